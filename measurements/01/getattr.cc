@@ -0,0 +1,47 @@
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "../utils.h"
+using namespace std;
+#define NUM_TRIALS 1000
+#define STALE_AFTER_SECONDS 4  // Longer than the kernel's attribute caching and the client's acregmin.
+
+// Measures the latency of a GETATTR that goes all the way to the server:
+// every trial stats a different file, created long enough before that no
+// cache still holds its attributes.
+int main(int argc, char **argv) {
+  const char* dir = argv[1];
+  for (int j = 0; j < NUM_TRIALS; ++j) {
+    string path = string(dir) + "/getattr" + to_string(j);
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+    if (fd == -1) {
+      perror("open");
+      return 1;
+    }
+    close(fd);
+  }
+  sleep(STALE_AFTER_SECONDS);
+
+  vector<double> trials(NUM_TRIALS, 0);
+  for (int j = 0; j < trials.size(); ++j) {
+    string path = string(dir) + "/getattr" + to_string(j);
+    struct stat sb;
+    long begin = getCurrentTime();  // start
+    stat(path.c_str(), &sb);
+    long end = getCurrentTime();    // end
+    trials[j] = (double)(end - begin);
+  }
+
+  for (int j = 0; j < NUM_TRIALS; ++j) {
+    unlink((string(dir) + "/getattr" + to_string(j)).c_str());
+  }
+  cout << "Latency for a getattr call: " << median(trials) << endl;
+  return 0;
+}
@@ -7,13 +7,17 @@ MTTR=0.1
 
 MAX=10000
 
+# Extra server flags, e.g. SERVER_ARGS=--wal to keep unstable writes and
+# the verifier across the restarts.
+SERVER_ARGS=${SERVER_ARGS:-}
+
 echo "Running server with availability of `bc <<< 'scale=2; ((1-0.1)/1)*100'`%"
 
 i=0
 while [ $i -lt $MAX ]
 do
   source $WORKING_DIR/setup-env-vars.sh
-  $WORKING_DIR/nfs_server.out &   # Launch the server
+  $WORKING_DIR/nfs_server.out $SERVER_ARGS &   # Launch the server
   sleep $MTBF
   kill -9 `pgrep nfs_server`
   sleep $MTTR
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "../utils.h"
+using namespace std;
+
+#define NUM_TRIALS 100
+#define BEGIN 1000
+#define END 1000000
+
+// Measures GETATTR latency as the export grows from BEGIN to END files.
+// Consecutive trials stat different files, so the result is not served from
+// the kernel's attribute cache.
+int main(int argc, char **argv) {
+  const char* dir = argv[1];
+  int files_created = 0;
+  int next_probe = 0;
+  for (int n = BEGIN; n <= END; n *= 10) {
+    // Grow the export up to n files.
+    for (; files_created < n; ++files_created) {
+      string path = string(dir) + "/f" + to_string(files_created);
+      int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+      if (fd == -1) {
+        perror("open");
+        return 1;
+      }
+      close(fd);
+    }
+
+    vector<double> trials(NUM_TRIALS, 0);
+    for (int j = 0; j < trials.size(); ++j) {
+      next_probe = (next_probe + 7919) % n;  // Hop around the export.
+      string path = string(dir) + "/f" + to_string(next_probe);
+      struct stat sb;
+      long begin = getCurrentTime();  // start
+      stat(path.c_str(), &sb);
+      long end = getCurrentTime();    // end
+      trials[j] = (double)(end - begin);
+    }
+    printf("%d,%0.6f\n", n, median(trials));
+  }
+  return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Compares sync and async server modes at 1, 8 and 64 concurrent clients.
+# Prints mode,workload,clients,ops_per_sec,failures.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+
+SECONDS_PER_RUN=10
+WORKLOADS="getattr read write lookup-read compound-read"
+CLIENTS="1 8 64"
+
+g++ -std=c++11 -O2 -I$WORKING_DIR $BENCH_DIR/server-throughput.cc \
+    $WORKING_DIR/nfs.pb.o $WORKING_DIR/nfs.grpc.pb.o \
+    `pkg-config --cflags --libs grpc++ grpc protobuf` -lpthread \
+    -o $BENCH_DIR/server-throughput.out || exit 1
+
+for mode in sync async
+do
+  $WORKING_DIR/nfs_server.out --mode=$mode > /dev/null &
+  sleep 1
+  for workload in $WORKLOADS
+  do
+    for clients in $CLIENTS
+    do
+      echo -n "$mode,"
+      $BENCH_DIR/server-throughput.out $workload $clients $SECONDS_PER_RUN
+    done
+  done
+  kill -9 `pgrep nfs_server`
+  sleep 1
+done
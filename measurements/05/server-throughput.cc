@@ -0,0 +1,146 @@
+// Drives the NFS server directly over gRPC, bypassing FUSE, so that server
+// side changes can be compared without the client in the way. Build it after
+// running make in nfs/ (see run-server-comparison.sh).
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <grpc++/grpc++.h>
+
+#include "nfs.grpc.pb.h"
+#include "../utils.h"
+using namespace std;
+
+#define SERVER "localhost:50051"
+#define IO_SIZE 4096
+
+// Creates /name at the server and returns its file handle.
+string createFile(nfs::NFS::Stub *stub, const string &name) {
+  grpc::ClientContext create_context;
+  nfs::CREATEargs createArgs;
+  nfs::CREATEres createRes;
+  createArgs.mutable_where()->mutable_dir()->set_data("/" + name);
+  stub->NFSPROC_CREATE(&create_context, createArgs, &createRes);
+
+  grpc::ClientContext lookup_context;
+  nfs::LOOKUPargs lookupArgs;
+  nfs::LOOKUPres lookupRes;
+  lookupArgs.mutable_what()->mutable_dir()->set_data("/" + name);
+  stub->NFSPROC_LOOKUP(&lookup_context, lookupArgs, &lookupRes);
+  return lookupRes.resok().object().data();
+}
+
+// Issues one RPC of the given workload, returns false if it failed. name is
+// the file fh is the handle of.
+bool issue(nfs::NFS::Stub *stub, const string &workload, const string &name, const string &fh, long i) {
+  grpc::ClientContext context;
+  grpc::Status status;
+  if (workload == "getattr") {
+    nfs::GETATTRargs args;
+    nfs::GETATTRres res;
+    args.mutable_object()->set_data(fh);
+    status = stub->NFSPROC_GETATTR(&context, args, &res);
+  } else if (workload == "read") {
+    nfs::READargs args;
+    nfs::READres res;
+    args.mutable_file()->set_data(fh);
+    args.set_offset((i % 256) * IO_SIZE);
+    args.set_count(IO_SIZE);
+    status = stub->NFSPROC_READ(&context, args, &res);
+  } else if (workload == "write" || workload == "shared-write") {
+    nfs::WRITEargs args;
+    nfs::WRITEres res;
+    args.mutable_file()->set_data(fh);
+    args.set_offset((i % 256) * IO_SIZE);
+    args.set_count(IO_SIZE);
+    args.set_stable(nfs::WRITEargs::DATA_SYNC);
+    args.set_data(string(IO_SIZE, 'a' + i % 26));
+    status = stub->NFSPROC_WRITE(&context, args, &res);
+  } else if (workload == "commit") {
+    // An unstable write made durable by its own COMMIT, as on close().
+    nfs::WRITEargs args;
+    nfs::WRITEres res;
+    args.mutable_file()->set_data(fh);
+    args.set_offset((i % 256) * IO_SIZE);
+    args.set_count(IO_SIZE);
+    args.set_stable(nfs::WRITEargs::UNSTABLE);
+    args.set_data(string(IO_SIZE, 'a' + i % 26));
+    status = stub->NFSPROC_WRITE(&context, args, &res);
+    if (!status.ok()) return false;
+
+    grpc::ClientContext commit_context;
+    nfs::COMMITargs commitArgs;
+    nfs::COMMITres commitRes;
+    commitArgs.mutable_file()->set_data(fh);
+    status = stub->NFSPROC_COMMIT(&commit_context, commitArgs, &commitRes);
+    return status.ok() && commitRes.has_resok();
+  } else if (workload == "lookup-read") {
+    // Opening a file and reading its first block, one RPC per step.
+    nfs::LOOKUPargs lookupArgs;
+    nfs::LOOKUPres lookupRes;
+    lookupArgs.mutable_what()->mutable_dir()->set_data("/" + name);
+    status = stub->NFSPROC_LOOKUP(&context, lookupArgs, &lookupRes);
+    if (!status.ok() || !lookupRes.has_resok()) return false;
+
+    grpc::ClientContext read_context;
+    nfs::READargs args;
+    nfs::READres res;
+    args.mutable_file()->set_data(lookupRes.resok().object().data());
+    args.set_count(IO_SIZE);
+    status = stub->NFSPROC_READ(&read_context, args, &res);
+  } else if (workload == "compound-read") {
+    // The same two steps in one COMPOUND.
+    nfs::COMPOUNDargs args;
+    nfs::COMPOUNDres res;
+    args.add_argarray()->mutable_lookup()->mutable_what()->mutable_dir()->set_data("/" + name);
+    args.add_argarray()->mutable_read()->set_count(IO_SIZE);
+    status = stub->NFSPROC_COMPOUND(&context, args, &res);
+    return status.ok() && res.ok();
+  } else {
+    return false;
+  }
+  return status.ok();
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    fprintf(stderr, "Usage: %s getattr|read|write|shared-write|commit|lookup-read|compound-read <clients> <seconds>\n", argv[0]);
+    return 1;
+  }
+  string workload = argv[1];
+  int num_clients = atoi(argv[2]);
+  int seconds = atoi(argv[3]);
+
+  atomic<long> ops(0), failures(0);
+  vector<thread> clients;
+  long begin = getCurrentTime();  // start
+  long deadline = begin + seconds * 1000000L;
+  for (int c = 0; c < num_clients; ++c) {
+    clients.push_back(thread([&, c]() {
+      // Every client gets its own channel, as separate mounts would.
+      grpc::ChannelArguments channel_args;
+      channel_args.SetInt("grpc.channel_id", c);
+      shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(SERVER, grpc::InsecureChannelCredentials(), channel_args);
+      unique_ptr<nfs::NFS::Stub> stub(nfs::NFS::NewStub(channel));
+      // shared-write and commit have all clients working on one file.
+      bool shared = (workload == "shared-write" || workload == "commit");
+      string name = shared ? "throughput-shared" : "throughput-" + to_string(c);
+      string fh = createFile(stub.get(), name);
+      for (long i = 0; getCurrentTime() < deadline; ++i) {
+        if (issue(stub.get(), workload, name, fh, i)) ++ops;
+        else ++failures;
+      }
+    }));
+  }
+  for (thread &client : clients) client.join();
+  long end = getCurrentTime();    // end
+
+  double ops_per_sec = (double) ops / ((end - begin) / 1000000.0);
+  printf("%s,%d,%0.2f,%ld\n", workload.c_str(), num_clients, ops_per_sec, (long) failures);
+  return 0;
+}
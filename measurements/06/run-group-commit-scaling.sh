@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Stable write IOPS against the number of concurrent clients, with group
+# commit disabled (a zero wait window), at its default window, and sharing
+# syncs across files with syncfs(). Uses the load generator of 05.
+# Prints config,workload,clients,ops_per_sec,failures.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+LOADGEN=$BENCH_DIR/../05/server-throughput.out
+
+SECONDS_PER_RUN=10
+WORKLOADS="shared-write commit write"
+CLIENTS="1 2 4 8 16 32 64"
+
+g++ -std=c++11 -O2 -I$WORKING_DIR $BENCH_DIR/../05/server-throughput.cc \
+    $WORKING_DIR/nfs.pb.o $WORKING_DIR/nfs.grpc.pb.o \
+    `pkg-config --cflags --libs grpc++ grpc protobuf` -lpthread \
+    -o $LOADGEN || exit 1
+
+run() {
+  config=$1
+  shift
+  $WORKING_DIR/nfs_server.out --mode=async "$@" > /dev/null &
+  sleep 1
+  for workload in $WORKLOADS
+  do
+    for clients in $CLIENTS
+    do
+      echo -n "$config,"
+      $LOADGEN $workload $clients $SECONDS_PER_RUN
+    done
+  done
+  kill -9 `pgrep nfs_server`
+  sleep 1
+}
+
+run no-wait --group-commit-wait-us=0
+run group-commit
+run group-commit-syncfs --group-commit-syncfs
@@ -0,0 +1,157 @@
+// Stress test for the server's buffering of UNSTABLE writes. Many writer
+// threads, each with its own channel, write random ranges into their own
+// regions of many shared files, committing now and then. At the end every
+// thread commits and reads its regions back, comparing them with a local
+// shadow copy. Prints threads,files,ops/s,mismatches; any mismatch is a bug.
+// Build it after running make in nfs/ (see run-optimizer-stress.sh).
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <grpc++/grpc++.h>
+
+#include "nfs.grpc.pb.h"
+#include "../utils.h"
+using namespace std;
+
+#define SERVER "localhost:50051"
+#define REGION_SIZE 65536     // Bytes of each file owned by one thread.
+#define MAX_WRITE_SIZE 8192
+#define FILES_PER_THREAD 8
+#define COMMIT_EVERY 64       // Writes between a thread's COMMITs.
+
+string createFile(nfs::NFS::Stub *stub, const string &name) {
+  grpc::ClientContext create_context;
+  nfs::CREATEargs createArgs;
+  nfs::CREATEres createRes;
+  createArgs.mutable_where()->mutable_dir()->set_data("/" + name);
+  stub->NFSPROC_CREATE(&create_context, createArgs, &createRes);
+
+  grpc::ClientContext lookup_context;
+  nfs::LOOKUPargs lookupArgs;
+  nfs::LOOKUPres lookupRes;
+  lookupArgs.mutable_what()->mutable_dir()->set_data("/" + name);
+  stub->NFSPROC_LOOKUP(&lookup_context, lookupArgs, &lookupRes);
+
+  // CREATE keeps an existing file, and the shadow copies start out as
+  // zeros, so empty what an earlier run left behind.
+  grpc::ClientContext setattr_context;
+  nfs::SETATTRargs setAttrArgs;
+  nfs::SETATTRres setAttrRes;
+  setAttrArgs.mutable_object()->set_data(lookupRes.resok().object().data());
+  setAttrArgs.mutable_new_attributes()->set_size(0);
+  stub->NFSPROC_SETATTR(&setattr_context, setAttrArgs, &setAttrRes);
+  return lookupRes.resok().object().data();
+}
+
+bool write(nfs::NFS::Stub *stub, const string &fh, size_t offset, const string &data) {
+  grpc::ClientContext context;
+  nfs::WRITEargs args;
+  nfs::WRITEres res;
+  args.mutable_file()->set_data(fh);
+  args.set_offset(offset);
+  args.set_count(data.size());
+  args.set_stable(nfs::WRITEargs::UNSTABLE);
+  args.set_data(data);
+  return stub->NFSPROC_WRITE(&context, args, &res).ok() && res.has_resok();
+}
+
+bool commit(nfs::NFS::Stub *stub, const string &fh) {
+  grpc::ClientContext context;
+  nfs::COMMITargs args;
+  nfs::COMMITres res;
+  args.mutable_file()->set_data(fh);
+  return stub->NFSPROC_COMMIT(&context, args, &res).ok() && res.has_resok();
+}
+
+bool read(nfs::NFS::Stub *stub, const string &fh, size_t offset, size_t count, string *data) {
+  grpc::ClientContext context;
+  nfs::READargs args;
+  nfs::READres res;
+  args.mutable_file()->set_data(fh);
+  args.set_offset(offset);
+  args.set_count(count);
+  if (!stub->NFSPROC_READ(&context, args, &res).ok() || !res.has_resok()) return false;
+  *data = res.resok().data();
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    fprintf(stderr, "Usage: %s <threads> <files> <seconds>\n", argv[0]);
+    return 1;
+  }
+  int num_threads = atoi(argv[1]);
+  int num_files = atoi(argv[2]);
+  int seconds = atoi(argv[3]);
+
+  // Files are created up front, so that threads agree on their handles.
+  vector<string> fhs;
+  {
+    unique_ptr<nfs::NFS::Stub> stub(nfs::NFS::NewStub(grpc::CreateChannel(SERVER, grpc::InsecureChannelCredentials())));
+    for (int f = 0; f < num_files; ++f) fhs.push_back(createFile(stub.get(), "stress-" + to_string(f)));
+  }
+
+  atomic<long> ops(0), mismatches(0);
+  vector<thread> threads;
+  long begin = getCurrentTime();  // start
+  long deadline = begin + seconds * 1000000L;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.push_back(thread([&, t]() {
+      grpc::ChannelArguments channel_args;
+      channel_args.SetInt("grpc.channel_id", t);
+      shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(SERVER, grpc::InsecureChannelCredentials(), channel_args);
+      unique_ptr<nfs::NFS::Stub> stub(nfs::NFS::NewStub(channel));
+      mt19937 rng(t);
+
+      // This thread owns bytes [t * REGION_SIZE, (t + 1) * REGION_SIZE) of
+      // each of its files; shadow holds what they should contain.
+      vector<int> files;
+      vector<string> shadow(FILES_PER_THREAD);
+      for (int i = 0; i < FILES_PER_THREAD; ++i) files.push_back((t * 7 + i) % num_files);
+      size_t region = (size_t) t * REGION_SIZE;
+
+      for (long i = 0; getCurrentTime() < deadline; ++i) {
+	int slot = rng() % FILES_PER_THREAD;
+	size_t count = 1 + rng() % MAX_WRITE_SIZE;
+	size_t offset = rng() % (REGION_SIZE - count);
+	string data(count, 'a' + rng() % 26);
+	data[0] = 'A' + t % 26;  // Tells whose data ended up where.
+	if (!write(stub.get(), fhs[files[slot]], region + offset, data)) {
+	  ++mismatches;
+	  continue;
+	}
+	if (shadow[slot].size() < offset + count) shadow[slot].resize(offset + count, '\0');
+	shadow[slot].replace(offset, count, data);
+	if (i % COMMIT_EVERY == 0) commit(stub.get(), fhs[files[slot]]);
+	++ops;
+      }
+
+      for (int slot = 0; slot < FILES_PER_THREAD; ++slot) {
+	const string &fh = fhs[files[slot]];
+	string data;
+	if (shadow[slot].empty()) continue;
+	if (!commit(stub.get(), fh) || !read(stub.get(), fh, region, shadow[slot].size(), &data)) {
+	  ++mismatches;
+	  continue;
+	}
+	data.resize(shadow[slot].size(), '\0');  // Holes read back short.
+	if (data != shadow[slot]) {
+	  fprintf(stderr, "thread %d: file %s differs\n", t, fh.c_str());
+	  ++mismatches;
+	}
+      }
+    }));
+  }
+  for (thread &writer : threads) writer.join();
+  long end = getCurrentTime();    // end
+
+  double ops_per_sec = (double) ops / ((end - begin) / 1000000.0);
+  printf("%d,%d,%0.2f,%ld\n", num_threads, num_files, ops_per_sec, (long) mismatches);
+  return mismatches == 0 ? 0 : 1;
+}
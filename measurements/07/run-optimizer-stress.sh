@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Runs the unstable write stress test against the server in async mode,
+# with and without the write-ahead log, at growing numbers of writers.
+# Prints config,threads,files,ops_per_sec,mismatches and fails on any
+# mismatch.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+
+SECONDS_PER_RUN=10
+FILES=64
+THREADS="1 8 32 128"
+
+g++ -std=c++11 -O2 -I$WORKING_DIR $BENCH_DIR/optimizer-stress.cc \
+    $WORKING_DIR/nfs.pb.o $WORKING_DIR/nfs.grpc.pb.o \
+    `pkg-config --cflags --libs grpc++ grpc protobuf` -lpthread \
+    -o $BENCH_DIR/optimizer-stress.out || exit 1
+
+failed=0
+for config in plain wal
+do
+  if [ $config == wal ]; then args=--wal; else args=; fi
+  $WORKING_DIR/nfs_server.out --mode=async $args > /dev/null &
+  sleep 1
+  for threads in $THREADS
+  do
+    echo -n "$config,"
+    $BENCH_DIR/optimizer-stress.out $threads $FILES $SECONDS_PER_RUN || failed=1
+  done
+  kill -9 `pgrep nfs_server`
+  sleep 1
+done
+exit $failed
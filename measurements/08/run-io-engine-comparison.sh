@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Compares the blocking and io_uring I/O engines of the async server as the
+# number of concurrent clients grows. The server must be built with liburing
+# for the io_uring runs to differ. Reads only reach the disk if the page
+# cache is dropped first, which needs root.
+# Prints engine,workload,clients,ops_per_sec,failures.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`/../05
+
+SECONDS_PER_RUN=10
+WORKLOADS="read commit"
+CLIENTS="1 16 64 256"
+
+g++ -std=c++11 -O2 -I$WORKING_DIR $BENCH_DIR/server-throughput.cc \
+    $WORKING_DIR/nfs.pb.o $WORKING_DIR/nfs.grpc.pb.o \
+    `pkg-config --cflags --libs grpc++ grpc protobuf` -lpthread \
+    -o $BENCH_DIR/server-throughput.out || exit 1
+
+for engine in blocking io_uring
+do
+  $WORKING_DIR/nfs_server.out --mode=async --io-engine=$engine > /dev/null &
+  sleep 1
+  for workload in $WORKLOADS
+  do
+    for clients in $CLIENTS
+    do
+      [ `id -u` -eq 0 ] && sync && echo 3 > /proc/sys/vm/drop_caches
+      echo -n "$engine,"
+      $BENCH_DIR/server-throughput.out $workload $clients $SECONDS_PER_RUN
+    done
+  done
+  kill -9 `pgrep nfs_server`
+  sleep 1
+done
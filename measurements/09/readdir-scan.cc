@@ -0,0 +1,97 @@
+// Lists a directory of many files at the server with READDIR and
+// READDIRPLUS, counting the RPCs and streamed messages a full scan takes.
+// The directory is created and filled first if it does not exist yet.
+// Prints rpc,entries,rpcs,messages,milliseconds.
+// Build it after running make in nfs/ (see run-readdir-scan.sh).
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <grpc++/grpc++.h>
+
+#include "nfs.grpc.pb.h"
+#include "../utils.h"
+using namespace std;
+
+#define SERVER "localhost:50051"
+
+string lookup(nfs::NFS::Stub *stub, const string &path) {
+  grpc::ClientContext context;
+  nfs::LOOKUPargs args;
+  nfs::LOOKUPres res;
+  args.mutable_what()->mutable_dir()->set_data(path);
+  stub->NFSPROC_LOOKUP(&context, args, &res);
+  return res.has_resok() ? res.resok().object().data() : "";
+}
+
+void populate(nfs::NFS::Stub *stub, const string &dir, int num_entries) {
+  grpc::ClientContext mkdir_context;
+  nfs::MKDIRargs mkdirArgs;
+  nfs::MKDIRres mkdirRes;
+  mkdirArgs.mutable_where()->mutable_dir()->set_data(dir);
+  mkdirArgs.mutable_attributes()->mutable_mode()->set_mode(0755);
+  stub->NFSPROC_MKDIR(&mkdir_context, mkdirArgs, &mkdirRes);
+
+  for (int i = 0; i < num_entries; ++i) {
+    grpc::ClientContext context;
+    nfs::CREATEargs args;
+    nfs::CREATEres res;
+    args.mutable_where()->mutable_dir()->set_data(dir + "/entry-" + to_string(i));
+    stub->NFSPROC_CREATE(&context, args, &res);
+  }
+}
+
+// Lists the directory, resuming from the last cookie whenever a stream
+// breaks off. Returns the number of entries seen.
+long scan(nfs::NFS::Stub *stub, const string &fh, bool plus, int *rpcs, int *messages) {
+  nfs::READDIRargs args;
+  args.mutable_dir()->set_data(fh);
+  long entries = 0;
+  bool eof = false;
+  *rpcs = 0;
+  *messages = 0;
+  while (!eof && *rpcs < 1000) {
+    grpc::ClientContext context;
+    ++*rpcs;
+    unique_ptr<grpc::ClientReader<nfs::READDIRres>> reader(plus ? stub->NFSPROC_READDIRPLUS(&context, args)
+							   : stub->NFSPROC_READDIR(&context, args));
+    nfs::READDIRres res;
+    while (reader->Read(&res)) {
+      ++*messages;
+      if (!res.has_resok()) return -1;
+      for (const nfs::entry &entry : res.resok().entries()) {
+	args.set_cookie(entry.cookie());
+	++entries;
+      }
+      eof = res.resok().eof();
+    }
+    reader->Finish();
+  }
+  return entries;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <entries>\n", argv[0]);
+    return 1;
+  }
+  int num_entries = atoi(argv[1]);
+  unique_ptr<nfs::NFS::Stub> stub(nfs::NFS::NewStub(grpc::CreateChannel(SERVER, grpc::InsecureChannelCredentials())));
+
+  string dir = "/readdir-" + to_string(num_entries);
+  string fh = lookup(stub.get(), dir);
+  if (fh.empty()) {
+    populate(stub.get(), dir, num_entries);
+    fh = lookup(stub.get(), dir);
+  }
+
+  for (int plus = 0; plus <= 1; ++plus) {
+    int rpcs, messages;
+    long begin = getCurrentTime();  // start
+    long entries = scan(stub.get(), fh, plus, &rpcs, &messages);
+    long end = getCurrentTime();    // end
+    printf("%s,%ld,%d,%d,%0.2f\n", plus ? "readdirplus" : "readdir", entries, rpcs, messages,
+	   (end - begin) / 1000.0);
+  }
+  return 0;
+}
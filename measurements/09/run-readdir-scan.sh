@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Times full READDIR and READDIRPLUS scans of directories of growing size.
+# Prints rpc,entries,rpcs,messages,milliseconds.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+
+g++ -std=c++11 -O2 -I$WORKING_DIR $BENCH_DIR/readdir-scan.cc \
+    $WORKING_DIR/nfs.pb.o $WORKING_DIR/nfs.grpc.pb.o \
+    `pkg-config --cflags --libs grpc++ grpc protobuf` -lpthread \
+    -o $BENCH_DIR/readdir-scan.out || exit 1
+
+$WORKING_DIR/nfs_server.out > /dev/null &
+sleep 1
+for entries in 100 10000 100000
+do
+  $BENCH_DIR/readdir-scan.out $entries
+done
+kill -9 `pgrep nfs_server`
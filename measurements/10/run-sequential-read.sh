@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Cold sequential reads with small READs, with and without the server's
+# block cache and its read-ahead. Caches are dropped before every run, so
+# it needs root for the numbers to mean anything.
+# Prints read_cache_mb,read_size,MB,MB_per_sec.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+
+FILE_MB=1024
+READ_SIZES="4096 16384 65536"
+
+g++ -std=c++11 -O2 -I$WORKING_DIR $BENCH_DIR/sequential-read.cc \
+    $WORKING_DIR/nfs.pb.o $WORKING_DIR/nfs.grpc.pb.o \
+    `pkg-config --cflags --libs grpc++ grpc protobuf` -lpthread \
+    -o $BENCH_DIR/sequential-read.out || exit 1
+
+for cache_mb in 0 256
+do
+  for read_size in $READ_SIZES
+  do
+    sync
+    [ `id -u` -eq 0 ] && echo 3 > /proc/sys/vm/drop_caches
+    $WORKING_DIR/nfs_server.out --read-cache-mb=$cache_mb > /dev/null &
+    sleep 1
+    echo -n "$cache_mb,"
+    $BENCH_DIR/sequential-read.out $read_size $FILE_MB
+    kill -9 `pgrep nfs_server`
+    sleep 1
+  done
+done
@@ -0,0 +1,89 @@
+// Reads a file at the server from start to end with unary READs of a given
+// size, one at a time, as a client reading sequentially would. The file is
+// created first if it does not exist yet. Prints read_size,MB,MB_per_sec.
+// Build it after running make in nfs/ (see run-sequential-read.sh).
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <grpc++/grpc++.h>
+
+#include "nfs.grpc.pb.h"
+#include "../utils.h"
+using namespace std;
+
+#define SERVER "localhost:50051"
+#define FILE_NAME "/sequential-read"
+#define WRITE_SIZE (1024 * 1024)
+
+string lookup(nfs::NFS::Stub *stub, const string &path) {
+  grpc::ClientContext context;
+  nfs::LOOKUPargs args;
+  nfs::LOOKUPres res;
+  args.mutable_what()->mutable_dir()->set_data(path);
+  stub->NFSPROC_LOOKUP(&context, args, &res);
+  return res.has_resok() ? res.resok().object().data() : "";
+}
+
+string populate(nfs::NFS::Stub *stub, long size) {
+  grpc::ClientContext create_context;
+  nfs::CREATEargs createArgs;
+  nfs::CREATEres createRes;
+  createArgs.mutable_where()->mutable_dir()->set_data(FILE_NAME);
+  stub->NFSPROC_CREATE(&create_context, createArgs, &createRes);
+  string fh = lookup(stub, FILE_NAME);
+
+  string data(WRITE_SIZE, 's');
+  for (long offset = 0; offset < size; offset += WRITE_SIZE) {
+    grpc::ClientContext context;
+    nfs::WRITEargs args;
+    nfs::WRITEres res;
+    args.mutable_file()->set_data(fh);
+    args.set_offset(offset);
+    args.set_count(WRITE_SIZE);
+    args.set_stable(nfs::WRITEargs::DATA_SYNC);
+    args.set_data(data);
+    stub->NFSPROC_WRITE(&context, args, &res);
+  }
+  return fh;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <read size> <file MB>\n", argv[0]);
+    return 1;
+  }
+  long read_size = atol(argv[1]);
+  long file_mb = atol(argv[2]);
+  long size = file_mb * 1024 * 1024;
+
+  shared_ptr<grpc::Channel> channel = grpc::CreateChannel(SERVER, grpc::InsecureChannelCredentials());
+  unique_ptr<nfs::NFS::Stub> stub(nfs::NFS::NewStub(channel));
+  string fh = lookup(stub.get(), FILE_NAME);
+  if (fh.empty()) {
+    fh = populate(stub.get(), size);
+    fprintf(stderr, "Created %s, drop the caches and run again for a cold read\n", FILE_NAME);
+  }
+
+  long bytes = 0;
+  long begin = getCurrentTime();  // start
+  for (long offset = 0; offset < size; offset += read_size) {
+    grpc::ClientContext context;
+    nfs::READargs args;
+    nfs::READres res;
+    args.mutable_file()->set_data(fh);
+    args.set_offset(offset);
+    args.set_count(read_size);
+    grpc::Status status = stub->NFSPROC_READ(&context, args, &res);
+    if (!status.ok() || !res.has_resok()) {
+      fprintf(stderr, "READ at %ld failed\n", offset);
+      return 1;
+    }
+    bytes += res.resok().count();
+  }
+  long end = getCurrentTime();    // end
+
+  double mb = bytes / (1024.0 * 1024.0);
+  printf("%ld,%0.0f,%0.2f\n", read_size, mb, mb / ((end - begin) / 1000000.0));
+  return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Stat throughput on a mount with the client's attribute cache turned off
+# (noac) and with its defaults. The kernel's own attribute cache is turned
+# off in both, so that every stat reaches the client. Prints
+# mount_options,files,threads,stats_per_sec,median_us.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+MOUNT_DIR=/tmp/nfs-stat-storm
+
+FILES=2000
+THREADS=8
+DURATION=10
+
+g++ -std=c++11 -O2 $BENCH_DIR/stat-storm.cc -lpthread -o $BENCH_DIR/stat-storm.out || exit 1
+
+mkdir -p $MOUNT_DIR
+$WORKING_DIR/nfs_server.out > /dev/null &
+sleep 1
+for options in noac ""
+do
+  $WORKING_DIR/nfs_client.out $MOUNT_DIR -o attr_timeout=0${options:+,$options}
+  sleep 1
+  echo -n "${options:-default},"
+  $BENCH_DIR/stat-storm.out $MOUNT_DIR $FILES $THREADS $DURATION
+  fusermount -u $MOUNT_DIR
+done
+kill -9 `pgrep nfs_server`
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "../utils.h"
+using namespace std;
+
+#define STALE_AFTER_SECONDS 2  // Longer than the kernel's attribute caching.
+
+// Stats a set of files over and over from several threads, the way make -j
+// checks the timestamps of sources and headers. Prints
+// files,threads,stats_per_sec,median_us.
+int main(int argc, char **argv) {
+  if (argc != 5) {
+    fprintf(stderr, "Usage: %s DIR FILES THREADS SECONDS\n", argv[0]);
+    return 1;
+  }
+  const char* dir = argv[1];
+  int files = atoi(argv[2]);
+  int threads = atoi(argv[3]);
+  int seconds = atoi(argv[4]);
+  for (int j = 0; j < files; ++j) {
+    string path = string(dir) + "/storm" + to_string(j);
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+    if (fd == -1) {
+      perror("open");
+      return 1;
+    }
+    close(fd);
+  }
+  sleep(STALE_AFTER_SECONDS);
+
+  long deadline = getCurrentTime() + seconds * 1000000L;
+  vector<vector<double>> trials(threads);
+  vector<thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      unsigned int seed = t;
+      while (getCurrentTime() < deadline) {
+	string path = string(dir) + "/storm" + to_string(rand_r(&seed) % files);
+	struct stat sb;
+	long begin = getCurrentTime();  // start
+	stat(path.c_str(), &sb);
+	long end = getCurrentTime();    // end
+	trials[t].push_back((double)(end - begin));
+      }
+    });
+  }
+  vector<double> all;
+  for (int t = 0; t < threads; ++t) {
+    workers[t].join();
+    all.insert(all.end(), trials[t].begin(), trials[t].end());
+  }
+
+  for (int j = 0; j < files; ++j) {
+    unlink((string(dir) + "/storm" + to_string(j)).c_str());
+  }
+  printf("%d,%d,%0.1f,%0.1f\n", files, threads, all.size() / (double) seconds, median(all));
+  return 0;
+}
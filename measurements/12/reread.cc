@@ -0,0 +1,53 @@
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "../utils.h"
+using namespace std;
+
+#define NUM_TRIALS 200
+#define READ_SIZE 65536
+
+// Opens, reads through and closes the same file over and over, the way
+// jobs on a compute node load a shared config or dataset. Prints
+// file_kb,median_us,MB_per_sec over all trials.
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s DIR FILE_KB\n", argv[0]);
+    return 1;
+  }
+  string path = string(argv[1]) + "/reread";
+  long size = atol(argv[2]) * 1024;
+  vector<char> buf(READ_SIZE, 'r');
+  int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd == -1) {
+    perror("open");
+    return 1;
+  }
+  for (long done = 0; done < size; done += READ_SIZE) {
+    write(fd, buf.data(), min((long) READ_SIZE, size - done));
+  }
+  close(fd);
+
+  vector<double> trials(NUM_TRIALS, 0);
+  double total = 0;
+  for (int j = 0; j < NUM_TRIALS; ++j) {
+    long begin = getCurrentTime();  // start
+    fd = open(path.c_str(), O_RDONLY);
+    while (read(fd, buf.data(), READ_SIZE) > 0);
+    close(fd);
+    long end = getCurrentTime();    // end
+    trials[j] = (double)(end - begin);
+    total += trials[j];
+  }
+
+  unlink(path.c_str());
+  printf("%ld,%0.1f,%0.1f\n", size / 1024, median(trials), (double) size * NUM_TRIALS / total);
+  return 0;
+}
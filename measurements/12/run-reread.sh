@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Repeated open-read-close of one file, with the client's data cache turned
+# off (cache_mb=0) and with its default size. Prints cache_mb,file_kb,
+# median_us,MB_per_sec.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+MOUNT_DIR=/tmp/nfs-reread
+
+FILE_KBS="4 256 8192"
+
+g++ -std=c++11 -O2 $BENCH_DIR/reread.cc -o $BENCH_DIR/reread.out || exit 1
+
+mkdir -p $MOUNT_DIR
+$WORKING_DIR/nfs_server.out > /dev/null &
+sleep 1
+for cache_mb in 0 ""
+do
+  $WORKING_DIR/nfs_client.out $MOUNT_DIR ${cache_mb:+-o cache_mb=$cache_mb}
+  sleep 1
+  for file_kb in $FILE_KBS
+  do
+    echo -n "${cache_mb:-default},"
+    $BENCH_DIR/reread.out $MOUNT_DIR $file_kb
+  done
+  fusermount -u $MOUNT_DIR
+done
+kill -9 `pgrep nfs_server`
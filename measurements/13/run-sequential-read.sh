@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Cold sequential read of one file through a single-threaded mount, with
+# the client's read-ahead turned off (readahead_kb=0) and at its default.
+# As root, loopback gets 1 ms of round trip with netem, so that the read is
+# bound by latency the way it is across a network.
+# Prints readahead_kb,file_mb,MB_per_sec.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+MOUNT_DIR=/tmp/nfs-sequential-read
+
+FILE_MB=256
+
+g++ -std=c++11 -O2 $BENCH_DIR/sequential-read.cc -o $BENCH_DIR/sequential-read.out || exit 1
+
+mkdir -p $MOUNT_DIR
+$WORKING_DIR/nfs_server.out > /dev/null &
+sleep 1
+$WORKING_DIR/nfs_client.out $MOUNT_DIR -s
+sleep 1
+$BENCH_DIR/sequential-read.out $MOUNT_DIR $FILE_MB > /dev/null
+fusermount -u $MOUNT_DIR
+
+[ `id -u` -eq 0 ] && tc qdisc add dev lo root netem delay 500us
+for readahead_kb in 0 ""
+do
+  $WORKING_DIR/nfs_client.out $MOUNT_DIR -s ${readahead_kb:+-o readahead_kb=$readahead_kb}
+  sleep 1
+  echo -n "${readahead_kb:-default},"
+  $BENCH_DIR/sequential-read.out $MOUNT_DIR $FILE_MB
+  fusermount -u $MOUNT_DIR
+done
+[ `id -u` -eq 0 ] && tc qdisc del dev lo root
+kill -9 `pgrep nfs_server`
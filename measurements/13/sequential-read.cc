@@ -0,0 +1,51 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "../utils.h"
+using namespace std;
+
+#define READ_SIZE 131072
+
+// Reads a file through the mount from start to end, as cat or cp would. The
+// file is created first if it does not exist yet; remount before reading it
+// so that the client caches nothing of it. Prints file_mb,MB_per_sec.
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s DIR FILE_MB\n", argv[0]);
+    return 1;
+  }
+  string path = string(argv[1]) + "/sequential-read";
+  long size = atol(argv[2]) * 1024 * 1024;
+  vector<char> buf(READ_SIZE, 's');
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || st.st_size != size) {
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) {
+      perror("open");
+      return 1;
+    }
+    for (long done = 0; done < size; done += READ_SIZE) {
+      write(fd, buf.data(), READ_SIZE);
+    }
+    close(fd);
+    fprintf(stderr, "Created %s, remount and run again for a cold read\n", path.c_str());
+  }
+
+  long bytes = 0;
+  long begin = getCurrentTime();  // start
+  int fd = open(path.c_str(), O_RDONLY);
+  ssize_t res;
+  while ((res = read(fd, buf.data(), READ_SIZE)) > 0) bytes += res;
+  close(fd);
+  long end = getCurrentTime();    // end
+
+  double mb = bytes / (1024.0 * 1024.0);
+  printf("%0.0f,%0.1f\n", mb, mb / ((end - begin) / 1000000.0));
+  return 0;
+}
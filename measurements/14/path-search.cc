@@ -0,0 +1,76 @@
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "../utils.h"
+using namespace std;
+
+#define STALE_AFTER_SECONDS 2  // Longer than the kernel's attribute caching.
+
+// Looks commands up along a PATH of several directories from several
+// threads, the way a shell or a compiler's include search does: every
+// directory but the last misses. Prints dirs,threads,searches_per_sec,median_us.
+int main(int argc, char **argv) {
+  if (argc != 6) {
+    fprintf(stderr, "Usage: %s DIR DIRS NAMES THREADS SECONDS\n", argv[0]);
+    return 1;
+  }
+  const char* dir = argv[1];
+  int dirs = atoi(argv[2]);
+  int names = atoi(argv[3]);
+  int threads = atoi(argv[4]);
+  int seconds = atoi(argv[5]);
+  for (int d = 0; d < dirs; ++d) {
+    mkdir((string(dir) + "/bin" + to_string(d)).c_str(), 0755);
+  }
+  for (int j = 0; j < names; ++j) {
+    string path = string(dir) + "/bin" + to_string(dirs - 1) + "/cmd" + to_string(j);
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0755);
+    if (fd == -1) {
+      perror("open");
+      return 1;
+    }
+    close(fd);
+  }
+  sleep(STALE_AFTER_SECONDS);
+
+  long deadline = getCurrentTime() + seconds * 1000000L;
+  vector<vector<double>> trials(threads);
+  vector<thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      unsigned int seed = t;
+      while (getCurrentTime() < deadline) {
+	string name = "/cmd" + to_string(rand_r(&seed) % names);
+	long begin = getCurrentTime();  // start
+	for (int d = 0; d < dirs; ++d) {
+	  struct stat sb;
+	  if (stat((string(dir) + "/bin" + to_string(d) + name).c_str(), &sb) == 0) break;
+	}
+	long end = getCurrentTime();    // end
+	trials[t].push_back((double)(end - begin));
+      }
+    });
+  }
+  vector<double> all;
+  for (int t = 0; t < threads; ++t) {
+    workers[t].join();
+    all.insert(all.end(), trials[t].begin(), trials[t].end());
+  }
+
+  for (int j = 0; j < names; ++j) {
+    unlink((string(dir) + "/bin" + to_string(dirs - 1) + "/cmd" + to_string(j)).c_str());
+  }
+  for (int d = 0; d < dirs; ++d) {
+    rmdir((string(dir) + "/bin" + to_string(d)).c_str());
+  }
+  printf("%d,%d,%0.1f,%0.1f\n", dirs, threads, all.size() / (double) seconds, median(all));
+  return 0;
+}
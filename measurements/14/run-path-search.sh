@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# PATH-style lookups, most of which miss, on a single-threaded mount that
+# asks the server about every missing path (-s, negttl=0, as the client
+# used to run), on a multithreaded one that still does, and on a
+# multithreaded one with the client's defaults. The kernel's own attribute
+# cache is turned off, so that every stat reaches the client. Prints
+# mount_options,dirs,threads,searches_per_sec,median_us.
+
+WORKING_DIR=~/Development/projects/cs739-p2/nfs
+BENCH_DIR=`dirname $0`
+MOUNT_DIR=/tmp/nfs-path-search
+
+DIRS=6
+NAMES=100
+THREADS=8
+DURATION=10
+
+g++ -std=c++11 -O2 $BENCH_DIR/path-search.cc -lpthread -o $BENCH_DIR/path-search.out || exit 1
+
+mkdir -p $MOUNT_DIR
+$WORKING_DIR/nfs_server.out > /dev/null &
+sleep 1
+for options in "-s -o negttl=0" "-o negttl=0" ""
+do
+  $WORKING_DIR/nfs_client.out $MOUNT_DIR -o attr_timeout=0 $options
+  sleep 1
+  echo -n "${options:-default},"
+  $BENCH_DIR/path-search.out $MOUNT_DIR $DIRS $NAMES $THREADS $DURATION
+  fusermount -u $MOUNT_DIR
+done
+kill -9 `pgrep nfs_server`
@@ -0,0 +1,293 @@
+#ifndef _NFS_CLIENT_BLOCK_CACHE_H_
+#define _NFS_CLIENT_BLOCK_CACHE_H_
+
+#include <algorithm>
+#include <list>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+#define CLIENT_BLOCK_SIZE 65536          // Unit of caching; reads are widened to whole blocks.
+#define CLIENT_CACHE_DEFAULT_MB 64       // Default -o cache_mb; 0 turns the cache off.
+
+// What tells one version of a file's contents from the next: if any of it
+// differs from what the server reports, someone else changed the file.
+struct FileVersion {
+  FileVersion()
+    : size(0), mtime_ns(0), ctime_ns(0) {
+  }
+
+  bool operator==(const FileVersion &other) const {
+    return size == other.size && mtime_ns == other.mtime_ns && ctime_ns == other.ctime_ns;
+  }
+
+  uint64_t size;
+  int64_t mtime_ns;
+  int64_t ctime_ns;
+};
+
+// Caches blocks of file data in the client, by file handle, within a bound
+// on memory, evicting the least recently used blocks past it.
+//
+// Cached data follows close-to-open consistency: a file's blocks are valid
+// for the version of the file they were read at, and are only checked
+// against the server when the file is opened (see revalidate()). The
+// client's own writes and truncations go to the blocks they touch, and
+// once the server has them, setVersion() makes their result the version
+// the blocks are valid for.
+//
+// Thread-safe, although keeping the blocks of a file in step with the
+// client's writes to it is up to the client.
+class ClientBlockCache {
+ public:
+  ClientBlockCache()
+    : capacity_(CLIENT_CACHE_DEFAULT_MB * 1024L * 1024L), bytes_(0) {
+    pthread_mutex_init(&mutex, nullptr);
+  }
+
+  // Must be called before the cache is used.
+  void setCapacity(size_t capacity_bytes) {
+    capacity_ = capacity_bytes;
+    evict();
+  }
+
+  bool enabled() const { return capacity_ > 0; }
+
+  size_t bytes() {
+    pthread_mutex_lock(&mutex);
+    size_t bytes = bytes_;
+    pthread_mutex_unlock(&mutex);
+    return bytes;
+  }
+
+  // Copies count bytes at offset of the file fh into buf if all of them are
+  // cached. Returns the number of bytes copied, fewer at the end of the
+  // file, or -1 if a block is missing.
+  long read(const std::string &fh, char *buf, size_t count, size_t offset) {
+    pthread_mutex_lock(&mutex);
+    // Find them all first, so that a miss leaves the LRU order alone.
+    std::vector<std::list<Block>::iterator> blocks;
+    bool hit = findBlocks(fh, count, offset, &blocks);
+    size_t done = 0;
+    if (hit) {
+      for (std::list<Block>::iterator block : blocks) {
+	lru_.splice(lru_.begin(), lru_, block);
+	size_t start = (offset + done) % CLIENT_BLOCK_SIZE;
+	if (start >= block->data.size()) break;
+	size_t n = std::min(block->data.size() - start, count - done);
+	memcpy(buf + done, block->data.data() + start, n);
+	done += n;
+      }
+    }
+    pthread_mutex_unlock(&mutex);
+    return hit ? (long) done : -1;
+  }
+
+  bool contains(const std::string &fh, uint64_t index) {
+    pthread_mutex_lock(&mutex);
+    auto file = files_.find(fh);
+    bool found = file != files_.end() && file->second.blocks.count(index) > 0;
+    pthread_mutex_unlock(&mutex);
+    return found;
+  }
+
+  // Caches size bytes of the file fh read from the server at offset, a
+  // multiple of CLIENT_BLOCK_SIZE; eof if the file ends there. A partial
+  // last block is only kept if it is the end of the file.
+  void fill(const std::string &fh, const char *data, size_t size, size_t offset, bool eof) {
+    if (!enabled()) return;
+    pthread_mutex_lock(&mutex);
+    File &file = files_[fh];
+    for (size_t done = 0; done < size || (eof && done == size); done += CLIENT_BLOCK_SIZE) {
+      size_t n = std::min(size - done, (size_t) CLIENT_BLOCK_SIZE);
+      if (n < CLIENT_BLOCK_SIZE && !eof) break;
+      uint64_t index = (offset + done) / CLIENT_BLOCK_SIZE;
+      put(fh, &file, index, std::string(data + done, n));
+      if (n < CLIENT_BLOCK_SIZE) break;
+    }
+    evict();
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // Applies a write by this client to the cached blocks it touches.
+  void write(const std::string &fh, const char *data, size_t size, size_t offset) {
+    pthread_mutex_lock(&mutex);
+    auto file = files_.find(fh);
+    if (file == files_.end()) {
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    grow(&file->second, offset + size);
+    for (size_t done = 0; done < size; ) {
+      size_t pos = offset + done;
+      size_t start = pos % CLIENT_BLOCK_SIZE;
+      size_t n = std::min(size - done, CLIENT_BLOCK_SIZE - start);
+      auto block = file->second.blocks.find(pos / CLIENT_BLOCK_SIZE);
+      if (block != file->second.blocks.end()) {
+	std::string &block_data = block->second->data;
+	if (block_data.size() < start + n) resize(&file->second, block->second, start + n);
+	memcpy(&block_data[start], data + done, n);
+      }
+      done += n;
+    }
+    evict();
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // Cuts or extends the cached file fh to size, as a truncate by this client.
+  void truncate(const std::string &fh, size_t size) {
+    pthread_mutex_lock(&mutex);
+    auto file = files_.find(fh);
+    if (file == files_.end()) {
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    std::vector<uint64_t> dropped;
+    for (auto &block : file->second.blocks) {
+      size_t start = block.first * CLIENT_BLOCK_SIZE;
+      if (start >= size) dropped.push_back(block.first);
+      else if (block.second->data.size() > size - start) resize(&file->second, block.second, size - start);
+    }
+    for (uint64_t index : dropped) drop(&file->second, index);
+    grow(&file->second, size);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // Drops the blocks of the file fh unless they are of this version, and
+  // makes the blocks read from now on valid for it. Called when the file is
+  // opened. Returns false if blocks were dropped.
+  bool revalidate(const std::string &fh, const FileVersion &version) {
+    pthread_mutex_lock(&mutex);
+    auto file = files_.find(fh);
+    bool valid = file == files_.end() || file->second.blocks.empty() || file->second.version == version;
+    if (!valid) dropFile(fh);
+    if (enabled()) files_[fh].version = version;
+    pthread_mutex_unlock(&mutex);
+    return valid;
+  }
+
+  // Makes the cached blocks of the file fh valid for version, which the
+  // server reported after taking changes this client has already applied.
+  void setVersion(const std::string &fh, const FileVersion &version) {
+    pthread_mutex_lock(&mutex);
+    auto file = files_.find(fh);
+    if (file != files_.end()) file->second.version = version;
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void invalidate(const std::string &fh) {
+    pthread_mutex_lock(&mutex);
+    dropFile(fh);
+    pthread_mutex_unlock(&mutex);
+  }
+
+ private:
+  // A block of a file: CLIENT_BLOCK_SIZE bytes at a multiple of
+  // CLIENT_BLOCK_SIZE, fewer only if the file ends within it.
+  struct Block {
+    std::string fh;
+    uint64_t index;
+    std::string data;
+  };
+
+  struct File {
+    File()
+      : end_block(-1) {
+    }
+
+    FileVersion version;
+    std::unordered_map<uint64_t, std::list<Block>::iterator> blocks;
+    int64_t end_block;  // The cached block the file ends within, or -1.
+  };
+
+  // Finds the blocks covering count bytes at offset of the file fh, up to
+  // the one the file ends within. Returns false if one is missing.
+  bool findBlocks(const std::string &fh, size_t count, size_t offset,
+		  std::vector<std::list<Block>::iterator> *blocks) {
+    auto file = files_.find(fh);
+    if (file == files_.end()) return false;
+    for (size_t pos = offset; pos < offset + count; pos = (pos / CLIENT_BLOCK_SIZE + 1) * CLIENT_BLOCK_SIZE) {
+      auto block = file->second.blocks.find(pos / CLIENT_BLOCK_SIZE);
+      if (block == file->second.blocks.end()) return false;
+      blocks->push_back(block->second);
+      if (block->second->data.size() < CLIENT_BLOCK_SIZE) break;  // The file ends here.
+    }
+    return true;
+  }
+
+  void put(const std::string &fh, File *file, uint64_t index, std::string data) {
+    auto block = file->blocks.find(index);
+    if (block == file->blocks.end()) {
+      lru_.push_front(Block{fh, index, std::string()});
+      block = file->blocks.insert(std::make_pair(index, lru_.begin())).first;
+    } else {
+      lru_.splice(lru_.begin(), lru_, block->second);
+    }
+    bytes_ -= block->second->data.size();
+    block->second->data.swap(data);
+    bytes_ += block->second->data.size();
+    noteLength(file, block->second);
+  }
+
+  void resize(File *file, std::list<Block>::iterator block, size_t size) {
+    bytes_ -= block->data.size();
+    block->data.resize(size, '\0');
+    bytes_ += block->data.size();
+    noteLength(file, block);
+  }
+
+  void noteLength(File *file, std::list<Block>::iterator block) {
+    if (block->data.size() < CLIENT_BLOCK_SIZE) file->end_block = block->index;
+    else if (file->end_block == (int64_t) block->index) file->end_block = -1;
+  }
+
+  // Zero-fills the cached block that ended the file, if the file now
+  // extends to size past it.
+  void grow(File *file, size_t size) {
+    if (file->end_block < 0) return;
+    std::list<Block>::iterator block = file->blocks[file->end_block];
+    size_t start = block->index * CLIENT_BLOCK_SIZE;
+    if (size > start + block->data.size()) {
+      resize(file, block, std::min(size - start, (size_t) CLIENT_BLOCK_SIZE));
+    }
+  }
+
+  void drop(File *file, uint64_t index) {
+    auto block = file->blocks.find(index);
+    if (block == file->blocks.end()) return;
+    if (file->end_block == (int64_t) index) file->end_block = -1;
+    bytes_ -= block->second->data.size();
+    lru_.erase(block->second);
+    file->blocks.erase(block);
+  }
+
+  void dropFile(const std::string &fh) {
+    auto file = files_.find(fh);
+    if (file == files_.end()) return;
+    for (auto &block : file->second.blocks) {
+      bytes_ -= block.second->data.size();
+      lru_.erase(block.second);
+    }
+    files_.erase(file);
+  }
+
+  void evict() {
+    while (bytes_ > capacity_ && !lru_.empty()) {
+      Block &victim = lru_.back();
+      auto file = files_.find(victim.fh);
+      drop(&file->second, victim.index);
+      if (file->second.blocks.empty()) files_.erase(file);
+    }
+  }
+
+  size_t capacity_;
+  size_t bytes_;
+  std::list<Block> lru_;  // Most recently used first.
+  std::unordered_map<std::string, File> files_;
+  pthread_mutex_t mutex;  // Guards everything above but capacity_.
+};
+
+#endif  // _NFS_CLIENT_BLOCK_CACHE_H_
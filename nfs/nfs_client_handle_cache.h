@@ -0,0 +1,122 @@
+#ifndef _NFS_CLIENT_HANDLE_CACHE_H_
+#define _NFS_CLIENT_HANDLE_CACHE_H_
+
+#include <chrono>
+#include <functional>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+
+#define HANDLE_CACHE_SHARDS 64  // Number of independently locked shards.
+#define NEGATIVE_TTL_S 3        // Default -o negttl: how long a path is known not to exist.
+
+// What the handle cache knows of a path.
+enum HandleLookup {
+  kHandleUnknown,  // Nothing: ask the server.
+  kHandleFound,    // The file handle of the file at the path.
+  kHandleMissing,  // The server said not long ago that there is no such file.
+};
+
+// Maps paths in the mount to the file handles the server gave for them,
+// and remembers for a while the paths it said do not exist, so that looking
+// for a file again (along PATH or the include path, say) costs no LOOKUP.
+//
+// A handle is kept until the file is removed through this client. A missing
+// path is kept for a TTL only, as another client may create the file
+// meanwhile; creating it through this client replaces it at once.
+//
+// Paths are spread over shards with a lock each, so that the FUSE threads
+// rarely wait for one another.
+class ClientHandleCache {
+ public:
+  ClientHandleCache() {
+    for (int i = 0; i < HANDLE_CACHE_SHARDS; ++i) {
+      pthread_rwlock_init(&shards_[i].lock, nullptr);
+    }
+  }
+
+  HandleLookup lookup(const std::string &path, std::string *fh) {
+    Shard &shard = shardFor(path);
+    HandleLookup result = kHandleUnknown;
+    pthread_rwlock_rdlock(&shard.lock);
+    auto entry = shard.entries.find(path);
+    if (entry != shard.entries.end()) {
+      if (!entry->second.missing) {
+	*fh = entry->second.fh;
+	result = kHandleFound;
+      } else if (std::chrono::steady_clock::now() < entry->second.expires) {
+	result = kHandleMissing;
+      }
+    }
+    pthread_rwlock_unlock(&shard.lock);
+    return result;
+  }
+
+  void insert(const std::string &path, const std::string &fh) {
+    Shard &shard = shardFor(path);
+    pthread_rwlock_wrlock(&shard.lock);
+    Entry &entry = shard.entries[path];
+    entry.fh = fh;
+    entry.missing = false;
+    pthread_rwlock_unlock(&shard.lock);
+  }
+
+  // Remembers for ttl that there is no file at path. Does nothing for no
+  // ttl.
+  void insertMissing(const std::string &path, std::chrono::milliseconds ttl) {
+    if (ttl.count() <= 0) return;
+    Shard &shard = shardFor(path);
+    pthread_rwlock_wrlock(&shard.lock);
+    Entry &entry = shard.entries[path];
+    entry.fh.clear();
+    entry.missing = true;
+    entry.expires = std::chrono::steady_clock::now() + ttl;
+    pthread_rwlock_unlock(&shard.lock);
+  }
+
+  void erase(const std::string &path) {
+    Shard &shard = shardFor(path);
+    pthread_rwlock_wrlock(&shard.lock);
+    shard.entries.erase(path);
+    pthread_rwlock_unlock(&shard.lock);
+  }
+
+  // Counts the handles and the missing paths held, expired ones included.
+  void count(size_t *handles, size_t *missing) {
+    *handles = *missing = 0;
+    for (int i = 0; i < HANDLE_CACHE_SHARDS; ++i) {
+      pthread_rwlock_rdlock(&shards_[i].lock);
+      for (const auto &entry : shards_[i].entries) {
+	if (entry.second.missing) ++*missing;
+	else ++*handles;
+      }
+      pthread_rwlock_unlock(&shards_[i].lock);
+    }
+  }
+
+ private:
+  struct Entry {
+    Entry()
+      : missing(false) {
+    }
+
+    std::string fh;
+    bool missing;
+    std::chrono::steady_clock::time_point expires;  // Of a missing path.
+  };
+
+  struct Shard {
+    pthread_rwlock_t lock;
+    std::unordered_map<std::string, Entry> entries;
+  };
+
+  Shard &shardFor(const std::string &path) {
+    return shards_[std::hash<std::string>()(path) % HANDLE_CACHE_SHARDS];
+  }
+
+  Shard shards_[HANDLE_CACHE_SHARDS];
+};
+
+static ClientHandleCache handleCache;
+
+#endif  // _NFS_CLIENT_HANDLE_CACHE_H_
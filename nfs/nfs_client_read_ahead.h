@@ -0,0 +1,281 @@
+#ifndef _NFS_CLIENT_READ_AHEAD_H_
+#define _NFS_CLIENT_READ_AHEAD_H_
+
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "nfs_client_block_cache.h"
+
+#define CLIENT_READ_AHEAD_DEFAULT_KB 4096  // Default -o readahead_kb, the largest window; 0 turns it off.
+#define CLIENT_READ_AHEAD_TRIGGER 2        // Back-to-back reads that make a file's reads sequential.
+#define CLIENT_READ_AHEAD_MIN_BLOCKS 2     // Window of a file just found to be read sequentially.
+#define CLIENT_READ_AHEAD_THREADS 8        // Read-ahead READs in flight at most.
+#define CLIENT_READ_AHEAD_MAX_MB 64        // Read-ahead data held over all files.
+#define CLIENT_READ_AHEAD_STREAMS 64       // Files whose reads are tracked.
+
+// Reads count bytes at offset of the file fh from the server into data, for
+// the read-ahead threads. Returns false if the READ failed.
+typedef bool (*ReadAheadFetcher)(const std::string &fh, uint64_t offset, size_t count, std::string *data);
+
+// Reads blocks of a file the application reads sequentially ahead of it,
+// on background threads, so that reading a file through is not bound by
+// the round trip of every READ.
+//
+// Once CLIENT_READ_AHEAD_TRIGGER reads of a file followed each other, the
+// blocks within a window past the last one are read ahead. The window
+// starts at CLIENT_READ_AHEAD_MIN_BLOCKS and doubles with every new block
+// the application reaches while the pattern holds, up to the configured
+// largest window. A read elsewhere in the file halves it and drops what was
+// read ahead for the old position.
+//
+// Reads pick blocks up with take(), waiting for those still on their way;
+// blocks are kept until the application reads past them. Changes to a file
+// must call invalidate(): blocks still being read for it are then dropped
+// when they arrive.
+class ClientReadAhead {
+ public:
+  ClientReadAhead()
+    : max_window_(CLIENT_READ_AHEAD_DEFAULT_KB * 1024L / CLIENT_BLOCK_SIZE), fetcher_(nullptr),
+      held_blocks_(0) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&queue_cond, nullptr);
+    pthread_cond_init(&arrived_cond, nullptr);
+  }
+
+  // Sets the largest window. Must be called before start().
+  void setMaxWindow(size_t bytes) { max_window_ = bytes / CLIENT_BLOCK_SIZE; }
+
+  // Starts the read-ahead threads, which read with fetcher. Without a call,
+  // or with no window, nothing is read ahead.
+  bool start(ReadAheadFetcher fetcher) {
+    if (max_window_ == 0) return true;
+    for (int i = 0; i < CLIENT_READ_AHEAD_THREADS; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, nullptr, &ClientReadAhead::runFetcher, this) != 0) return false;
+      pthread_detach(thread);
+    }
+    fetcher_ = fetcher;
+    return true;
+  }
+
+  bool enabled() const { return fetcher_ != nullptr; }
+
+  size_t heldBytes() {
+    pthread_mutex_lock(&mutex);
+    size_t bytes = held_blocks_ * CLIENT_BLOCK_SIZE;
+    pthread_mutex_unlock(&mutex);
+    return bytes;
+  }
+
+  // Notes that the application read count bytes at offset of the file fh.
+  // Returns the blocks to read ahead now, unless may_read_ahead is false
+  // (at the end of the file, say); the caller passes those it does not have
+  // already to readAhead().
+  std::vector<uint64_t> noteRead(const std::string &fh, size_t offset, size_t count, bool may_read_ahead) {
+    std::vector<uint64_t> wanted;
+    if (!enabled()) return wanted;
+    uint64_t end_block = (offset + count + CLIENT_BLOCK_SIZE - 1) / CLIENT_BLOCK_SIZE;
+
+    pthread_mutex_lock(&mutex);
+    Stream &stream = streamFor(fh);
+    if (offset == stream.next_offset) {
+      ++stream.sequential;
+      if (stream.sequential >= CLIENT_READ_AHEAD_TRIGGER && end_block > stream.read_to) {
+	stream.window = std::min(std::max(stream.window * 2, (size_t) CLIENT_READ_AHEAD_MIN_BLOCKS), max_window_);
+      }
+      // Blocks the application has read past.
+      dropBlocks(&stream, offset / CLIENT_BLOCK_SIZE);
+    } else {
+      stream.sequential = 1;
+      stream.window /= 2;
+      dropBlocks(&stream, UINT64_MAX);
+      stream.read_ahead_to = 0;
+    }
+    stream.next_offset = offset + count;
+    stream.read_to = end_block;
+
+    if (may_read_ahead && stream.sequential >= CLIENT_READ_AHEAD_TRIGGER) {
+      uint64_t last = end_block + stream.window;
+      for (uint64_t index = std::max(stream.read_ahead_to, end_block); index < last; ++index) {
+	wanted.push_back(index);
+      }
+      stream.read_ahead_to = std::max(stream.read_ahead_to, last);
+    }
+    pthread_mutex_unlock(&mutex);
+    return wanted;
+  }
+
+  // Queues the blocks of the file fh for the read-ahead threads, as many as
+  // fit within CLIENT_READ_AHEAD_MAX_MB.
+  void readAhead(const std::string &fh, const std::vector<uint64_t> &blocks) {
+    if (blocks.empty()) return;
+    pthread_mutex_lock(&mutex);
+    auto found = streams_.find(fh);
+    if (found != streams_.end()) {
+      Stream &stream = found->second;
+      for (uint64_t index : blocks) {
+	if (stream.blocks.count(index) > 0) continue;
+	if (held_blocks_ >= CLIENT_READ_AHEAD_MAX_MB * 1024L * 1024L / CLIENT_BLOCK_SIZE) {
+	  // Full: the rest is read ahead once the application catches up.
+	  stream.read_ahead_to = std::min(stream.read_ahead_to, index);
+	  break;
+	}
+	std::shared_ptr<Block> block(new Block);
+	stream.blocks[index] = block;
+	++held_blocks_;
+	Request request = { fh, index, block };
+	queue_.push_back(request);
+      }
+      pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // Copies block index of the file fh into data if it was read ahead,
+  // waiting for it if it is still on its way. Returns false otherwise, or
+  // if reading it failed. A block shorter than CLIENT_BLOCK_SIZE ends the
+  // file.
+  bool take(const std::string &fh, uint64_t index, std::string *data) {
+    bool found = false;
+    pthread_mutex_lock(&mutex);
+    auto stream = streams_.find(fh);
+    if (stream != streams_.end()) {
+      auto it = stream->second.blocks.find(index);
+      if (it != stream->second.blocks.end()) {
+	std::shared_ptr<Block> block = it->second;
+	while (!block->arrived) pthread_cond_wait(&arrived_cond, &mutex);
+	if (!block->dropped && !block->failed) {
+	  data->assign(block->data);
+	  found = true;
+	}
+      }
+    }
+    pthread_mutex_unlock(&mutex);
+    return found;
+  }
+
+  // Drops what was read ahead of the file fh, whose data changed or may
+  // have, and forgets how it was being read.
+  void invalidate(const std::string &fh) {
+    pthread_mutex_lock(&mutex);
+    auto stream = streams_.find(fh);
+    if (stream != streams_.end()) {
+      dropBlocks(&stream->second, UINT64_MAX);
+      lru_.erase(stream->second.lru_pos);
+      streams_.erase(stream);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+ private:
+  struct Block {
+    Block()
+      : arrived(false), failed(false), dropped(false) {
+    }
+
+    std::string data;
+    bool arrived;
+    bool failed;
+    bool dropped;  // No longer held: its data may be out of date.
+  };
+
+  // How the application has been reading a file.
+  struct Stream {
+    Stream()
+      : next_offset(0), sequential(0), window(0), read_to(0), read_ahead_to(0) {
+    }
+
+    size_t next_offset;     // Where the last read ended.
+    int sequential;         // Reads so far that started where the one before ended.
+    size_t window;          // In blocks.
+    uint64_t read_to;       // Past the last block the application read.
+    uint64_t read_ahead_to; // Past the last block queued for reading ahead.
+    std::map<uint64_t, std::shared_ptr<Block>> blocks;
+    std::list<std::string>::iterator lru_pos;
+  };
+
+  struct Request {
+    std::string fh;
+    uint64_t index;
+    std::shared_ptr<Block> block;
+  };
+
+  // The stream of the file fh, made the most recently used. A new stream
+  // replaces the least recently used one when the table is full.
+  Stream& streamFor(const std::string &fh) {
+    auto found = streams_.find(fh);
+    if (found != streams_.end()) {
+      lru_.splice(lru_.begin(), lru_, found->second.lru_pos);
+      return found->second;
+    }
+    if (streams_.size() >= CLIENT_READ_AHEAD_STREAMS) {
+      auto victim = streams_.find(lru_.back());
+      dropBlocks(&victim->second, UINT64_MAX);
+      streams_.erase(victim);
+      lru_.pop_back();
+    }
+    lru_.push_front(fh);
+    Stream &stream = streams_[fh];
+    stream.lru_pos = lru_.begin();
+    return stream;
+  }
+
+  // Drops the blocks of stream before index end.
+  void dropBlocks(Stream *stream, uint64_t end) {
+    auto it = stream->blocks.begin();
+    while (it != stream->blocks.end() && it->first < end) {
+      it->second->dropped = true;
+      --held_blocks_;
+      it = stream->blocks.erase(it);
+    }
+  }
+
+  static void* runFetcher(void *args) {
+    ClientReadAhead *read_ahead = static_cast<ClientReadAhead*>(args);
+    read_ahead->fetchLoop();
+    return nullptr;
+  }
+
+  void fetchLoop() {
+    while (1) {
+      pthread_mutex_lock(&mutex);
+      while (queue_.empty()) pthread_cond_wait(&queue_cond, &mutex);
+      Request request = queue_.front();
+      queue_.pop_front();
+      bool wanted = !request.block->dropped;
+      pthread_mutex_unlock(&mutex);
+
+      std::string data;
+      bool ok = wanted && fetcher_(request.fh, request.index * CLIENT_BLOCK_SIZE, CLIENT_BLOCK_SIZE, &data);
+
+      pthread_mutex_lock(&mutex);
+      request.block->data.swap(data);
+      request.block->failed = !ok;
+      request.block->arrived = true;
+      pthread_cond_broadcast(&arrived_cond);
+      pthread_mutex_unlock(&mutex);
+    }
+  }
+
+  size_t max_window_;  // In blocks.
+  ReadAheadFetcher fetcher_;
+  std::unordered_map<std::string, Stream> streams_;
+  std::list<std::string> lru_;  // Files of streams_, most recently read first.
+  std::deque<Request> queue_;
+  size_t held_blocks_;
+  pthread_mutex_t mutex;  // Guards streams_, lru_, queue_, held_blocks_ and the blocks.
+  pthread_cond_t queue_cond;
+  pthread_cond_t arrived_cond;
+};
+
+static ClientReadAhead readAhead;
+
+#endif  // _NFS_CLIENT_READ_AHEAD_H_
@@ -21,7 +21,10 @@
 #endif
 
 #include <fuse.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -37,9 +40,28 @@
 
 #include "nfs_grpc_client_wrapper.h"
 
+// The stats file lives only in this process. Its contents are rendered
+// anew on every open, so that reads through one descriptor see a single
+// snapshot; direct_io keeps the kernel from cutting reads short at a size
+// reported earlier.
+static int is_stats_file(const char *path)
+{
+	return strcmp(path, REMOTE_STATS_PATH) == 0;
+}
+
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
+
+	if (is_stats_file(path)) {
+		char *stats = remote_stats();
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = strlen(stats);
+		free(stats);
+		return 0;
+	}
 	
 	// res = lstat(path, stbuf);
 	res = remote_getattr(path, stbuf);
@@ -54,11 +76,14 @@ static int xmp_access(const char *path, int mask)
 {
 	int res;
 
+	if (is_stats_file(path))
+		return (mask & W_OK) ? -EACCES : 0;
+
 	// res = access(path, mask);
 	
 	// Since no notion of permissions in being supported,
-	// access is replaced by simply a call to remote_open().
-	res = remote_open(path, mask);
+	// access is replaced by simply a call to remote_access().
+	res = remote_access(path);
 	if (res == -1)
 		return -errno;
 	
@@ -81,26 +106,16 @@ static int xmp_readlink(const char *path, char *buf, size_t size)
 static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
-	DIR *dp;
-	struct dirent *de;
+	int res;
 
 	(void) offset;
 	(void) fi;
 
-	dp = opendir(path);
-	if (dp == NULL)
-		return -errno;
-
-	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
-			break;
-	}
+	// Entries come with their attributes, streamed over a single RPC.
+	res = remote_readdir(path, buf, filler);
+	if (res == -1)
+		return -ENOENT;
 
-	closedir(dp);
 	return 0;
 }
 
@@ -120,6 +135,9 @@ static int xmp_unlink(const char *path)
 {
 	int res;
 
+	if (is_stats_file(path))
+		return -EACCES;
+
 	//res = unlink(path);
 	res = remote_unlink(path); 
 	if (res == -1)
@@ -199,6 +217,9 @@ static int xmp_truncate(const char *path, off_t size)
 {
 	int res;
 
+	if (is_stats_file(path))
+		return -EACCES;
+
 	// res = truncate(path, size);
 	res = remote_setattr(path, size);
 	if (res == -1)
@@ -225,6 +246,14 @@ static int xmp_open(const char *path, struct fuse_file_info *fi)
 {
 	int res;
 
+	if (is_stats_file(path)) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		fi->fh = (uintptr_t) remote_stats();
+		fi->direct_io = 1;
+		return 0;
+	}
+
 	//res = open(path, fi->flags);
 	res = remote_open(path, fi->flags);
 	if (res == -1)
@@ -252,7 +281,16 @@ static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
 	
 	int res;
 
-	(void) fi;
+	if (is_stats_file(path)) {
+		const char *stats = (const char *) (uintptr_t) fi->fh;
+		size_t len = strlen(stats);
+		if ((size_t) offset >= len)
+			return 0;
+		if (size > len - offset)
+			size = len - offset;
+		memcpy(buf, stats + offset, size);
+		return size;
+	}
 	/*
         int fd;
 	fd = open(path, O_RDONLY);
@@ -314,6 +352,11 @@ static int xmp_release(const char *path, struct fuse_file_info *fi)
 	(void) fi;
 	return 0; */
 
+	if (is_stats_file(path)) {
+		free((char *) (uintptr_t) fi->fh);
+		return 0;
+	}
+
         int res = remote_fsync(path);
 	if (res == -1)
 	        return -errno; 
@@ -331,6 +374,9 @@ static int xmp_fsync(const char *path, int isdatasync,
 	(void) isdatasync;
 	(void) fi;
 	return 0; */
+
+	if (is_stats_file(path))
+		return 0;
         
         int res = remote_fsync(path);
 	if (res == -1)
@@ -402,7 +448,18 @@ static int xmp_removexattr(const char *path, const char *name)
 }
 #endif /* HAVE_SETXATTR */
 
+static void *xmp_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+
+	// Runs in the daemon, after fuse_main() has forked: gRPC's threads
+	// would not survive the fork.
+	remote_init();
+	return NULL;
+}
+
 static struct fuse_operations xmp_oper = {
+	.init		= xmp_init,
 	.getattr	= xmp_getattr,
 	.access		= xmp_access,
 	.readlink	= xmp_readlink,
@@ -437,8 +494,89 @@ static struct fuse_operations xmp_oper = {
 #endif
 };
 
+// Attribute caching mount options, in seconds, as for NFS: -o acregmin=N,
+// acregmax=N, acdirmin=N, acdirmax=N, actimeo=N to set all four, or noac
+// to always ask the server. -o negttl=N sets how long a path the server
+// did not find is taken not to exist (0 under noac), -o cache_mb=N bounds
+// the data cache, -o wsize=N sets how many bytes of small writes are merged
+// into one WRITE, and -o readahead_kb=N how far ahead of a sequential
+// reader to read.
+// -1 keeps the client library's default.
+struct nfs_options {
+	int acregmin;
+	int acregmax;
+	int acdirmin;
+	int acdirmax;
+	int cache_mb;
+	int wsize;
+	int readahead_kb;
+	int negttl;
+};
+
+enum {
+	KEY_ACTIMEO,
+	KEY_NOAC,
+};
+
+#define NFS_OPT(t, p) { t, offsetof(struct nfs_options, p), 0 }
+
+static struct fuse_opt nfs_opts[] = {
+	NFS_OPT("acregmin=%d", acregmin),
+	NFS_OPT("acregmax=%d", acregmax),
+	NFS_OPT("acdirmin=%d", acdirmin),
+	NFS_OPT("acdirmax=%d", acdirmax),
+	NFS_OPT("cache_mb=%d", cache_mb),
+	NFS_OPT("wsize=%d", wsize),
+	NFS_OPT("readahead_kb=%d", readahead_kb),
+	NFS_OPT("negttl=%d", negttl),
+	FUSE_OPT_KEY("actimeo=", KEY_ACTIMEO),
+	FUSE_OPT_KEY("noac", KEY_NOAC),
+	FUSE_OPT_END
+};
+
+static int nfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	struct nfs_options *options = data;
+	int seconds;
+
+	(void) outargs;
+	switch (key) {
+	case KEY_ACTIMEO:
+		seconds = atoi(arg + strlen("actimeo="));
+		break;
+	case KEY_NOAC:
+		seconds = 0;
+		options->negttl = 0;
+		break;
+	default:
+		return 1;
+	}
+	options->acregmin = options->acregmax = seconds;
+	options->acdirmin = options->acdirmax = seconds;
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct nfs_options options = { -1, -1, -1, -1, -1, -1, -1, -1 };
+	int res;
+
+	if (fuse_opt_parse(&args, &options, nfs_opts, nfs_opt_proc) == -1)
+		return 1;
+	remote_set_attr_timeouts(options.acregmin, options.acregmax,
+				 options.acdirmin, options.acdirmax);
+	if (options.cache_mb >= 0)
+		remote_set_data_cache_mb(options.cache_mb);
+	if (options.wsize > 0)
+		remote_set_wsize(options.wsize);
+	if (options.readahead_kb >= 0)
+		remote_set_read_ahead_kb(options.readahead_kb);
+	if (options.negttl >= 0)
+		remote_set_negative_ttl(options.negttl);
+
 	umask(0);
-	return fuse_main(argc, argv, &xmp_oper, NULL);
+	res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }
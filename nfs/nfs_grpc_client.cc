@@ -8,8 +8,15 @@
 #include <cstdio>
 #include <cstring>
 #include <cstddef>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sstream>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -20,10 +27,16 @@
 #include <grpc++/grpc++.h>
 
 #include "nfs.grpc.pb.h"
+#include "nfs_client_block_cache.h"
+#include "nfs_client_handle_cache.h"
+#include "nfs_client_read_ahead.h"
 #include "nfs_grpc_client_wrapper.h"
+#include "nfs_latency_histogram.h"
 
 using grpc::Channel;
 using grpc::ClientContext;
+using grpc::ClientReader;
+using grpc::ClientWriter;
 using grpc::Status;
 using nfs::NFS;
 using nfs::fattr;
@@ -47,30 +60,630 @@ using nfs::REMOVEargs;
 using nfs::REMOVEres;
 using nfs::LOOKUPargs;
 using nfs::LOOKUPres;
+using nfs::READDIRargs;
+using nfs::READDIRres;
+using nfs::COMPOUNDargs;
+using nfs::COMPOUNDres;
+using nfs::nfs_resop;
 
 #define SERVER "localhost"
 #define RPC_TIMEOUT 5000  // Timeout in milliseconds after which the rpc request will fail
-#define CONN_TIMEOUT 100000 // Timeout in ms after which the client timeouts on the server
+#define RECONNECT_BACKOFF_MIN_MS 100   // First wait before reconnecting to a lost server
+#define RECONNECT_BACKOFF_MAX_MS 1000  // Longest wait between reconnection attempts
 #define RETRY 100   // Retry the rpc request after these many milliseconds
+#define READ_STREAM_THRESHOLD 65536  // Reads larger than this are streamed
+#define OPEN_PREFETCH_SIZE 131072    // Bytes read along with the LOOKUP of an open
+#define COMPOUND_MAX_BYTES 1048576   // Write data packed into one compound on retransmit
+#define COMPOUND_RETRIES 3           // Retransmissions of a compound whose writes were lost
+#define ACREGMIN_S 3                 // Shortest time the attributes of a file answer GETATTRs
+#define ACREGMAX_S 60                // Longest time the attributes of a file answer GETATTRs
+#define ACDIRMIN_S 30                // Same for a directory
+#define ACDIRMAX_S 60                // Same for a directory
+#define WSIZE_DEFAULT 1048576        // Default -o wsize: most data sent in one WRITE
+#define WSIZE_MAX 2097152            // Keeps a WRITE well within gRPC's 4 MiB message limit
+#define WRITEBACK_MAX_AGE_MS 1000    // Dirty data older than this is sent to the server
+#define WRITEBACK_SCAN_MS 100        // How often writes and the writeback thread look for such data
+#define FILE_SHARDS 64               // Number of independently locked shards of per-file write state
 // #define DEBUG true
 
-static std::string latest_write_server_verf = std::to_string(std::numeric_limits<long>::max());
-static std::unordered_map<std::string, std::vector<WRITEargs>> client_buffer_map;
-static std::unordered_map<std::string, std::string> fh_map;
+// The operations the client counts RPCs for. Operations issued on behalf
+// of another, such as the LOOKUP of a GETATTR on an unknown path or the
+// COMPOUNDs of a retransmission, count as their own.
+enum ClientOp {
+  kOpGetattr,
+  kOpSetattr,
+  kOpLookup,
+  kOpRead,
+  kOpReadStream,
+  kOpReadAhead,
+  kOpWrite,
+  kOpWriteStream,
+  kOpCommit,
+  kOpCreate,
+  kOpRemove,
+  kOpMkdir,
+  kOpRmdir,
+  kOpReaddirplus,
+  kOpCompound,
+  kNumClientOps
+};
+
+static const char *kClientOpNames[kNumClientOps] = {
+  "GETATTR", "SETATTR", "LOOKUP", "READ", "READ_STREAM", "READ_AHEAD", "WRITE", "WRITE_STREAM",
+  "COMMIT", "CREATE", "REMOVE", "MKDIR", "RMDIR", "READDIRPLUS", "COMPOUND"
+};
+
+// What the client has been doing, rendered into REMOTE_STATS_PATH. Every
+// RPC attempt is timed, from its context being made to its status being
+// checked, so slow replies show in the latencies, while failed attempts
+// show as retries and the time slept before trying again as backoff.
+class ClientStats {
+ public:
+  ClientStats()
+    : connects(0), disconnects(0), connect_wait_ms(0), attr_hits(0), missing_hits(0), data_hits(0), data_misses(0),
+      data_invalidations(0), read_ahead_blocks(0), read_ahead_hits(0), dirty_writes(0), stream_writes(0),
+      verifier_mismatches(0), broken_streams(0), retransmitted_writes(0), retransmitted_bytes(0),
+      compound_resends(0),
+      start_(std::chrono::steady_clock::now()) {
+    pthread_mutex_init(&stats_mutex, nullptr);
+  }
+
+  void recordRpc(ClientOp op, uint64_t latency_ns, bool ok, long backoff_ms) {
+    pthread_mutex_lock(&stats_mutex);
+    OpStats &stats = ops_[op];
+    stats.latency_ns.record(latency_ns);
+    if (!ok) ++stats.retries;
+    stats.backoff_ms += backoff_ms;
+    pthread_mutex_unlock(&stats_mutex);
+  }
+
+  // Renders the counters, followed by the state of the caches and the
+  // write buffers.
+  std::string render(size_t handles, size_t missing_paths, size_t cached_bytes, size_t read_ahead_bytes,
+		     size_t dirty_bytes, size_t buffered_writes, size_t buffered_bytes, size_t buffered_files,
+		     size_t open_streams) {
+    std::ostringstream out;
+    out << "uptime_s " << std::chrono::duration_cast<std::chrono::seconds>(
+	std::chrono::steady_clock::now() - start_).count() << "\n";
+    char line[160];
+    snprintf(line, sizeof(line), "%-12s %10s %8s %10s %9s %9s %9s %9s\n", "op", "rpcs", "retries",
+	     "backoff_ms", "mean_us", "p50_us", "p99_us", "p999_us");
+    out << line;
+    pthread_mutex_lock(&stats_mutex);
+    for (int op = 0; op < kNumClientOps; ++op) {
+      const OpStats &stats = ops_[op];
+      if (stats.latency_ns.count == 0) continue;
+      snprintf(line, sizeof(line), "%-12s %10llu %8llu %10llu %9llu %9llu %9llu %9llu\n", kClientOpNames[op],
+	       (unsigned long long) stats.latency_ns.count, (unsigned long long) stats.retries,
+	       (unsigned long long) stats.backoff_ms, (unsigned long long) stats.latency_ns.mean() / 1000,
+	       (unsigned long long) stats.latency_ns.percentile(0.5) / 1000,
+	       (unsigned long long) stats.latency_ns.percentile(0.99) / 1000,
+	       (unsigned long long) stats.latency_ns.percentile(0.999) / 1000);
+      out << line;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    out << "connects " << connects << "\n"
+	<< "disconnects " << disconnects << "\n"
+	<< "connect_wait_ms " << connect_wait_ms << "\n"
+	<< "attr_cache_hits " << attr_hits << "\n"
+	<< "handle_cache_handles " << handles << "\n"
+	<< "handle_cache_missing " << missing_paths << "\n"
+	<< "handle_cache_missing_hits " << missing_hits << "\n"
+	<< "data_cache_hits " << data_hits << "\n"
+	<< "data_cache_misses " << data_misses << "\n"
+	<< "data_cache_invalidations " << data_invalidations << "\n"
+	<< "data_cache_bytes " << cached_bytes << "\n"
+	<< "read_ahead_blocks " << read_ahead_blocks << "\n"
+	<< "read_ahead_hits " << read_ahead_hits << "\n"
+	<< "read_ahead_bytes " << read_ahead_bytes << "\n"
+	<< "dirty_writes " << dirty_writes << "\n"
+	<< "dirty_bytes " << dirty_bytes << "\n"
+	<< "stream_writes " << stream_writes << "\n"
+	<< "buffered_writes " << buffered_writes << "\n"
+	<< "buffered_bytes " << buffered_bytes << "\n"
+	<< "buffered_files " << buffered_files << "\n"
+	<< "open_write_streams " << open_streams << "\n"
+	<< "verifier_mismatches " << verifier_mismatches << "\n"
+	<< "broken_write_streams " << broken_streams << "\n"
+	<< "retransmitted_writes " << retransmitted_writes << "\n"
+	<< "retransmitted_bytes " << retransmitted_bytes << "\n"
+	<< "compound_resends " << compound_resends << "\n";
+    return out.str();
+  }
+
+  std::atomic<long> connects;             // Times the channel to the server became ready.
+  std::atomic<long> disconnects;          // Times it lost its connection.
+  std::atomic<long> connect_wait_ms;      // Time it spent connecting or reconnecting.
+  std::atomic<long> attr_hits;            // GETATTRs answered from attributes already received.
+  std::atomic<long> missing_hits;         // GETATTRs answered from paths known not to exist.
+  std::atomic<long> data_hits;            // Reads answered from the data cache.
+  std::atomic<long> data_misses;          // Reads that went to the server for some block.
+  std::atomic<long> data_invalidations;   // Opens that found cached data changed at the server.
+  std::atomic<long> read_ahead_blocks;    // Blocks read ahead of the application.
+  std::atomic<long> read_ahead_hits;      // Reads answered from blocks read ahead.
+  std::atomic<long> dirty_writes;         // Unstable writes merged into dirty extents.
+  std::atomic<long> stream_writes;        // Unstable writes pushed onto a write stream.
+  std::atomic<long> verifier_mismatches;  // Commits that found the server had restarted.
+  std::atomic<long> broken_streams;       // Commits whose write stream lost writes.
+  std::atomic<long> retransmitted_writes;
+  std::atomic<long> retransmitted_bytes;
+  std::atomic<long> compound_resends;     // Retransmissions sent again for a mismatched verifier.
+
+ private:
+  struct OpStats {
+    OpStats()
+      : retries(0), backoff_ms(0) {
+    }
+
+    Histogram latency_ns;  // Of every attempt, failed ones included.
+    uint64_t retries;
+    uint64_t backoff_ms;
+  };
+
+  OpStats ops_[kNumClientOps];
+  std::chrono::steady_clock::time_point start_;
+  pthread_mutex_t stats_mutex;  // Guards ops_.
+};
+
+static ClientStats clientStats;
+
+// Data of files by file handle, checked against the server on open.
+static ClientBlockCache dataCache;
+
+// An open NFSPROC_WRITE_STREAM to one file. Unstable writes to the file are
+// pushed onto it and acknowledged together when the stream is closed.
+struct WriteStream {
+  std::chrono::steady_clock::time_point opened;
+  ClientContext context;
+  WRITEres writeRes;
+  std::unique_ptr<ClientWriter<WRITEargs>> writer;
+};
+
+// Attributes of files by file handle, as the server last sent them along
+// with the reply to a READ, WRITE, LOOKUP, CREATE and so on. Until they
+// expire, they answer GETATTRs without asking the server again. The
+// client's own changes replace them with the attributes the server returns
+// after the change, or update them in place for buffered writes.
+struct CachedAttributes {
+  fattr attributes;
+  std::chrono::steady_clock::time_point expires;
+};
+static std::unordered_map<std::string, CachedAttributes> attr_map;
+static pthread_mutex_t attr_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards attr_map.
+
+// How long attributes are trusted, in seconds, as set by the acregmin,
+// acregmax, acdirmin and acdirmax mount options, and how long a path the
+// server did not find is taken not to exist, as set by negttl.
+static int acregmin_s = ACREGMIN_S;
+static int acregmax_s = ACREGMAX_S;
+static int acdirmin_s = ACDIRMIN_S;
+static int acdirmax_s = ACDIRMAX_S;
+static int negttl_s = NEGATIVE_TTL_S;
+
+// Unstable writes not sent to the server yet: the data they wrote, as
+// extents by offset that never overlap or touch, so that small writes go
+// out merged into few large WRITEs.
+struct DirtyFile {
+  DirtyFile()
+    : bytes(0) {
+  }
+
+  std::map<size_t, std::string> extents;
+  size_t bytes;
+  std::chrono::steady_clock::time_point since;  // When the oldest of them was written.
+};
+
+// What the client holds of the unstable writes to a file, from the first
+// one until the file is committed. The server only sees their data once it
+// is committed or streamed, so the sizes it reports until then may fall
+// short of uncommitted_end.
+struct FileWrites {
+  FileWrites()
+    : uncommitted_end(0), stream_broken(false), verf(std::numeric_limits<long>::max()) {
+  }
+
+  DirtyFile dirty;
+  std::vector<WRITEargs> sent;          // Sent, and kept for retransmission.
+  size_t uncommitted_end;               // How far the writes reach.
+  std::unique_ptr<WriteStream> stream;  // Where the writes are sent, while open.
+  bool stream_broken;                   // A stream lost writes: the commit retransmits them.
+  long verf;                            // Lowest verifier the server sent for them.
+};
+
+// The FileWrites of files by file handle, spread over shards with a lock
+// each. The lock orders what is done to a file: writes, truncations and
+// commits hold it exclusively, while reads and opens share it, so that
+// data read from the server cannot be cached over a write made meanwhile.
+// No thread holds the locks of two shards at once.
+struct FileShard {
+  FileShard() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // Writes must not wait behind a steady stream of reads.
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+  }
+
+  pthread_rwlock_t lock;
+  std::unordered_map<std::string, FileWrites> files;
+};
+static FileShard file_shards[FILE_SHARDS];
+
+static FileShard& fileShard(const std::string &fh) {
+  return file_shards[std::hash<std::string>()(fh) % FILE_SHARDS];
+}
+
+// Holds the lock of the file with handle fh until it goes out of scope.
+class FileLock {
+ public:
+  FileLock(const std::string &fh, bool exclusive)
+    : shard_(&fileShard(fh)) {
+    if (exclusive) pthread_rwlock_wrlock(&shard_->lock);
+    else pthread_rwlock_rdlock(&shard_->lock);
+  }
+
+  ~FileLock() { pthread_rwlock_unlock(&shard_->lock); }
+
+ private:
+  FileShard *shard_;
+};
+
+// The writes held for the file with handle fh, or nullptr if there are
+// none. The caller holds its FileLock.
+static FileWrites* findWrites(const std::string &fh) {
+  FileShard &shard = fileShard(fh);
+  auto file = shard.files.find(fh);
+  return file == shard.files.end() ? nullptr : &file->second;
+}
+
+// Same, made if there are none. The caller holds its FileLock exclusively,
+// as for forgetWrites().
+static FileWrites& writesFor(const std::string &fh) {
+  return fileShard(fh).files[fh];
+}
+
+static void forgetWrites(const std::string &fh) {
+  fileShard(fh).files.erase(fh);
+}
+
+// When writes next look for dirty data that has waited too long, in
+// milliseconds of the steady clock.
+static std::atomic<long> writeback_scan_ms(0);
+
+// Counts the changes the server took from this client that left no writes
+// behind to lay over data read before them: commits, truncations, stable
+// writes and creations. Tells an open whether what it read may be stale.
+static std::atomic<long> data_changes(0);
+
+// The most data a WRITE carries, as set by the wsize mount option.
+static size_t wsize = WSIZE_DEFAULT;
+
+// Adds size bytes of data written at offset to the dirty extents of file,
+// merged with the extents they overlap or touch. The new data wins where
+// they overlap. Appending to an extent grows it in place.
+static void addDirtyExtent(DirtyFile *file, const char *data, size_t size, size_t offset) {
+  if (file->extents.empty()) file->since = std::chrono::steady_clock::now();
+  size_t end = offset + size;
+  auto it = file->extents.upper_bound(offset);
+  if (it != file->extents.begin() && std::prev(it)->first + std::prev(it)->second.size() >= offset) --it;
+
+  // Start from the extent the data overlaps or extends, if any.
+  size_t base = offset;
+  std::string merged;
+  if (it != file->extents.end() && it->first <= offset) {
+    base = it->first;
+    merged.swap(it->second);
+    file->bytes -= merged.size();
+    it = file->extents.erase(it);
+  }
+  if (merged.size() < end - base) merged.resize(end - base);
+  memcpy(&merged[offset - base], data, size);
+
+  // Take in what the extents after it have beyond the new data.
+  while (it != file->extents.end() && it->first <= base + merged.size()) {
+    size_t covered = base + merged.size() - it->first;
+    if (covered < it->second.size()) merged.append(it->second, covered, std::string::npos);
+    file->bytes -= it->second.size();
+    it = file->extents.erase(it);
+  }
+  file->bytes += merged.size();
+  file->extents[base].swap(merged);
+}
+
+// Drops the uncommitted data of the file with handle fh past size, which it
+// is being truncated to, so that neither sending nor retransmitting it
+// grows the file again. The caller holds its FileLock exclusively.
+static void truncateUncommitted(const std::string &fh, size_t size) {
+  FileWrites *writes = findWrites(fh);
+  if (writes == nullptr) return;
+  std::vector<WRITEargs> &request_vec = writes->sent;
+  for (auto it = request_vec.begin(); it != request_vec.end(); ) {
+    if (it->offset() >= size) {
+      it = request_vec.erase(it);
+      continue;
+    }
+    if (it->offset() + it->data().size() > size) {
+      it->mutable_data()->resize(size - it->offset());
+      it->set_count(size - it->offset());
+    }
+    ++it;
+  }
+
+  DirtyFile &file = writes->dirty;
+  auto it = file.extents.lower_bound(size);
+  if (it != file.extents.begin()) {
+    std::string &last = std::prev(it)->second;
+    size_t start = std::prev(it)->first;
+    if (start + last.size() > size) {
+      file.bytes -= last.size() - (size - start);
+      last.resize(size - start);
+    }
+  }
+  while (it != file.extents.end()) {
+    file.bytes -= it->second.size();
+    it = file.extents.erase(it);
+  }
+  writes->uncommitted_end = std::min(writes->uncommitted_end, size);
+}
+
+// Copies data that starts at data_offset of a file over the part of it in
+// buf, which holds size bytes wanted at offset, of which data_size are
+// valid. Returns the bytes of buf valid after.
+static size_t overlayData(const std::string &data, size_t data_offset, char *buf, size_t size, size_t offset,
+			  size_t data_size) {
+  size_t start = std::max(offset, data_offset);
+  size_t end = std::min(offset + size, data_offset + data.size());
+  if (start >= end) return data_size;
+  if (start - offset > data_size) memset(buf + data_size, 0, start - offset - data_size);
+  memcpy(buf + (start - offset), data.data() + (start - data_offset), end - start);
+  return std::max(data_size, end - offset);
+}
+
+// Copies the writes to the file with handle fh that the server may not have
+// applied yet over data read from it: size bytes wanted at offset into buf,
+// of which the server returned data_size. Returns the bytes of buf that are
+// valid after, more if the writes extend the file. The caller holds its
+// FileLock.
+static size_t overlayUncommittedWrites(const std::string &fh, char *buf, size_t size, size_t offset,
+				       size_t data_size) {
+  const FileWrites *writes = findWrites(fh);
+  if (writes == nullptr) return data_size;
+  // The file reaches at least as far as those writes, holes reading as zeros.
+  if (writes->uncommitted_end > offset + data_size) {
+    size_t valid = std::min(size, writes->uncommitted_end - offset);
+    memset(buf + data_size, 0, valid - data_size);
+    data_size = valid;
+  }
+  // Dirty data was written after everything sent.
+  for (const WRITEargs &writeArgs : writes->sent) {
+    data_size = overlayData(writeArgs.data(), writeArgs.offset(), buf, size, offset, data_size);
+  }
+  for (const auto &extent : writes->dirty.extents) {
+    data_size = overlayData(extent.second, extent.first, buf, size, offset, data_size);
+  }
+  return data_size;
+}
+
+// Whether the file with handle fh has writes the server may not have yet.
+// The caller holds its FileLock.
+static bool hasUncommittedWrites(const std::string &fh) {
+  return findWrites(fh) != nullptr;
+}
+
+// Copies size bytes at offset of the file with handle fh into buf from
+// blocks read ahead, waiting for those still on their way. Returns the
+// number of bytes copied, fewer at the end of the file, or -1 unless all of
+// them were read ahead.
+static long readFromReadAhead(const std::string &fh, char *buf, size_t size, size_t offset) {
+  if (!readAhead.enabled()) return -1;
+  size_t done = 0;
+  std::string block;
+  while (done < size) {
+    size_t pos = offset + done;
+    if (!readAhead.take(fh, pos / CLIENT_BLOCK_SIZE, &block)) return -1;
+    size_t in_block = pos % CLIENT_BLOCK_SIZE;
+    if (in_block >= block.size()) break;
+    size_t n = std::min(block.size() - in_block, size - done);
+    memcpy(buf + done, block.data() + in_block, n);
+    done += n;
+    if (block.size() < CLIENT_BLOCK_SIZE) break;  // The file ends here.
+  }
+  ++clientStats.read_ahead_hits;
+  return done;
+}
+
+// Fills in stbuf from attributes sent by the server.
+static void fillStat(const fattr &attributes, struct stat *stbuf) {
+  switch(attributes.type()) {
+  case fattr::NFSDIR: stbuf->st_mode |= S_IFDIR; break;
+  case fattr::NFSREG: stbuf->st_mode |= S_IFREG; break;
+  default: break;
+  }
+  stbuf->st_size = attributes.size();
+  stbuf->st_blocks = attributes.used() / 512;
+  stbuf->st_ino = attributes.fileid();
+  stbuf->st_atim.tv_sec = attributes.atime().seconds();
+  stbuf->st_atim.tv_nsec = attributes.atime().nseconds();
+  stbuf->st_mtim.tv_sec = attributes.mtime().seconds();
+  stbuf->st_mtim.tv_nsec = attributes.mtime().nseconds();
+  stbuf->st_ctim.tv_sec = attributes.ctime().seconds();
+  stbuf->st_ctim.tv_nsec = attributes.ctime().nseconds();
+}
+
+// How long attributes just received stay trusted: a tenth of the time since
+// the file last changed, so that files being worked on are checked often
+// and old ones rarely, within the limits set for files or directories.
+static std::chrono::milliseconds attributesTtl(const fattr &attributes) {
+  bool dir = attributes.type() == fattr::NFSDIR;
+  std::chrono::milliseconds min(1000L * (dir ? acdirmin_s : acregmin_s));
+  std::chrono::milliseconds max(1000L * (dir ? acdirmax_s : acregmax_s));
+  std::chrono::system_clock::time_point mtime(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+      std::chrono::seconds(attributes.mtime().seconds()) + std::chrono::nanoseconds(attributes.mtime().nseconds())));
+  std::chrono::milliseconds ttl = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now() - mtime) / 10;
+  return std::min(std::max(ttl, min), max);
+}
+
+static FileVersion fileVersion(const fattr &attributes) {
+  FileVersion version;
+  version.size = attributes.size();
+  version.mtime_ns = attributes.mtime().seconds() * 1000000000L + attributes.mtime().nseconds();
+  version.ctime_ns = attributes.ctime().seconds() * 1000000000L + attributes.ctime().nseconds();
+  return version;
+}
+
+// Makes what the server reported after a change of this client's the
+// version of the file its cached data is valid for.
+static void storeDataVersion(const std::string &fh, const nfs::wcc_data &wcc) {
+  if (wcc.has_after()) dataCache.setVersion(fh, fileVersion(wcc.after().attributes()));
+}
+
+static void storeAttributes(const std::string &fh, const fattr &attributes) {
+  pthread_mutex_lock(&attr_mutex);
+  CachedAttributes &cached = attr_map[fh];
+  cached.attributes = attributes;
+  cached.expires = std::chrono::steady_clock::now() + attributesTtl(attributes);
+  pthread_mutex_unlock(&attr_mutex);
+}
+
+// Stores the attributes of a file after a change, if the server sent them.
+static void storeAttributes(const std::string &fh, const nfs::wcc_data &wcc) {
+  if (wcc.has_after()) storeAttributes(fh, wcc.after().attributes());
+}
+
+// Stores the attributes of the directory an entry at path was added to or
+// removed from, if its handle is known.
+static void storeParentAttributes(const std::string &path, const nfs::wcc_data &wcc) {
+  size_t slash = path.find_last_of('/');
+  if (slash == std::string::npos) return;
+  std::string parent_fh;
+  if (handleCache.lookup(slash == 0 ? "/" : path.substr(0, slash), &parent_fh) == kHandleFound) {
+    storeAttributes(parent_fh, wcc);
+  }
+}
+
+// Fills in stbuf for the file with handle fh from attributes that have not
+// expired yet, and returns false if there are none.
+static bool lookupAttributes(const std::string &fh, struct stat *stbuf) {
+  bool found = false;
+  pthread_mutex_lock(&attr_mutex);
+  auto cached = attr_map.find(fh);
+  if (cached != attr_map.end()) {
+    if (std::chrono::steady_clock::now() >= cached->second.expires) {
+      attr_map.erase(cached);
+    } else {
+      fillStat(cached->second.attributes, stbuf);
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&attr_mutex);
+  return found;
+}
+
+// Copies the last attributes received for the file with handle fh, expired
+// or not, into attributes. Returns false if there are none.
+static bool cachedAttributes(const std::string &fh, fattr *attributes) {
+  pthread_mutex_lock(&attr_mutex);
+  auto cached = attr_map.find(fh);
+  bool found = cached != attr_map.end();
+  if (found) *attributes = cached->second.attributes;
+  pthread_mutex_unlock(&attr_mutex);
+  return found;
+}
+
+static void forgetAttributes(const std::string &fh) {
+  pthread_mutex_lock(&attr_mutex);
+  attr_map.erase(fh);
+  pthread_mutex_unlock(&attr_mutex);
+}
+
+// Makes the cached attributes of the file with handle fh, if any, reflect a
+// write up to end that is buffered rather than sent: the server would have
+// grown the file and set its times to about now.
+static void updateAttributesForWrite(const std::string &fh, size_t end) {
+  pthread_mutex_lock(&attr_mutex);
+  auto cached = attr_map.find(fh);
+  if (cached != attr_map.end()) {
+    fattr &attributes = cached->second.attributes;
+    if (attributes.size() < end) attributes.set_size(end);
+    std::chrono::nanoseconds now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::system_clock::now().time_since_epoch());
+    attributes.mutable_mtime()->set_seconds(now.count() / 1000000000);
+    attributes.mutable_mtime()->set_nseconds(now.count() % 1000000000);
+    *attributes.mutable_ctime() = attributes.mtime();
+  }
+  pthread_mutex_unlock(&attr_mutex);
+}
+
+// Makes stbuf account for writes to the file that the server has not seen.
+// Needed on top of updateAttributesForWrite() for attributes the server
+// sends before they are committed.
+static void addUncommittedWrites(const std::string &fh, struct stat *stbuf) {
+  FileLock lock(fh, false);
+  const FileWrites *writes = findWrites(fh);
+  if (writes != nullptr && (size_t) stbuf->st_size < writes->uncommitted_end) {
+    stbuf->st_size = writes->uncommitted_end;
+  }
+}
+
+// Notes that the application asked for size bytes at offset of the file
+// with handle fh and got data_size, and reads ahead of it if it reads the
+// file sequentially, up to the end of the file as far as the client knows.
+// Nothing is read ahead of a file with uncommitted writes, as the server
+// may not have applied them yet. The caller holds the file's FileLock.
+static void noteReadForReadAhead(const std::string &fh, size_t size, size_t offset, size_t data_size) {
+  if (!readAhead.enabled()) return;
+  bool may_read_ahead = data_size == size && !hasUncommittedWrites(fh);
+  std::vector<uint64_t> wanted = readAhead.noteRead(fh, offset, data_size, may_read_ahead);
+  fattr attributes;
+  uint64_t file_size = cachedAttributes(fh, &attributes) ? attributes.size() : UINT64_MAX;
+  wanted.erase(std::remove_if(wanted.begin(), wanted.end(), [&fh, file_size](uint64_t index) {
+	return index * CLIENT_BLOCK_SIZE >= file_size || dataCache.contains(fh, index);
+      }), wanted.end());
+  readAhead.readAhead(fh, wanted);
+}
 
   
 class NFSClient {
  public:
-  NFSClient(std::shared_ptr<Channel> channel)
-      : stub_(NFS::NewStub(channel)) {}
+  NFSClient(std::shared_ptr<Channel> channel, std::shared_ptr<NFS::Stub> stub)
+      : channel_(channel), stub_(stub), op_(kOpGetattr) {}
+
+  // Counts the RPCs sent until it goes out of scope towards op.
+  class OpScope {
+   public:
+    OpScope(NFSClient *client, ClientOp op)
+      : client_(client), previous_(client->op_) {
+      client->op_ = op;
+    }
+
+    ~OpScope() { client_->op_ = previous_; }
+
+   private:
+    NFSClient *client_;
+    ClientOp previous_;
+  };
 
   int NFSPROC_GETATTR(const char *c_path, struct stat *stbuf) {
-    if (fh_map.find(std::string(c_path)) == fh_map.end()) {
-      int res = NFSPROC_LOOKUP(c_path);
+    OpScope scope(this, kOpGetattr);
+    std::string fh;
+    HandleLookup known = handleCache.lookup(c_path, &fh);
+    if (known == kHandleMissing) {
+      ++clientStats.missing_hits;
+      return -2;
+    }
+    if (known == kHandleUnknown) {
+      int res = NFSPROC_LOOKUP(c_path, &fh);
       if (res != 0) return -2;  // File does not exist at server!
     }
     
-    const char *path = fh_map[std::string(c_path)].c_str();
+    const char *path = fh.c_str();
+    if (lookupAttributes(path, stbuf)) {
+      ++clientStats.attr_hits;
+      addUncommittedWrites(path, stbuf);
+      return 0;
+    }
   
     // Data we are sending to the server.
     GETATTRargs getAttrArgs;
@@ -93,16 +706,9 @@ class NFSClient {
     if (status.ok() && getAttrRes.has_resok()) {
       if (getAttrRes.resok().has_obj_attributes()) {
       	// Populate the stbuf data structure using the getAttrRes.
-      	switch(getAttrRes.resok().obj_attributes().type()) {
-      	case fattr::NFSDIR: stbuf->st_mode |= S_IFDIR; break;
-      	case fattr::NFSREG: stbuf->st_mode |= S_IFREG; break;
-      	default: break;
-      	}
-      	stbuf->st_size = getAttrRes.resok().obj_attributes().size();
-      	stbuf->st_ino = getAttrRes.resok().obj_attributes().fileid();
-      	stbuf->st_atime = getAttrRes.resok().obj_attributes().atime().seconds();
-      	stbuf->st_mtime = getAttrRes.resok().obj_attributes().mtime().seconds();
-      	stbuf->st_ctime = getAttrRes.resok().obj_attributes().ctime().seconds();
+      	fillStat(getAttrRes.resok().obj_attributes(), stbuf);
+	storeAttributes(path, getAttrRes.resok().obj_attributes());
+	addUncommittedWrites(path, stbuf);
       	return 0;
       } else {
 	return -2;
@@ -117,10 +723,17 @@ class NFSClient {
   }
   
   int NFSPROC_SETATTR(const char *c_path, size_t size) {
-    if (fh_map.find(std::string(c_path)) == fh_map.end()) {
+    OpScope scope(this, kOpSetattr);
+    std::string fh;
+    if (handleCache.lookup(c_path, &fh) != kHandleFound) {
       return -1;
     }
-    const char *path = fh_map[std::string(c_path)].c_str();
+    const char *path = fh.c_str();
+    FileLock lock(fh, true);
+    // Uncommitted data past the new size must not grow the file again, and
+    // writes streamed before must reach the server before the truncation.
+    truncateUncommitted(path, size);
+    drainWriteStream(path);
     // Data we are sending to the server.
     SETATTRargs setAttrArgs;
     setAttrArgs.mutable_object()->set_data(path);
@@ -138,9 +751,15 @@ class NFSClient {
       // The actual RPC.
       status = stub_->NFSPROC_SETATTR(context.get(), setAttrArgs, &setAttrRes);
     } while (isRetryRequiredForStatus(status, retry_interval));
+    forgetAttributes(path);
 
     // Act upon its status.
     if (status.ok() && setAttrRes.has_resok()) {
+      storeAttributes(path, setAttrRes.resok().obj_wcc());
+      dataCache.truncate(path, size);
+      readAhead.invalidate(path);
+      storeDataVersion(path, setAttrRes.resok().obj_wcc());
+      ++data_changes;
       return 0;
     } else {
       #ifdef DEBUG
@@ -152,13 +771,60 @@ class NFSClient {
     }
   }
 
-  // Assambles the client's payload, sends it and presents the response back
-  // from the server.
+  // Reads from the data cache if it has the whole range. Otherwise reads
+  // the blocks covering the range, from those read ahead if it has them all
+  // or else from the server, and caches them. The server does not read back
+  // unstable writes it has not flushed yet, and never saw those still
+  // dirty, so the client's own uncommitted writes are laid over what it
+  // returns. Either way, the read may set off reading ahead. Reads of a file
+  // run side by side, but not beside writes to it.
   int NFSPROC_READ(const char *c_path, char *buf, size_t buf_size, size_t offset) {
-    if (fh_map.find(std::string(c_path)) == fh_map.end()) {
+    OpScope scope(this, kOpRead);
+    std::string fh;
+    if (handleCache.lookup(c_path, &fh) != kHandleFound) {
       return -1;
     }
-    const char *path = fh_map[std::string(c_path)].c_str();
+    const char *path = fh.c_str();
+    FileLock lock(fh, false);
+    if (!dataCache.enabled()) {
+      long res = readFromReadAhead(path, buf, buf_size, offset);
+      if (res < 0) res = readFromServer(path, buf, buf_size, offset);
+      if (res < 0) return -1;
+      size_t data_size = overlayUncommittedWrites(path, buf, buf_size, offset, res);
+      noteReadForReadAhead(path, buf_size, offset, data_size);
+      return data_size;
+    }
+    long cached = dataCache.read(path, buf, buf_size, offset);
+    if (cached >= 0) {
+      ++clientStats.data_hits;
+      noteReadForReadAhead(path, buf_size, offset, cached);
+      return cached;
+    }
+    ++clientStats.data_misses;
+
+    size_t start = offset / CLIENT_BLOCK_SIZE * CLIENT_BLOCK_SIZE;
+    size_t end = (offset + buf_size + CLIENT_BLOCK_SIZE - 1) / CLIENT_BLOCK_SIZE * CLIENT_BLOCK_SIZE;
+    std::string blocks(end - start, '\0');
+    long res = readFromReadAhead(path, &blocks[0], blocks.size(), start);
+    if (res < 0) res = readFromServer(path, &blocks[0], blocks.size(), start);
+    if (res < 0) return -1;
+    size_t data_size = overlayUncommittedWrites(path, &blocks[0], blocks.size(), start, res);
+    dataCache.fill(path, blocks.data(), data_size, start, data_size < blocks.size());
+    size_t copied = 0;
+    if (data_size > offset - start) {
+      copied = std::min(buf_size, data_size - (offset - start));
+      memcpy(buf, blocks.data() + (offset - start), copied);
+    }
+    noteReadForReadAhead(path, buf_size, offset, copied);
+    return copied;
+  }
+
+  // Reads from the server with a single READ, or a stream of them for a
+  // large range.
+  int readFromServer(const char *path, char *buf, size_t buf_size, size_t offset) {
+    if (buf_size > READ_STREAM_THRESHOLD) {
+      return NFSPROC_READ_STREAM(path, buf, buf_size, offset);
+    }
     // Data we are sending to the server.
     READargs readArgs;
     readArgs.mutable_file()->set_data(path);
@@ -180,9 +846,75 @@ class NFSClient {
 
     // Act upon its status.
     if (status.ok() && readRes.has_resok()) {
-      std::string data = readRes.mutable_resok()->data();
-      std::size_t data_size = readRes.mutable_resok()->count();
-      strncpy(buf, data.c_str(), data_size);
+      if (readRes.resok().has_file_attributes()) storeAttributes(path, readRes.resok().file_attributes());
+      const std::string &data = readRes.resok().data();
+      std::size_t data_size = std::min(data.size(), buf_size);
+      memcpy(buf, data.data(), data_size);
+      return data_size;
+    } else {
+      #ifdef DEBUG
+      std::cout << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      #endif
+      return -1;
+    }
+  }
+
+  // Reads count bytes at offset of the file fh into data for a read-ahead
+  // thread. It is not retried: if it fails, the application's READ goes to
+  // the server itself.
+  bool NFSPROC_READ_AHEAD(const std::string &fh, uint64_t offset, size_t count, std::string *data) {
+    OpScope scope(this, kOpReadAhead);
+    READargs readArgs;
+    readArgs.mutable_file()->set_data(fh);
+    readArgs.set_offset(offset);
+    readArgs.set_count(count);
+
+    READres readRes;
+    std::unique_ptr<ClientContext> context(getClientContext());
+    Status status = stub_->NFSPROC_READ(context.get(), readArgs, &readRes);
+    recordAttempt(status, 0);
+    if (!status.ok() || !readRes.has_resok()) return false;
+    data->swap(*readRes.mutable_resok()->mutable_data());
+    ++clientStats.read_ahead_blocks;
+    return true;
+  }
+
+  // Reads a large range as a stream of fixed-size chunks over a single RPC.
+  int NFSPROC_READ_STREAM(const char *path, char *buf, size_t buf_size, size_t offset) {
+    OpScope scope(this, kOpReadStream);
+    // Data we are sending to the server.
+    READargs readArgs;
+    readArgs.mutable_file()->set_data(path);
+    readArgs.set_offset(offset);
+    readArgs.set_count(buf_size);
+
+    size_t data_size;
+    bool failed;
+    int retry_interval = RETRY;
+    Status status;
+    do {
+      data_size = 0;
+      failed = false;
+      std::unique_ptr<ClientContext> context(getClientContext());
+      std::unique_ptr<ClientReader<READres>> reader(stub_->NFSPROC_READ_STREAM(context.get(), readArgs));
+      READres readRes;
+      while (reader->Read(&readRes)) {
+	if (!readRes.has_resok()) {
+	  failed = true;
+	  continue;
+	}
+	if (readRes.resok().has_file_attributes()) storeAttributes(path, readRes.resok().file_attributes());
+	const std::string &data = readRes.resok().data();
+	size_t chunk_size = std::min(data.size(), buf_size - data_size);
+	memcpy(buf + data_size, data.data(), chunk_size);
+	data_size += chunk_size;
+      }
+      status = reader->Finish();
+    } while (isRetryRequiredForStatus(status, retry_interval));
+
+    // Act upon its status.
+    if (status.ok() && !failed) {
       return data_size;
     } else {
       #ifdef DEBUG
@@ -194,34 +926,53 @@ class NFSClient {
   }
 
   int NFSPROC_WRITE(const char *c_path, const char *buf, size_t buf_size, size_t offset, bool isUnstable = true) {
-    if (fh_map.find(std::string(c_path)) == fh_map.end()) {
+    OpScope scope(this, kOpWrite);
+    std::string fh;
+    if (handleCache.lookup(c_path, &fh) != kHandleFound) {
       return -1;
     }
-    const char *path = fh_map[std::string(c_path)].c_str();
+    const char *path = fh.c_str();
+
+    if (isUnstable) {
+      // Unstable writes are held as dirty extents of the file and sent,
+      // merged, later; see bufferWrite().
+      {
+	FileLock lock(fh, true);
+	FileWrites &writes = writesFor(fh);
+	writes.uncommitted_end = std::max(writes.uncommitted_end, offset + buf_size);
+	updateAttributesForWrite(fh, offset + buf_size);
+	dataCache.write(fh, buf, buf_size, offset);
+	readAhead.invalidate(fh);
+	bufferWrite(fh, buf, buf_size, offset);
+      }
+      flushAgedWrites();
+      return buf_size;
+    }
+    FileLock lock(fh, true);
+
     // Data we are sending to the server.
     WRITEargs writeArgs;
     writeArgs.mutable_file()->set_data(path);
     writeArgs.set_offset(offset);
     writeArgs.set_count(buf_size);
-    writeArgs.set_data(buf);
-
-    if (isUnstable) {
-      writeArgs.set_stable(WRITEargs::UNSTABLE);
-      // For unstable writes, we store the data in the client buffer.
-      std::string path_str(path);
-      if (client_buffer_map.find(path_str) == client_buffer_map.end()) {
-	std::vector<WRITEargs> request_vec;
-	client_buffer_map.insert(make_pair(path_str, request_vec));
-      }
-      // Create copy of the write data.
-      client_buffer_map[path_str].push_back(writeArgs);
-    } else {
-      writeArgs.set_stable(WRITEargs::DATA_SYNC);
-    }
+    writeArgs.set_data(buf, buf_size);
+    writeArgs.set_stable(WRITEargs::DATA_SYNC);
 
     // Container for the data we expect from the server.
     WRITEres writeRes;
+    int data_size = writeToServer(writeArgs, &writeRes);
+    if (data_size >= 0) {
+      dataCache.write(path, buf, data_size, offset);
+      readAhead.invalidate(path);
+      storeDataVersion(path, writeRes.resok().file_wcc());
+      ++data_changes;
+    }
+    return data_size;
+  }
 
+  // Sends writeArgs in a unary WRITE. Returns the number of bytes written,
+  // or -1. The caller holds the file's FileLock exclusively.
+  int writeToServer(const WRITEargs &writeArgs, WRITEres *writeRes) {
     int retry_interval = RETRY;
     Status status;
     do {
@@ -229,16 +980,17 @@ class NFSClient {
       // the server and/or tweak certain RPC behaviors.
       std::unique_ptr<ClientContext> context(getClientContext());
       // The actual RPC.
-      status = stub_->NFSPROC_WRITE(context.get(), writeArgs, &writeRes);
+      status = stub_->NFSPROC_WRITE(context.get(), writeArgs, writeRes);
     } while (isRetryRequiredForStatus(status, retry_interval));
 
     // Act upon its status.
-    if (status.ok() && writeRes.has_resok()) {
-      std::size_t data_size = writeRes.resok().count();
-      if (isUnstable) {
-	latest_write_server_verf = std::to_string(std::min(std::stol(writeRes.resok().verf()), std::stol(latest_write_server_verf)));
+    if (status.ok() && writeRes->has_resok()) {
+      storeAttributes(writeArgs.file().data(), writeRes->resok().file_wcc());
+      if (writeArgs.stable() == WRITEargs::UNSTABLE) {
+	FileWrites *writes = findWrites(writeArgs.file().data());
+	if (writes != nullptr) writes->verf = std::min(std::stol(writeRes->resok().verf()), writes->verf);
       }
-      return data_size;
+      return writeRes->resok().count();
     } else {
       #ifdef DEBUG
       std::cout << status.error_code() << ": " << status.error_message()
@@ -249,6 +1001,7 @@ class NFSClient {
   }
 
  int NFSPROC_MKDIR(const char *path, mode_t mode) {
+    OpScope scope(this, kOpMkdir);
    /*if (fh_map.find(std::string(c_path)) == fh_map.end()) {
       return -1;
     }
@@ -273,6 +1026,12 @@ class NFSClient {
 
     // Act upon its status.
     if (status.ok() && mkdirRes.has_resok()) {
+      const nfs::MKDIRresok &resok = mkdirRes.resok();
+      if (resok.obj().has_handle()) {
+	handleCache.insert(path, resok.obj().handle().data());
+	if (resok.has_obj_attributes()) storeAttributes(resok.obj().handle().data(), resok.obj_attributes().attributes());
+      }
+      storeParentAttributes(path, resok.dir_wcc());
       return 0;
     } else {
       #ifdef DEBUG
@@ -284,10 +1043,12 @@ class NFSClient {
   }
 
  int NFSPROC_RMDIR(const char *c_path) {
-    if (fh_map.find(std::string(c_path)) == fh_map.end()) {
+    OpScope scope(this, kOpRmdir);
+    std::string fh;
+    if (handleCache.lookup(c_path, &fh) != kHandleFound) {
       return -1;
     }
-    const char *path = fh_map[std::string(c_path)].c_str();
+    const char *path = fh.c_str();
     // Data we are sending to the server.
     RMDIRargs rmdirArgs;
     rmdirArgs.mutable_object()->mutable_dir()->set_data(path);
@@ -307,6 +1068,9 @@ class NFSClient {
     
     // Act upon its status.
     if (status.ok() && rmdirRes.has_resok()) {
+      handleCache.erase(c_path);
+      forgetAttributes(path);
+      storeParentAttributes(c_path, rmdirRes.resok().dir_wcc());
       return 0;
     } else {
       #ifdef DEBUG
@@ -318,6 +1082,7 @@ class NFSClient {
   }
 
  int NFSPROC_CREATE(const char *path, mode_t mode) {
+    OpScope scope(this, kOpCreate);
     // Data we are sending to the server.
     CREATEargs createArgs;
     createArgs.mutable_where()->mutable_dir()->set_data(path);
@@ -337,6 +1102,18 @@ class NFSClient {
 
     // Act upon its status.
     if (status.ok() && createRes.has_resok()) {
+      const nfs::CREATEresok &resok = createRes.resok();
+      if (resok.obj().has_handle()) {
+	handleCache.insert(path, resok.obj().handle().data());
+	if (resok.has_obj_attributes()) storeAttributes(resok.obj().handle().data(), resok.obj_attributes().attributes());
+      }
+      storeParentAttributes(path, resok.dir_wcc());
+      if (resok.obj().has_handle()) {
+	FileLock lock(resok.obj().handle().data(), true);
+	dataCache.invalidate(resok.obj().handle().data());
+	readAhead.invalidate(resok.obj().handle().data());
+	++data_changes;
+      }
       return 0;
     } else {
       #ifdef DEBUG
@@ -348,10 +1125,13 @@ class NFSClient {
   }
 
  int NFSPROC_REMOVE(const char *c_path) {
-    if (fh_map.find(std::string(c_path)) == fh_map.end()) {
+    OpScope scope(this, kOpRemove);
+    std::string fh;
+    if (handleCache.lookup(c_path, &fh) != kHandleFound) {
       return -1;
     }
-    const char *path = fh_map[std::string(c_path)].c_str();
+    const char *path = fh.c_str();
+    FileLock lock(fh, true);
     // Data we are sending to the server.
     REMOVEargs removeArgs;
     removeArgs.mutable_object()->mutable_dir()->set_data(path);
@@ -372,6 +1152,14 @@ class NFSClient {
 
     // Act upon its status.
     if (status.ok() && removeRes.has_resok()) {
+      handleCache.erase(c_path);
+      forgetAttributes(path);
+      dataCache.invalidate(path);
+      readAhead.invalidate(path);
+      // Whatever was written to the file is gone with it.
+      closeWriteStream(path);
+      forgetWrites(path);
+      storeParentAttributes(c_path, removeRes.resok().dir_wcc());
       return 0;
     } else {
       #ifdef DEBUG
@@ -383,18 +1171,27 @@ class NFSClient {
   }
 
   int NFSPROC_COMMIT(const char *c_path) {
-    if (fh_map.find(std::string(c_path)) == fh_map.end()) {
+    OpScope scope(this, kOpCommit);
+    std::string fh;
+    if (handleCache.lookup(c_path, &fh) != kHandleFound) {
       return -1;
     }
-    const char *path = fh_map[std::string(c_path)].c_str();
+    const char *path = fh.c_str();
+    FileLock lock(fh, true);
     // Data we are sending to the server.
     COMMITargs commitArgs;
     commitArgs.mutable_file()->set_data(path);
     commitArgs.set_offset(0);  // Assumption: Entire file is synced.
     commitArgs.set_count(0);   // Assumption: Entire file is synced.
+
+    // Send what is still dirty and wait for the server to acknowledge
+    // everything streamed so far.
+    flushDirty(commitArgs.file().data());
+    drainWriteStream(commitArgs.file().data());
     
     // Check if we have any pending buffer to commit, at all.
-    if (client_buffer_map.find(commitArgs.file().data()) == client_buffer_map.end()) {
+    FileWrites *writes = findWrites(commitArgs.file().data());
+    if (writes == nullptr) {
       return 0; // nothing to commit, just return.
     }
     
@@ -413,7 +1210,10 @@ class NFSClient {
 
     // Act upon its status.
     if (status.ok() && commitRes.has_resok()) {
-      return releaseBuffersBasedOnCommitStatus(commitArgs.file().data(), commitRes);
+      storeAttributes(commitArgs.file().data(), commitRes.resok().file_wcc());
+      int res = releaseBuffersBasedOnCommitStatus(commitArgs.file().data(), commitRes, writes->stream_broken);
+      if (res == 0) storeDataVersion(commitArgs.file().data(), commitRes.resok().file_wcc());
+      return res;
     } else {
       #ifdef DEBUG
       std::cout << status.error_code() << ": " << status.error_message()
@@ -424,7 +1224,10 @@ class NFSClient {
   }
  
 
- int NFSPROC_LOOKUP(const char *path) {
+  // Looks up the handle of the file at path, and stores it in fh if given.
+  // A path the server does not find is remembered as missing for negttl.
+ int NFSPROC_LOOKUP(const char *path, std::string *fh = nullptr) {
+    OpScope scope(this, kOpLookup);
     // Data we are sending to the server.
     LOOKUPargs lookupArgs;
     lookupArgs.mutable_what()->mutable_dir()->set_data(path);
@@ -447,7 +1250,159 @@ class NFSClient {
     if (status.ok() && lookupRes.has_resok()) {
       std::string key(path);
       std::string value = lookupRes.resok().object().data();
-      fh_map.insert(make_pair(key, value));
+      handleCache.insert(key, value);
+      if (lookupRes.resok().has_obj_attributes()) storeAttributes(value, lookupRes.resok().obj_attributes().attributes());
+      if (fh != nullptr) fh->swap(value);
+      return 0;
+    } else {
+      if (status.ok()) handleCache.insertMissing(path, std::chrono::seconds(negttl_s));
+      #ifdef DEBUG
+      std::cout << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      #endif
+      return -1;
+    }
+  }
+
+  // Looks up path and checks the file's cached data against the attributes
+  // the server returns (close-to-open consistency). Unless the file is
+  // opened write-only, or its first block is cached already, the first
+  // OPEN_PREFETCH_SIZE bytes are read into the cache in the same round trip,
+  // for the read that usually follows an open.
+  int NFSPROC_OPEN(const char *path, int flags) {
+    std::string fh;
+    bool known = handleCache.lookup(path, &fh) == kHandleFound;
+    if (known) {
+      FileLock lock(fh, true);
+      flushDirty(fh);
+    }
+    if ((flags & O_ACCMODE) == O_WRONLY || (flags & O_TRUNC) || !dataCache.enabled() ||
+	(known && dataCache.contains(fh, 0))) {
+      if (NFSPROC_LOOKUP(path, &fh) != 0) return -1;
+      FileLock lock(fh, false);
+      revalidateData(fh);
+      return 0;
+    }
+    // The READ has no file handle of its own, so it reads the file the
+    // LOOKUP before it found. It runs outside the file's lock, so its data
+    // is only cached if nothing changed the file meanwhile.
+    long changes = data_changes;
+    COMPOUNDargs compoundArgs;
+    compoundArgs.add_argarray()->mutable_lookup()->mutable_what()->mutable_dir()->set_data(path);
+    READargs *readArgs = compoundArgs.add_argarray()->mutable_read();
+    readArgs->set_offset(0);
+    readArgs->set_count(OPEN_PREFETCH_SIZE);
+
+    COMPOUNDres compoundRes;
+    bool ok = NFSPROC_COMPOUND(compoundArgs, &compoundRes);
+    if (compoundRes.resarray_size() == 0 || !compoundRes.resarray(0).lookup().has_resok()) {
+      return -1;
+    }
+    const nfs::LOOKUPresok &lookup = compoundRes.resarray(0).lookup().resok();
+    fh = lookup.object().data();
+    handleCache.insert(path, fh);
+    if (lookup.has_obj_attributes()) storeAttributes(fh, lookup.obj_attributes().attributes());
+    FileLock lock(fh, false);
+    revalidateData(fh);
+    if (ok && !hasUncommittedWrites(fh) && data_changes == changes) {
+      const nfs::READresok &resok = compoundRes.resarray(1).read().resok();
+      dataCache.fill(fh, resok.data().data(), resok.data().size(), 0, resok.eof());
+    }
+    return 0;
+  }
+
+  // Drops the cached data of the file with handle fh if the attributes just
+  // received for it show that it changed since the data was read. Data of
+  // a file with uncommitted writes is this client's own and is kept. Blocks
+  // read ahead are dropped regardless, and reading ahead starts afresh. The
+  // caller holds the file's FileLock.
+  void revalidateData(const std::string &fh) {
+    readAhead.invalidate(fh);
+    if (hasUncommittedWrites(fh)) return;
+    fattr attributes;
+    if (!cachedAttributes(fh, &attributes)) {
+      dataCache.invalidate(fh);
+    } else if (!dataCache.revalidate(fh, fileVersion(attributes))) {
+      ++clientStats.data_invalidations;
+    }
+  }
+
+  // Sends the operations of compoundArgs in one round trip. Returns true if
+  // all of them succeeded; compoundRes has the results of those that ran.
+  bool NFSPROC_COMPOUND(const COMPOUNDargs &compoundArgs, COMPOUNDres *compoundRes) {
+    OpScope scope(this, kOpCompound);
+    int retry_interval = RETRY;
+    Status status;
+    do {
+      compoundRes->Clear();
+      std::unique_ptr<ClientContext> context(getClientContext());
+      status = stub_->NFSPROC_COMPOUND(context.get(), compoundArgs, compoundRes);
+    } while (isRetryRequiredForStatus(status, retry_interval));
+
+    if (status.ok()) {
+      return compoundRes->ok();
+    } else {
+      #ifdef DEBUG
+      std::cout << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      #endif
+      return false;
+    }
+  }
+
+  // Lists a directory over one streamed RPC. Every entry is passed to filler
+  // with its attributes, and its file handle is remembered so that opening
+  // it needs no LOOKUP. A broken stream is resumed after the last entry
+  // received instead of starting over.
+  int NFSPROC_READDIRPLUS(const char *c_path, void *buf, remote_fill_dir_t filler) {
+    OpScope scope(this, kOpReaddirplus);
+    std::string fh;
+    if (handleCache.lookup(c_path, &fh) != kHandleFound) {
+      if (NFSPROC_LOOKUP(c_path, &fh) != 0) return -1;
+    }
+    std::string prefix(c_path);
+    if (prefix.empty() || prefix.back() != '/') prefix += '/';
+
+    // Data we are sending to the server.
+    READDIRargs readDirArgs;
+    readDirArgs.mutable_dir()->set_data(fh);
+
+    filler(buf, ".", nullptr, 0);
+    filler(buf, "..", nullptr, 0);
+
+    bool failed = false;
+    bool eof = false;
+    int retry_interval = RETRY;
+    Status status;
+    do {
+      std::unique_ptr<ClientContext> context(getClientContext());
+      std::unique_ptr<ClientReader<READDIRres>> reader(stub_->NFSPROC_READDIRPLUS(context.get(), readDirArgs));
+      READDIRres readDirRes;
+      while (reader->Read(&readDirRes)) {
+	if (!readDirRes.has_resok()) {
+	  failed = true;
+	  context->TryCancel();
+	  break;
+	}
+	for (const nfs::entry &entry : readDirRes.resok().entries()) {
+	  struct stat st;
+	  memset(&st, 0, sizeof(st));
+	  st.st_ino = entry.fileid();
+	  if (entry.has_name_attributes()) fillStat(entry.name_attributes().attributes(), &st);
+	  if (entry.has_name_handle()) {
+	    handleCache.insert(prefix + entry.name(), entry.name_handle().handle().data());
+	    if (entry.has_name_attributes()) storeAttributes(entry.name_handle().handle().data(), entry.name_attributes().attributes());
+	  }
+	  filler(buf, entry.name().c_str(), &st, 0);
+	  readDirArgs.set_cookie(entry.cookie());
+	}
+	eof = readDirRes.resok().eof();
+      }
+      status = reader->Finish();
+    } while (!failed && !eof && isRetryRequiredForStatus(status, retry_interval));
+
+    // Act upon its status.
+    if (!failed && eof) {
       return 0;
     } else {
       #ifdef DEBUG
@@ -458,15 +1413,28 @@ class NFSClient {
     }
   }
 
+  // Makes the context of the next RPC attempt, which starts timing it.
   ClientContext* getClientContext() {
+    attempt_start_ = std::chrono::steady_clock::now();
     std::unique_ptr<ClientContext> client_context(new ClientContext);
+    // Queue the RPC while the channel reconnects, instead of failing it.
+    client_context->set_wait_for_ready(true);
     std::chrono::system_clock::time_point deadline = 
       std::chrono::system_clock::now() + std::chrono::milliseconds(RPC_TIMEOUT);
     client_context->set_deadline(deadline);
     return client_context.release();
   }
  
+  // Records the RPC attempt that just ended with status, retried after
+  // backoff_ms if it failed.
+  void recordAttempt(const Status &status, int backoff_ms) {
+    uint64_t latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now() - attempt_start_).count();
+    clientStats.recordRpc(op_, latency_ns, status.ok(), status.ok() ? 0 : backoff_ms);
+  }
+
   bool isRetryRequiredForStatus(const Status &status, int &retry_interval) {
+    recordAttempt(status, retry_interval);
     if (status.ok()) {
       return false;
     } else {
@@ -480,44 +1448,283 @@ class NFSClient {
     }
   }
   
-  int releaseBuffersBasedOnCommitStatus(const std::string &path, const COMMITres &commitRes) {
-    if (latest_write_server_verf.compare(commitRes.resok().verf()) != 0) {
+  // Adds an unstable write to the file's dirty extents. They are sent once
+  // they add up to wsize bytes, or once they have waited longer than
+  // WRITEBACK_MAX_AGE_MS, by a later write or the writeback thread (see
+  // flushAgedWrites()). An open or commit of the file sends what is left.
+  // The caller holds the file's FileLock exclusively.
+  void bufferWrite(const std::string &fh, const char *buf, size_t buf_size, size_t offset) {
+    DirtyFile &file = writesFor(fh).dirty;
+    addDirtyExtent(&file, buf, buf_size, offset);
+    ++clientStats.dirty_writes;
+    if (file.bytes >= wsize) flushDirty(fh);
+  }
+
+  // Sends the dirty data of every file that has waited longer than
+  // WRITEBACK_MAX_AGE_MS, looking at most every WRITEBACK_SCAN_MS. Takes the
+  // lock of each file it sends, so the caller holds none.
+  void flushAgedWrites() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    long now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+    long scan_ms = writeback_scan_ms;
+    if (now_ms < scan_ms || !writeback_scan_ms.compare_exchange_strong(scan_ms, now_ms + WRITEBACK_SCAN_MS)) {
+      return;
+    }
+    std::chrono::steady_clock::time_point aged = now - std::chrono::milliseconds(WRITEBACK_MAX_AGE_MS);
+    for (FileShard &shard : file_shards) {
+      std::vector<std::string> expired;
+      pthread_rwlock_rdlock(&shard.lock);
+      for (const auto &file : shard.files) {
+	const DirtyFile &dirty = file.second.dirty;
+	if (!dirty.extents.empty() && dirty.since < aged) expired.push_back(file.first);
+      }
+      pthread_rwlock_unlock(&shard.lock);
+      for (const std::string &expired_fh : expired) {
+	FileLock lock(expired_fh, true);
+	flushDirty(expired_fh);
+      }
+    }
+  }
+
+  // Sends the dirty extents of the file with handle fh as unstable writes
+  // of at most wsize bytes, kept in its FileWrites until committed.
+  // They go onto the file's write stream, acknowledged when it is closed on
+  // commit. If the stream is broken, they fall back to a unary write; the
+  // commit will then retransmit whatever the stream lost. The caller holds
+  // the file's FileLock exclusively, as for everything below.
+  void flushDirty(const std::string &fh) {
+    FileWrites *writes = findWrites(fh);
+    if (writes == nullptr || writes->dirty.extents.empty()) return;
+    DirtyFile file;
+    std::swap(file, writes->dirty);
+
+    OpScope scope(this, kOpWrite);
+    std::vector<WRITEargs> &request_vec = writes->sent;
+    for (const auto &extent : file.extents) {
+      for (size_t done = 0; done < extent.second.size(); done += wsize) {
+	size_t count = std::min(wsize, extent.second.size() - done);
+	request_vec.push_back(WRITEargs());
+	WRITEargs &writeArgs = request_vec.back();
+	writeArgs.mutable_file()->set_data(fh);
+	writeArgs.set_offset(extent.first + done);
+	writeArgs.set_count(count);
+	writeArgs.set_data(extent.second.data() + done, count);
+	writeArgs.set_stable(WRITEargs::UNSTABLE);
+	if (!pushToWriteStream(fh, writeArgs)) {
+	  WRITEres writeRes;
+	  writeToServer(writeArgs, &writeRes);
+	}
+      }
+    }
+  }
+
+  // Opens the file's write stream on first use and pushes writeArgs onto it.
+  // Returns false if the stream is broken.
+  bool pushToWriteStream(const std::string &path, const WRITEargs &writeArgs) {
+    std::unique_ptr<WriteStream> &stream = writesFor(path).stream;
+    if (!stream) {
+      stream.reset(new WriteStream);
+      stream->opened = std::chrono::steady_clock::now();
+      stream->writer = stub_->NFSPROC_WRITE_STREAM(&stream->context, &stream->writeRes);
+    }
+    ++clientStats.stream_writes;
+    return stream->writer->Write(writeArgs);
+  }
+
+  // Waits until the server has taken every write streamed to the file so
+  // far, so that the next RPC is ordered after them. A broken stream is
+  // remembered for the commit to retransmit.
+  void drainWriteStream(const std::string &fh) {
+    if (!closeWriteStream(fh)) writesFor(fh).stream_broken = true;
+  }
+
+  // Closes the file's write stream, if any. Returns false if the server did
+  // not acknowledge every write pushed onto it.
+  bool closeWriteStream(const std::string &path) {
+    FileWrites *writes = findWrites(path);
+    if (writes == nullptr || !writes->stream) return true;
+    std::unique_ptr<WriteStream> stream(std::move(writes->stream));
+
+    stream->writer->WritesDone();
+    Status status = stream->writer->Finish();
+    // A stream is never retried: what it lost is retransmitted instead.
+    clientStats.recordRpc(kOpWriteStream, std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now() - stream->opened).count(), status.ok(), 0);
+    if (!status.ok() || !stream->writeRes.has_resok()) {
+      #ifdef DEBUG
+      std::cout << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      #endif
+      return false;
+    }
+    writes->verf = std::min(std::stol(stream->writeRes.resok().verf()), writes->verf);
+    storeAttributes(path, stream->writeRes.resok().file_wcc());
+    return true;
+  }
+  
+  int releaseBuffersBasedOnCommitStatus(const std::string &path, const COMMITres &commitRes, bool retransmit) {
+    // Each file keeps the verifiers of its own writes, so that a commit of
+    // another file cannot hide a restart from this one.
+    if (retransmit || std::to_string(findWrites(path)->verf) != commitRes.resok().verf()) {
+      if (retransmit) ++clientStats.broken_streams;
+      else ++clientStats.verifier_mismatches;
       #ifdef DEBUG
       printf("versions don't match\n");
       #endif
       // Server has crashed and come back since the latest write, hence 
       // all pending uncommitted writes need to be retransmitted.
-      std::vector<WRITEargs> &request_vec = client_buffer_map[path];
-      for (WRITEargs &writeArgs : request_vec) {
-	int res = NFSPROC_WRITE(writeArgs.file().data().c_str(), writeArgs.data().c_str(), writeArgs.count(), writeArgs.offset(), false);  // The write is stable;
-	if (res < 0) return res;
-      }
+      int res = retransmitBuffers(path);
+      if (res < 0) return res;
     }
     
-    client_buffer_map.erase(path);  // Release the buffer.
-    latest_write_server_verf = std::to_string(std::numeric_limits<long>::max());
+    forgetWrites(path);  // Release the buffer.
+    ++data_changes;
+    return 0;
+  }
+
+  // Resends the buffered writes to the file with handle path, packed into
+  // compounds of up to COMPOUND_MAX_BYTES of data that each end with a COMMIT.
+  // A compound is sent again if the server restarted between its writes and
+  // its COMMIT, which shows as a write verifier other than the COMMIT's.
+  int retransmitBuffers(const std::string &path) {
+    const std::vector<WRITEargs> &request_vec = findWrites(path)->sent;
+    size_t next = 0;
+    while (next < request_vec.size()) {
+      COMPOUNDargs compoundArgs;
+      size_t bytes = 0;
+      while (next < request_vec.size() && (bytes == 0 || bytes + request_vec[next].count() <= COMPOUND_MAX_BYTES)) {
+	WRITEargs *writeArgs = compoundArgs.add_argarray()->mutable_write();
+	*writeArgs = request_vec[next++];
+	writeArgs->mutable_file()->set_data(path);
+	writeArgs->set_stable(WRITEargs::UNSTABLE);
+	bytes += writeArgs->count();
+	++clientStats.retransmitted_writes;
+      }
+      clientStats.retransmitted_bytes += bytes;
+      compoundArgs.add_argarray()->mutable_commit()->mutable_file()->set_data(path);
+
+      int attempts = 0;
+      while (1) {
+	COMPOUNDres compoundRes;
+	if (!NFSPROC_COMPOUND(compoundArgs, &compoundRes)) return -1;
+	const std::string &verf = compoundRes.resarray(compoundRes.resarray_size() - 1).commit().resok().verf();
+	bool committed = true;
+	for (const nfs_resop &resop : compoundRes.resarray()) {
+	  if (resop.has_write() && resop.write().resok().verf() != verf) committed = false;
+	}
+	if (committed) break;
+	if (++attempts == COMPOUND_RETRIES) return -1;
+	++clientStats.compound_resends;
+      }
+    }
     return 0;
   }
 
  private:
-  std::unique_ptr<NFS::Stub> stub_;
+  std::shared_ptr<Channel> channel_;
+  std::shared_ptr<NFS::Stub> stub_;
+  ClientOp op_;  // What the RPCs sent now are counted towards.
+  std::chrono::steady_clock::time_point attempt_start_;
 };
 
-NFSClient* getNFSClient() {
-  // Instantiate the client. It requires a channel, out of which the actual RPCs
-  // are created. This channel models a connection to an endpoint (in this case,
-  // localhost at port 50051). We indicate that the channel isn't authenticated
-  // (use of InsecureChannelCredentials()).
+// The one channel to the server, and the stub over it, shared by every
+// operation of the mount. gRPC reconnects the channel on its own when the
+// connection drops; RPCs issued meanwhile wait for it (see
+// getClientContext()).
+static std::shared_ptr<Channel> server_channel;
+static std::shared_ptr<NFS::Stub> server_stub;
+static pthread_once_t server_channel_once = PTHREAD_ONCE_INIT;
+
+// Follows the connectivity of the channel for the stats, and asks it to
+// connect again whenever it goes idle, so that the next RPC finds it ready.
+static void* watchChannel(void *args) {
+  std::chrono::steady_clock::time_point not_ready_since = std::chrono::steady_clock::now();
+  grpc_connectivity_state state = server_channel->GetState(true);
+  while (1) {
+    std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now() + std::chrono::hours(1);
+    if (!server_channel->WaitForStateChange(state, deadline)) continue;
+    grpc_connectivity_state next = server_channel->GetState(true);
+    if (next == GRPC_CHANNEL_READY && state != GRPC_CHANNEL_READY) {
+      ++clientStats.connects;
+      clientStats.connect_wait_ms += std::chrono::duration_cast<std::chrono::milliseconds>(
+	  std::chrono::steady_clock::now() - not_ready_since).count();
+    } else if (next != GRPC_CHANNEL_READY && state == GRPC_CHANNEL_READY) {
+      ++clientStats.disconnects;
+      not_ready_since = std::chrono::steady_clock::now();
+    }
+    state = next;
+  }
+  return nullptr;
+}
+
+// Sends the dirty data of files that are no longer written to once it has
+// aged, which a later write would otherwise have to do.
+static void* writeBack(void *args) {
+  while (1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(WRITEBACK_SCAN_MS));
+    NFSClient nfs_client(server_channel, server_stub);
+    nfs_client.flushAgedWrites();
+  }
+  return nullptr;
+}
+
+static bool readAheadFromServer(const std::string &fh, uint64_t offset, size_t count, std::string *data) {
+  NFSClient nfs_client(server_channel, server_stub);
+  return nfs_client.NFSPROC_READ_AHEAD(fh, offset, count, data);
+}
+
+static void openServerChannel() {
+  // The channel isn't authenticated (use of InsecureChannelCredentials()).
+  // A lost server is retried quickly rather than with gRPC's default
+  // backoff of up to two minutes.
   std::string connection = std::string(SERVER) + ":50051";
-  std::shared_ptr<Channel> channel = grpc::CreateChannel(connection, grpc::InsecureChannelCredentials());
-  std::chrono::system_clock::time_point deadline = 
-      std::chrono::system_clock::now() + std::chrono::milliseconds(CONN_TIMEOUT);
-  channel->WaitForConnected(deadline);
-  
-  std::unique_ptr<NFSClient> nfs_client(new NFSClient(channel));    
+  grpc::ChannelArguments args;
+  args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, RECONNECT_BACKOFF_MIN_MS);
+  args.SetInt(GRPC_ARG_MIN_RECONNECT_BACKOFF_MS, RECONNECT_BACKOFF_MIN_MS);
+  args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, RECONNECT_BACKOFF_MAX_MS);
+  server_channel = grpc::CreateCustomChannel(connection, grpc::InsecureChannelCredentials(), args);
+  server_stub = NFS::NewStub(server_channel);
+
+  pthread_t watcher;
+  if (pthread_create(&watcher, nullptr, &watchChannel, nullptr) == 0) pthread_detach(watcher);
+  pthread_t writer;
+  if (pthread_create(&writer, nullptr, &writeBack, nullptr) == 0) pthread_detach(writer);
+  readAhead.start(&readAheadFromServer);
+}
+
+NFSClient* getNFSClient() {
+  pthread_once(&server_channel_once, &openServerChannel);
+  std::unique_ptr<NFSClient> nfs_client(new NFSClient(server_channel, server_stub));
   return nfs_client.release();
 }
 
+void remote_init() {
+  pthread_once(&server_channel_once, &openServerChannel);
+}
+
+void remote_set_wsize(int bytes) {
+  wsize = std::min(std::max(bytes, 1), WSIZE_MAX);
+}
+
+void remote_set_read_ahead_kb(int kb) {
+  readAhead.setMaxWindow(kb * 1024L);
+}
+
+void remote_set_data_cache_mb(int mb) {
+  dataCache.setCapacity(mb * 1024L * 1024L);
+}
+
+void remote_set_negative_ttl(int seconds) {
+  negttl_s = seconds;
+}
+
+void remote_set_attr_timeouts(int acregmin, int acregmax, int acdirmin, int acdirmax) {
+  if (acregmin >= 0) acregmin_s = acregmin;
+  if (acregmax >= 0) acregmax_s = acregmax;
+  if (acdirmin >= 0) acdirmin_s = acdirmin;
+  if (acdirmax >= 0) acdirmax_s = acdirmax;
+}
+
 int remote_getattr(const char *path, struct stat *stbuf) {
   std::unique_ptr<NFSClient> nfs_client(getNFSClient());
   int res = nfs_client->NFSPROC_GETATTR(path, stbuf);
@@ -564,12 +1771,18 @@ int remote_rmdir(const char *path) {
   return res;
 }
 
-int remote_open(const char *path, mode_t mode) {
+int remote_access(const char *path) {
   std::unique_ptr<NFSClient> nfs_client(getNFSClient());
   int res = nfs_client->NFSPROC_LOOKUP(path);
   return res;
 }
 
+int remote_open(const char *path, int flags) {
+  std::unique_ptr<NFSClient> nfs_client(getNFSClient());
+  int res = nfs_client->NFSPROC_OPEN(path, flags);
+  return res;
+}
+
 int remote_create(const char *path, int flags, mode_t mode) {
   std::unique_ptr<NFSClient> nfs_client(getNFSClient());
   int res = nfs_client->NFSPROC_CREATE(path, mode);
@@ -581,3 +1794,34 @@ int remote_unlink(const char *path) {
   int res = nfs_client->NFSPROC_REMOVE(path);
   return res;
 }
+
+int remote_readdir(const char *path, void *buf, remote_fill_dir_t filler) {
+  std::unique_ptr<NFSClient> nfs_client(getNFSClient());
+  int res = nfs_client->NFSPROC_READDIRPLUS(path, buf, filler);
+  return res;
+}
+
+char* remote_stats() {
+  size_t buffered_writes = 0;
+  size_t buffered_bytes = 0;
+  size_t buffered_files = 0;
+  size_t dirty_bytes = 0;
+  size_t open_streams = 0;
+  for (FileShard &shard : file_shards) {
+    pthread_rwlock_rdlock(&shard.lock);
+    for (const auto &file : shard.files) {
+      const FileWrites &writes = file.second;
+      buffered_writes += writes.sent.size();
+      for (const WRITEargs &writeArgs : writes.sent) buffered_bytes += writeArgs.data().size();
+      dirty_bytes += writes.dirty.bytes;
+      if (writes.stream) ++open_streams;
+    }
+    buffered_files += shard.files.size();
+    pthread_rwlock_unlock(&shard.lock);
+  }
+  size_t handles, missing_paths;
+  handleCache.count(&handles, &missing_paths);
+  std::string text = clientStats.render(handles, missing_paths, dataCache.bytes(), readAhead.heldBytes(),
+					dirty_bytes, buffered_writes, buffered_bytes, buffered_files, open_streams);
+  return strdup(text.c_str());
+}
@@ -3,9 +3,32 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+// Read-only file at the root of the mount holding the client's counters.
+#define REMOTE_STATS_PATH "/.nfsstats"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
+  // Same as FUSE's fuse_fill_dir_t.
+  typedef int (*remote_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+
+  // Opens the connection to the server, shared by all the calls below.
+  // Called once the mount is up; the first call opens it otherwise.
+  void remote_init(void);
+  // Sets how long, in seconds, attributes received from the server answer
+  // getattr for files and directories. Negative values keep the defaults.
+  void remote_set_attr_timeouts(int acregmin, int acregmax, int acdirmin, int acdirmax);
+  // Sets how long, in seconds, a path the server did not find is taken not
+  // to exist; 0 asks the server every time.
+  void remote_set_negative_ttl(int seconds);
+  // Bounds the memory the client caches file data in; 0 turns it off.
+  void remote_set_data_cache_mb(int mb);
+  // Sets how far ahead of a file read sequentially the client reads at
+  // most; 0 turns read-ahead off.
+  void remote_set_read_ahead_kb(int kb);
+  // Sets the most data, in bytes, sent in one WRITE; small writes are
+  // merged up to it.
+  void remote_set_wsize(int bytes);
   int remote_setattr(const char *path, size_t size);
   int remote_getattr(const char *path, struct stat *stbuf);
   int remote_read(const char *path, char *buf, size_t buf_size, size_t offset);
@@ -13,9 +36,13 @@ extern "C" {
   int remote_fsync(const char *path);
   int remote_mkdir(const char *path, mode_t mode);
   int remote_rmdir(const char *path);  
-  int remote_open(const char *path, mode_t mode);
+  int remote_access(const char *path);
+  int remote_open(const char *path, int flags);
   int remote_create(const char *path, int flags, mode_t mode);
   int remote_unlink(const char *path);
+  int remote_readdir(const char *path, void *buf, remote_fill_dir_t filler);
+  // The contents of REMOTE_STATS_PATH, to be freed by the caller.
+  char* remote_stats(void);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,84 @@
+#ifndef _NFS_LATENCY_HISTOGRAM_H_
+#define _NFS_LATENCY_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <vector>
+
+#define HISTOGRAM_SUB_BITS 3                               // 8 buckets per power of two, within 12.5%.
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 46)     // Up to 2^47, over a day in ns.
+
+// Log-linear bucketing of non-negative values, shared by the server, which
+// counts latencies and sizes into these buckets, and nfsstat, which reads
+// percentiles back out of them. Values below HISTOGRAM_SUB_BUCKETS get a
+// bucket each; above, every power of two is split in HISTOGRAM_SUB_BUCKETS
+// equal buckets.
+inline int histogramBucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) return (int) value;
+  int power = 63 - __builtin_clzll(value);
+  int index = (power - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+    + (int) ((value >> (power - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+  return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// The smallest value counted in bucket index.
+inline uint64_t histogramBucketStart(int index) {
+  if (index < HISTOGRAM_SUB_BUCKETS) return index;
+  int power = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+  return (HISTOGRAM_SUB_BUCKETS + sub) << (power - HISTOGRAM_SUB_BITS);
+}
+
+// Counts of values per bucket, plus their sum.
+struct Histogram {
+  Histogram()
+    : buckets(HISTOGRAM_BUCKETS, 0), count(0), sum(0) {
+  }
+
+  void record(uint64_t value) {
+    ++buckets[histogramBucket(value)];
+    ++count;
+    sum += value;
+  }
+
+  void merge(const Histogram &other) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) buckets[i] += other.buckets[i];
+    count += other.count;
+    sum += other.sum;
+  }
+
+  // What was counted since earlier, a snapshot of the same counters.
+  Histogram since(const Histogram &earlier) const {
+    Histogram delta;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) delta.buckets[i] = buckets[i] - earlier.buckets[i];
+    delta.count = count - earlier.count;
+    delta.sum = sum - earlier.sum;
+    return delta;
+  }
+
+  // The value below which a fraction q of the values fall, as the middle
+  // of the bucket holding it. 0 if nothing was counted.
+  uint64_t percentile(double q) const {
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t) (q * count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+      seen += buckets[i];
+      if (seen > rank) {
+	uint64_t start = histogramBucketStart(i);
+	uint64_t end = (i + 1 < HISTOGRAM_BUCKETS) ? histogramBucketStart(i + 1) : start + 1;
+	return start + (end - start - 1) / 2;
+      }
+    }
+    return histogramBucketStart(HISTOGRAM_BUCKETS - 1);
+  }
+
+  uint64_t mean() const { return count == 0 ? 0 : sum / count; }
+
+  std::vector<uint64_t> buckets;
+  uint64_t count;
+  uint64_t sum;
+};
+
+#endif  // _NFS_LATENCY_HISTOGRAM_H_
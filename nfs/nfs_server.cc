@@ -1,5 +1,8 @@
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
+#include <getopt.h>
 #include <iostream>
 #include <memory>
 #include <pthread.h>
@@ -8,15 +11,27 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sstream>
+#include <thread>
 #include <grpc++/grpc++.h>
 
 #include "nfs.grpc.pb.h"
 #include "nfs_server_utilities.h"
+#include "nfs_server_stats.h"
+#include "nfs_server_io_engine.h"
+#include "nfs_server_block_cache.h"
+#include "nfs_server_group_commit.h"
+#include "nfs_server_wal.h"
 #include "nfs_server_batch_optimizer.h"
+#include "nfs_server_flusher.h"
+#include "nfs_server_streams.h"
+#include "nfs_server_zero_copy.h"
+#include "nfs_server_async.h"
 
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
+using grpc::ServerReader;
+using grpc::ServerWriter;
 using grpc::Status;
 
 using nfs::NFS;
@@ -62,42 +77,55 @@ using nfs::LOOKUPargs;
 using nfs::LOOKUPres;
 using nfs::LOOKUPresok;
 using nfs::LOOKUPresfail;
-  
+using nfs::READDIRargs;
+using nfs::READDIRres;
+using nfs::COMPOUNDargs;
+using nfs::COMPOUNDres;
+using nfs::nfs_argop;
+using nfs::nfs_resop;
+using nfs::STATSargs;
+using nfs::STATSres;
+
+// Returns the arguments of a compound operation with an empty file handle
+// (fh, within args) replaced by the current one, copying them into scratch
+// only if that is needed. A handle of their own becomes the current one.
+template <class Args>
+const Args* withCurrentHandle(const Args &args, const nfs_fh &fh, nfs_fh* (Args::*mutable_fh)(),
+			      Args *scratch, std::string *current_fh) {
+  if (!fh.data().empty()) {
+    *current_fh = fh.data();
+    return &args;
+  }
+  *scratch = args;
+  (scratch->*mutable_fh)()->set_data(*current_fh);
+  return scratch;
+}
 
-static const std::string SERVER_VERF = std::to_string(std::chrono::system_clock::now().time_since_epoch() / std::chrono::milliseconds(1));
-static BatchWriteOptimizer batchWriteOptimizer;
+void fillHistogram(const Histogram &histogram, nfs::histogram *out) {
+  out->set_count(histogram.count);
+  out->set_sum(histogram.sum);
+  int used = HISTOGRAM_BUCKETS;
+  while (used > 0 && histogram.buckets[used - 1] == 0) --used;
+  for (int i = 0; i < used; ++i) out->add_buckets(histogram.buckets[i]);
+}
 
 class NFSServiceImpl final : public NFS::Service {
   Status NFSPROC_GETATTR(ServerContext* context, const GETATTRargs* getAttrArgs,
 		         GETATTRres* getAttrRes) override {
-    std::unique_ptr<const std::string> server_path(getServerPath(getAttrArgs->object()));
+    StatTimer timer(kStatGetattr);
+    // Resolving the handle lstats the file already.
+    struct stat sb;
+    std::unique_ptr<const std::string> server_path(getServerPath(getAttrArgs->object(), &sb));
     if(server_path == NULL) {
       return Status::OK; 
     }
-    
-    struct stat sb;
-    int res = lstat(server_path->c_str(), &sb);
-    if (res == -1) { 
-      getAttrRes->mutable_resok();
-      return Status::OK;  // Failed to get attributes for the file.
-    } else {
-      // Populate fattr based on stat.
-      switch(sb.st_mode & S_IFMT) {
-      case S_IFDIR: getAttrRes->mutable_resok()->mutable_obj_attributes()->set_type(fattr::NFSDIR); break;
-      case S_IFREG: getAttrRes->mutable_resok()->mutable_obj_attributes()->set_type(fattr::NFSREG); break;
-      default: break;
-      }
-      getAttrRes->mutable_resok()->mutable_obj_attributes()->set_size(sb.st_size);
-      getAttrRes->mutable_resok()->mutable_obj_attributes()->set_fileid(sb.st_ino);
-      getAttrRes->mutable_resok()->mutable_obj_attributes()->mutable_atime()->set_seconds(sb.st_atime);
-      getAttrRes->mutable_resok()->mutable_obj_attributes()->mutable_mtime()->set_seconds(sb.st_mtime);
-      getAttrRes->mutable_resok()->mutable_obj_attributes()->mutable_ctime()->set_seconds(sb.st_ctime);
-      return Status::OK;
-    }
+    fillAttributes(sb, getAttrRes->mutable_resok()->mutable_obj_attributes());
+    return Status::OK;
   }  
 
   Status NFSPROC_SETATTR(ServerContext* context, const SETATTRargs* setAttrArgs,
 		         SETATTRres* setAttrRes) override {
+    StatTimer timer(kStatSetattr);
     std::unique_ptr<const std::string> server_path(getServerPath(setAttrArgs->object()));
      if(server_path == NULL)
     {
@@ -105,84 +133,161 @@ class NFSServiceImpl final : public NFS::Service {
       return Status::OK;
     }
 
+    // Buffered writes would otherwise land after the truncation.
+    batchWriteOptimizer.settle(setAttrArgs->object().data());
+    fdCache.invalidate(setAttrArgs->object().data());
+    mappedReads.beginTruncate(setAttrArgs->object().data());
+    struct stat before, after;
+    bool have_before = (lstat(server_path->c_str(), &before) != -1);
     int res = truncate(server_path->c_str(), setAttrArgs->new_attributes().size());
+    mappedReads.endTruncate(setAttrArgs->object().data());
+    blockCache.invalidate(setAttrArgs->object().data());
     if (res == -1) {
+      fillWcc(have_before ? &before : nullptr, nullptr, setAttrRes->mutable_resfail()->mutable_obj_wcc());
       return Status::OK;  // Failed to get attributes for the file.
     } else {
-      setAttrRes->mutable_resok();
+      bool have_after = (lstat(server_path->c_str(), &after) != -1);
+      fillWcc(have_before ? &before : nullptr, have_after ? &after : nullptr,
+	      setAttrRes->mutable_resok()->mutable_obj_wcc());
       return Status::OK;
     }
   }
 
   Status NFSPROC_READ(ServerContext* context, const READargs* readArgs,
 		      READres* readRes) override {
-    std::unique_ptr<const std::string> server_path(getServerPath(readArgs->file()));
-     if(server_path == NULL)
-    {
-	readRes->mutable_resfail();
-      //getAttrRes->mutable_resok();
-      return Status::OK;
-    }
+    StatTimer timer(kStatRead);
+    ScopedFileDescriptor fd(&fdCache, acquireFileDescriptor(readArgs->file().data()));
 
-    int fd = open(server_path->c_str(), O_RDONLY);
-
-    if (fd == -1) {
+    if (fd.get() == -1) {
       readRes->mutable_resfail();
       return Status::OK;
     } else {
-      std::unique_ptr<char> buf(new char[readArgs->count()]);
-      size_t bytes_read = pread(fd, buf.get(), readArgs->count(), readArgs->offset());
-      readRes->mutable_resok()->set_data(buf.get());
+      struct stat sb;
+      if (fstat(fd.get(), &sb) == -1) {
+	readRes->mutable_resfail();
+	return Status::OK;
+      }
+      // Never allocate more than one reply carries or the file still holds.
+      size_t offset = readArgs->offset();
+      size_t file_size = sb.st_size;
+      size_t count = (offset >= file_size) ? 0 : std::min((size_t) readArgs->count(), file_size - offset);
+      count = std::min(count, (size_t) READ_MAX_COUNT);
+
+      // Read straight into the reply, binary data included.
+      std::string *data = readRes->mutable_resok()->mutable_data();
+      data->resize(count);
+      ssize_t bytes_read = blockCache.read(readArgs->file().data(), fd.get(), &(*data)[0], count, offset);
+      if (bytes_read == -1) {
+	readRes->mutable_resfail();
+	return Status::OK;
+      }
+      data->resize(bytes_read);
       readRes->mutable_resok()->set_count(bytes_read);
-      close(fd);
+      readRes->mutable_resok()->set_eof(offset + bytes_read >= file_size);
+      fillAttributes(sb, readRes->mutable_resok()->mutable_file_attributes());
       return Status::OK;
     }
   }
 
+  Status NFSPROC_READ_STREAM(ServerContext* context, const READargs* readArgs,
+			     ServerWriter<READres>* writer) override {
+    StatTimer timer(kStatReadStream);
+    ReadStreamCursor cursor(*readArgs);
+    READres readRes;
+    while (cursor.next(&readRes)) {
+      // Write() blocks until the client has room for more, which bounds
+      // how far the server can run ahead of a slow reader.
+      if (!writer->Write(readRes)) break;  // The client went away.
+      readRes.Clear();
+    }
+    return Status::OK;
+  }
+
   Status NFSPROC_WRITE(ServerContext* context, const WRITEargs* writeArgs,
 		       WRITEres* writeRes) override {
-    std::unique_ptr<const std::string> server_path(getServerPath(writeArgs->file()));
-       if(server_path == NULL)
-    {
-        writeRes->mutable_resfail();
-      //getAttrRes->mutable_resok();
+    StatTimer timer(kStatWrite);
+    bool unstable = (writeArgs->stable() == WRITEargs::UNSTABLE);
+    if (unstable && batchWriteOptimizer.admitUnstableWrite()) {
+      // Unstable, fast, uncommitted writes with no fsync. The data only goes
+      // to disk when the batch optimizer flushes it, so no descriptor is needed.
+      // With the write-ahead log, the write is logged durably first.
+      // Read before buffering: if the write is lost, the verifier changes
+      // after this one.
+      std::string verf = serverVerifier();
+      uint64_t lsn = 0;
+      wcc_data wcc;
+      if (!bufferUnstableWrite(*writeArgs, &lsn, &wcc) || !syncUnstableWrites(lsn)) {
+	writeRes->mutable_resfail();
+	return Status::OK;
+      }
+      size_t bytes_written = writeArgs->count();
+      writeRes->mutable_resok()->set_count(bytes_written);
+      writeRes->mutable_resok()->set_verf(verf);
+      writeRes->mutable_resok()->set_committed(WRITEresok::UNSTABLE);
+      writeRes->mutable_resok()->mutable_file_wcc()->Swap(&wcc);
       return Status::OK;
     }
 
-    int fd = open(server_path->c_str(), O_WRONLY);
-    if (fd == -1) {
+    // Stable, slow, committed writes, including unstable ones turned away
+    // by a full buffer. Concurrent ones share their syncs. Buffered writes to
+    // the file must not land or be replayed over this one later; a write
+    // that was turned away may well have some.
+    #ifdef DEBUG
+    std::cout << "Stable data: " << writeArgs->data() << std::endl;
+    #endif
+    wcc_data wcc;
+    ssize_t bytes_written = writeStable(*writeArgs, unstable || writeAheadLog.enabled(), &wcc);
+    if (bytes_written == -1) {
       writeRes->mutable_resfail();
       return Status::OK;
-    } else {
-      if (writeArgs->stable() == WRITEargs::UNSTABLE) {
-	// Unstable, fast, uncommitted writes with no fsync.
-	const char *buf = writeArgs->data().c_str();
-	batchWriteOptimizer.createRequest(writeArgs->file().data(), writeArgs->offset(), writeArgs->count(), buf);
-	size_t bytes_written = writeArgs->count(); //pwrite(fd, buf, writeArgs->count(), writeArgs->offset());
-	writeRes->mutable_resok()->set_count(bytes_written);
-	writeRes->mutable_resok()->set_verf(SERVER_VERF);
-	writeRes->mutable_resok()->set_committed(WRITEresok::UNSTABLE);
-	close(fd);
-	return Status::OK;
-      } else {
-	// Stable, slow, committed writes with forced fsync.
-	const char *buf = writeArgs->data().c_str();
-	#ifdef DEBUG
-	std::cout << "Stable data: " << buf << std::endl;
-	#endif
-	size_t bytes_written = pwrite(fd, buf, writeArgs->count(), writeArgs->offset());
-	writeRes->mutable_resok()->set_count(bytes_written);
-	writeRes->mutable_resok()->set_verf(SERVER_VERF);
-	fsync(fd);
-	close(fd);
-	writeRes->mutable_resok()->set_committed(WRITEresok::DATA_SYNC);
-	return Status::OK;
-      }
     }
+    writeRes->mutable_resok()->mutable_file_wcc()->Swap(&wcc);
+    writeRes->mutable_resok()->set_count(bytes_written);
+    writeRes->mutable_resok()->set_verf(serverVerifier());
+    writeRes->mutable_resok()->set_committed(WRITEresok::DATA_SYNC);
+    return Status::OK;
+  }
+
+  Status NFSPROC_READDIR(ServerContext* context, const READDIRargs* readDirArgs,
+			 ServerWriter<READDIRres>* writer) override {
+    StatTimer timer(kStatReaddir);
+    ReadDirCursor cursor(*readDirArgs);
+    READDIRres readDirRes;
+    while (cursor.next(&readDirRes)) {
+      if (!writer->Write(readDirRes)) break;  // The client went away.
+      readDirRes.Clear();
+    }
+    return Status::OK;
+  }
+
+  Status NFSPROC_READDIRPLUS(ServerContext* context, const READDIRargs* readDirArgs,
+			     ServerWriter<READDIRres>* writer) override {
+    StatTimer timer(kStatReaddirplus);
+    ReadDirPlusCursor cursor(*readDirArgs);
+    READDIRres readDirRes;
+    while (cursor.next(&readDirRes)) {
+      if (!writer->Write(readDirRes)) break;  // The client went away.
+      readDirRes.Clear();
+    }
+    return Status::OK;
+  }
+
+  Status NFSPROC_WRITE_STREAM(ServerContext* context, ServerReader<WRITEargs>* reader,
+			      WRITEres* writeRes) override {
+    StatTimer timer(kStatWriteStream);
+    WriteStreamSink sink;
+    WRITEargs writeArgs;
+    while (reader->Read(&writeArgs)) {
+      sink.consume(&writeArgs);
+      writeArgs.Clear();
+    }
+    sink.finish(writeRes);
+    return Status::OK;
   }
 
    Status NFSPROC_LOOKUP(ServerContext* context, const LOOKUPargs* lookupArgs,
                          LOOKUPres* lookupRes) override {
+    StatTimer timer(kStatLookup);
     std::unique_ptr<const std::string> server_path(getPathName(lookupArgs->what().dir()));
     struct stat sb;
     int res = lstat(server_path->c_str(), &sb);
@@ -191,18 +296,27 @@ class NFSServiceImpl final : public NFS::Service {
       return Status::OK;  // Failed to get attributes for the file.
     } else {
 	long inode_no = (long) sb.st_ino;
+	handleIndex.insert(inode_no, *server_path);
 	std::string inode_str = std::to_string(inode_no);
 	lookupRes->mutable_resok()->mutable_object()->set_data(inode_str.c_str()); 	
+	fillAttributes(sb, lookupRes->mutable_resok()->mutable_obj_attributes()->mutable_attributes());
 	return Status::OK;
     }
   }
 
   Status NFSPROC_COMMIT(ServerContext* context, const COMMITargs* commitArgs,
 			COMMITres* commitRes) override {
+    StatTimer timer(kStatCommit);
     BatchWriteStatus status = batchWriteOptimizer.commitRequestFor(commitArgs->file().data(), commitArgs->offset(), commitArgs->count());
     if (status == BatchWriteStatus::kCommitSuccess || status == BatchWriteStatus::kCommitNone) {
       commitRes->mutable_resok();
-      commitRes->mutable_resok()->set_verf(SERVER_VERF);
+      commitRes->mutable_resok()->set_verf(serverVerifier());
+      // Everything buffered is in the file now, so its attributes are final.
+      ScopedFileDescriptor fd(&fdCache, acquireFileDescriptor(commitArgs->file().data()));
+      struct stat sb;
+      if (fd.get() != -1 && fstat(fd.get(), &sb) != -1) {
+	fillWcc(nullptr, &sb, commitRes->mutable_resok()->mutable_file_wcc());
+      }
     } else {
       commitRes->mutable_resfail();
     }
@@ -212,6 +326,7 @@ class NFSServiceImpl final : public NFS::Service {
 
   Status NFSPROC_MKDIR(ServerContext* context, const MKDIRargs* mkdirArgs,
                       MKDIRres* mkdirRes) override {
+    StatTimer timer(kStatMkdir);
 
     std::unique_ptr<const std::string> server_path(getPathName(mkdirArgs->where().dir()));
     if(server_path == nullptr) {
@@ -224,7 +339,13 @@ class NFSServiceImpl final : public NFS::Service {
     if (stat(server_path->c_str(), &sb) == -1) {
         // Dir does not exist
 	if(mkdir(server_path->c_str(), mkdirArgs->attributes().mode().mode()) == 0) { 
-	  mkdirRes->mutable_resok(); 
+	  MKDIRresok *resok = mkdirRes->mutable_resok();
+	  if (stat(server_path->c_str(), &sb) != -1) {
+	    handleIndex.insert(sb.st_ino, *server_path);
+	    resok->mutable_obj()->mutable_handle()->set_data(std::to_string(sb.st_ino));
+	    fillAttributes(sb, resok->mutable_obj_attributes()->mutable_attributes());
+	  }
+	  fillParentWcc(*server_path, resok->mutable_dir_wcc());
 	  return Status::OK;
 	}
     }
@@ -235,6 +356,7 @@ class NFSServiceImpl final : public NFS::Service {
 
   Status NFSPROC_RMDIR(ServerContext* context, const RMDIRargs* rmdirArgs,
                       RMDIRres* rmdirRes) override {
+    StatTimer timer(kStatRmdir);
     std::unique_ptr<const std::string> server_path(getServerPath(rmdirArgs->object().dir()));
     if(server_path == nullptr) {
       rmdirRes->mutable_resfail();
@@ -245,7 +367,9 @@ class NFSServiceImpl final : public NFS::Service {
     if (stat(server_path->c_str(), &sb) != -1) {
         if(rmdir(server_path->c_str()) == 0) {
 	  // Directory deleted
-          rmdirRes->mutable_resok();
+	  handleIndex.erase(sb.st_ino);
+	  fdCache.invalidate(rmdirArgs->object().dir().data());
+	  fillParentWcc(*server_path, rmdirRes->mutable_resok()->mutable_dir_wcc());
 	  return Status::OK;
     	}
     }
@@ -258,12 +382,19 @@ class NFSServiceImpl final : public NFS::Service {
 
   Status NFSPROC_CREATE(ServerContext* context, const CREATEargs* createArgs,
                         CREATEres* createRes) override {
+    StatTimer timer(kStatCreate);
     std::unique_ptr<const std::string> server_path(getPathName(createArgs->where().dir()));
     struct stat sb;
     if (stat(server_path->c_str(), &sb) == -1) {
       int fd = open(server_path->c_str(), O_CREAT, S_IRWXU | S_IRWXG);
       if (fd != -1) {         
-	createRes->mutable_resok();
+	CREATEresok *resok = createRes->mutable_resok();
+	if (fstat(fd, &sb) != -1) {
+	  handleIndex.insert(sb.st_ino, *server_path);
+	  resok->mutable_obj()->mutable_handle()->set_data(std::to_string(sb.st_ino));
+	  fillAttributes(sb, resok->mutable_obj_attributes()->mutable_attributes());
+	}
+	fillParentWcc(*server_path, resok->mutable_dir_wcc());
 	close(fd);
 	return Status::OK;
       } else {
@@ -273,13 +404,16 @@ class NFSServiceImpl final : public NFS::Service {
       }
     } else {
       // File already exists at server!
-      createRes->mutable_resok();
+      CREATEresok *resok = createRes->mutable_resok();
+      resok->mutable_obj()->mutable_handle()->set_data(std::to_string(sb.st_ino));
+      fillAttributes(sb, resok->mutable_obj_attributes()->mutable_attributes());
       return Status::OK;
     }
   }
 
   Status NFSPROC_REMOVE(ServerContext* context, const REMOVEargs* removeArgs,
                       REMOVEres* removeRes) override {
+    StatTimer timer(kStatRemove);
     std::unique_ptr<const std::string> server_path(getServerPath(removeArgs->object().dir()));
     if(server_path == nullptr) {
       removeRes->mutable_resfail();
@@ -289,7 +423,11 @@ class NFSServiceImpl final : public NFS::Service {
     struct stat sb;
     if (stat(server_path->c_str(), &sb) != -1) {
         if(remove(server_path->c_str()) == 0) {
-	  removeRes->mutable_resok();
+	  handleIndex.erase(sb.st_ino);
+	  batchWriteOptimizer.discard(removeArgs->object().dir().data());
+	  blockCache.invalidate(removeArgs->object().dir().data());
+	  fdCache.invalidate(removeArgs->object().dir().data());
+	  fillParentWcc(*server_path, removeRes->mutable_resok()->mutable_dir_wcc());
 	  return Status::OK;
         }
     }
@@ -297,11 +435,125 @@ class NFSServiceImpl final : public NFS::Service {
     return Status::OK;
   }
 
+  // Runs the operations of a compound in order and stops at the first one
+  // that fails. LOOKUP and CREATE make the handle of their file current for
+  // the operations that follow them.
+  Status NFSPROC_COMPOUND(ServerContext* context, const COMPOUNDargs* compoundArgs,
+			  COMPOUNDres* compoundRes) override {
+    StatTimer timer(kStatCompound);
+    std::string current_fh;
+    bool ok = true;
+    for (const nfs_argop &argop : compoundArgs->argarray()) {
+      nfs_resop *resop = compoundRes->add_resarray();
+      switch (argop.argop_case()) {
+      case nfs_argop::kLookup:
+	NFSPROC_LOOKUP(context, &argop.lookup(), resop->mutable_lookup());
+	ok = resop->lookup().has_resok();
+	if (ok) current_fh = resop->lookup().resok().object().data();
+	break;
+      case nfs_argop::kCreate:
+	NFSPROC_CREATE(context, &argop.create(), resop->mutable_create());
+	ok = resop->create().has_resok() && resop->create().resok().obj().has_handle();
+	if (ok) current_fh = resop->create().resok().obj().handle().data();
+	break;
+      case nfs_argop::kGetattr: {
+	GETATTRargs scratch;
+	const GETATTRargs *args = withCurrentHandle(argop.getattr(), argop.getattr().object(),
+						    &GETATTRargs::mutable_object, &scratch, &current_fh);
+	NFSPROC_GETATTR(context, args, resop->mutable_getattr());
+	ok = resop->getattr().has_resok() && resop->getattr().resok().has_obj_attributes();
+	break;
+      }
+      case nfs_argop::kRead: {
+	READargs scratch;
+	const READargs *args = withCurrentHandle(argop.read(), argop.read().file(),
+						 &READargs::mutable_file, &scratch, &current_fh);
+	NFSPROC_READ(context, args, resop->mutable_read());
+	ok = resop->read().has_resok();
+	break;
+      }
+      case nfs_argop::kWrite: {
+	WRITEargs scratch;
+	const WRITEargs *args = withCurrentHandle(argop.write(), argop.write().file(),
+						  &WRITEargs::mutable_file, &scratch, &current_fh);
+	NFSPROC_WRITE(context, args, resop->mutable_write());
+	ok = resop->write().has_resok();
+	break;
+      }
+      case nfs_argop::kCommit: {
+	COMMITargs scratch;
+	const COMMITargs *args = withCurrentHandle(argop.commit(), argop.commit().file(),
+						   &COMMITargs::mutable_file, &scratch, &current_fh);
+	NFSPROC_COMMIT(context, args, resop->mutable_commit());
+	ok = resop->commit().has_resok();
+	break;
+      }
+      default:
+	ok = false;  // An operation this server does not know.
+	break;
+      }
+      if (!ok) break;
+    }
+    compoundRes->set_ok(ok);
+    return Status::OK;
+  }
+
+  Status NFSPROC_STATS(ServerContext* context, const STATSargs* statsArgs,
+		       STATSres* statsRes) override {
+    statsRes->set_uptime_ns(serverStats.uptimeNs());
+    for (int id = 0; id < kNumProcedureStats; ++id) {
+      nfs::proc_stats *proc = statsRes->add_procedures();
+      proc->set_name(kProcedureNames[id]);
+      fillHistogram(serverStats.snapshot((StatId) id), proc->mutable_latency_ns());
+    }
+    fillHistogram(serverStats.snapshot(kStatDiskRead), statsRes->mutable_disk_read_ns());
+    fillHistogram(serverStats.snapshot(kStatDiskWrite), statsRes->mutable_disk_write_ns());
+    fillHistogram(serverStats.snapshot(kStatFsync), statsRes->mutable_fsync_ns());
+    fillHistogram(serverStats.snapshot(kStatFlushBytes), statsRes->mutable_flush_bytes());
+
+    FlusherMetrics flusher = backgroundFlusher.metrics();
+    statsRes->set_queued_bytes(flusher.queued_bytes);
+    statsRes->set_queued_files(flusher.queued_files);
+    statsRes->set_oldest_dirty_us(flusher.oldest_age_us);
+    statsRes->set_drain_bytes_per_sec(flusher.drain_bytes_per_sec);
+    statsRes->set_downgraded_writes(flusher.downgraded_writes);
+
+    BlockCacheMetrics cache = blockCache.metrics();
+    statsRes->set_cache_hits(cache.hits);
+    statsRes->set_cache_misses(cache.misses);
+    statsRes->set_cached_bytes(cache.cached_bytes);
+    statsRes->set_prefetched_blocks(cache.prefetched_blocks);
+    statsRes->set_prefetch_hits(cache.prefetch_hits);
+    return Status::OK;
+  }
+
+};
+
+struct ServerOptions {
+  bool async_mode;     // Serve RPCs from completion queues instead of the sync API.
+  int num_cqs;         // Completion queues (and polling threads) in async mode.
+  int num_io_threads;  // Threads running disk bound RPCs in async mode.
+  long group_commit_wait_us;  // Longest a sync waits for others to share it.
+  bool group_commit_syncfs;   // Share syncs across all files with syncfs().
+  bool wal;                   // Log unstable writes and keep the verifier across restarts.
+  std::string wal_dir;
+  std::string io_engine;      // "blocking" or "io_uring".
+  long read_cache_mb;         // Size of the block cache, 0 for none.
 };
 
-void RunServer() {
+void RunServer(const ServerOptions &options) {
   std::string server_address("0.0.0.0:50051");
   NFSServiceImpl service;
+
+  if (options.async_mode) {
+    AsyncNFSServer async_server(&service, options.num_cqs, options.num_io_threads);
+    std::cout << "Server (ID: " << SERVER_VERF << ") listening on " << server_address
+              << " in async mode with " << options.num_cqs << " completion queues and "
+              << options.num_io_threads << " I/O threads" << std::endl;
+    async_server.run(server_address);
+    return;
+  }
+
   ServerBuilder builder;
   // Listen on the given address without any authentication mechanism.
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
@@ -321,15 +573,92 @@ void* RunBatchOptimizerThread(void *args) {
   #ifdef DEBUG
   std::cout << "Started Batch Optimizer Thread in background.\n";
   #endif
-  long sleep_time_in_microseconds = 10000;  // every 10 ms we flush buffer in memory to disk.
-  while(1) {
-    usleep(sleep_time_in_microseconds);
-    batchWriteOptimizer.scheduledCommit();
-  }
+  backgroundFlusher.run();  // Never returns.
   return nullptr;
 }
 
+void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [--mode=sync|async] [--cqs=N] [--io-threads=N]\n"
+	  "       [--group-commit-wait-us=N] [--group-commit-syncfs] [--wal] [--wal-dir=PATH]\n"
+	  "       [--io-engine=blocking|io_uring] [--read-cache-mb=N]\n", program);
+}
+
 int main(int argc, char** argv) {
+  ServerOptions options;
+  options.async_mode = false;
+  options.num_cqs = std::max(1u, std::thread::hardware_concurrency());
+  options.num_io_threads = ASYNC_IO_THREADS;
+  options.group_commit_wait_us = GROUP_COMMIT_MAX_WAIT_US;
+  options.group_commit_syncfs = false;
+  options.wal = false;
+  options.wal_dir = WAL_DIR;
+  options.io_engine = "blocking";
+  options.read_cache_mb = BLOCK_CACHE_DEFAULT_MB;
+
+  static struct option long_options[] = {
+    {"mode", required_argument, nullptr, 'm'},
+    {"cqs", required_argument, nullptr, 'q'},
+    {"io-threads", required_argument, nullptr, 'i'},
+    {"group-commit-wait-us", required_argument, nullptr, 'w'},
+    {"group-commit-syncfs", no_argument, nullptr, 's'},
+    {"wal", no_argument, nullptr, 'l'},
+    {"wal-dir", required_argument, nullptr, 'd'},
+    {"io-engine", required_argument, nullptr, 'e'},
+    {"read-cache-mb", required_argument, nullptr, 'c'},
+    {nullptr, 0, nullptr, 0}
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 'm':
+      if (strcmp(optarg, "async") == 0) options.async_mode = true;
+      else if (strcmp(optarg, "sync") == 0) options.async_mode = false;
+      else { usage(argv[0]); return 1; }
+      break;
+    case 'q': options.num_cqs = std::max(1, atoi(optarg)); break;
+    case 'i': options.num_io_threads = std::max(1, atoi(optarg)); break;
+    case 'w': options.group_commit_wait_us = std::max(0L, atol(optarg)); break;
+    case 's': options.group_commit_syncfs = true; break;
+    case 'l': options.wal = true; break;
+    case 'd': options.wal_dir = optarg; break;
+    case 'e': options.io_engine = optarg; break;
+    case 'c': options.read_cache_mb = std::max(0L, atol(optarg)); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (!selectIoEngine(options.io_engine)) {
+    usage(argv[0]);
+    return 1;
+  }
+  std::cout << "Using the " << ioEngine->name() << " I/O engine" << std::endl;
+  groupCommitter.configure(options.group_commit_wait_us, options.group_commit_syncfs);
+  if (!blockCache.start(options.read_cache_mb * 1024 * 1024)) {
+    fprintf(stderr, "Error starting the read-ahead threads\n");
+    return 1;
+  }
+  if (blockCache.enabled()) {
+    std::cout << "Caching up to " << options.read_cache_mb << " MB of file blocks" << std::endl;
+  }
+
+  // Index every file handle in the export before serving any requests.
+  handleIndex.build(SERVER_DATA_DIR_STR);
+  std::cout << "Indexed " << handleIndex.size() << " file handles under " << SERVER_DATA_DIR << std::endl;
+
+  // Writes a previous run logged were acknowledged, so they are replayed
+  // even if this run does without the log. The verifier only survives if
+  // both runs log and nothing was lost.
+  bool replayed = writeAheadLog.replay(options.wal_dir);
+  if (options.wal) {
+    if (!writeAheadLog.open(options.wal_dir)) {
+      fprintf(stderr, "Error opening write-ahead log in %s\n", options.wal_dir.c_str());
+      return 1;
+    }
+    SERVER_VERF = writeAheadLog.loadVerifier(SERVER_VERF, replayed);
+  } else {
+    writeAheadLog.forgetVerifier(options.wal_dir);
+  }
+
   // Create and run BatchOptimizerThread.
   pthread_t batch_optimizer_thread;
   pthread_attr_t attr;
@@ -343,6 +672,6 @@ int main(int argc, char** argv) {
     return 1;
   }
   
-  RunServer();
+  RunServer(options);
   return 0;
 }
@@ -0,0 +1,439 @@
+#ifndef _NFS_SERVER_ASYNC_H_
+#define _NFS_SERVER_ASYNC_H_
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <grpc++/grpc++.h>
+
+#include "nfs.grpc.pb.h"
+#include "nfs_server_stats.h"
+#include "nfs_server_streams.h"
+#include "nfs_server_zero_copy.h"
+
+#define ASYNC_IO_THREADS 32  // Default size of the pool running disk bound RPCs.
+
+using grpc::Server;
+using grpc::ServerAsyncReader;
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerAsyncWriter;
+using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
+using grpc::ServerContext;
+using grpc::Status;
+using nfs::NFS;
+
+// READ is registered as a raw method so its reply can be assembled from
+// slices that point straight at the file's pages.
+typedef NFS::WithRawMethod_NFSPROC_READ<NFS::AsyncService> AsyncNFSService;
+
+// A fixed set of threads running blocking work handed off by the completion
+// queue threads, so that a slow fsync never holds up a completion queue.
+class WorkerPool {
+ public:
+  WorkerPool(int num_threads) {
+    pthread_mutex_init(&task_queue_mutex, nullptr);
+    pthread_cond_init(&task_queue_cond, nullptr);
+    for (int i = 0; i < num_threads; ++i) {
+      pthread_t worker;
+      pthread_create(&worker, nullptr, &WorkerPool::run, this);
+      pthread_detach(worker);
+    }
+  }
+
+  void submit(std::function<void()> task) {
+    pthread_mutex_lock(&task_queue_mutex);
+    task_queue.push_back(std::move(task));
+    pthread_cond_signal(&task_queue_cond);
+    pthread_mutex_unlock(&task_queue_mutex);
+  }
+
+ private:
+  static void* run(void *args) {
+    WorkerPool *pool = static_cast<WorkerPool*>(args);
+    while (1) {
+      pthread_mutex_lock(&pool->task_queue_mutex);
+      while (pool->task_queue.empty()) {
+        pthread_cond_wait(&pool->task_queue_cond, &pool->task_queue_mutex);
+      }
+      std::function<void()> task = std::move(pool->task_queue.front());
+      pool->task_queue.pop_front();
+      pthread_mutex_unlock(&pool->task_queue_mutex);
+      task();
+    }
+    return nullptr;
+  }
+
+  std::deque<std::function<void()>> task_queue;
+  pthread_mutex_t task_queue_mutex;
+  pthread_cond_t task_queue_cond;
+};
+
+// An RPC in flight on the async server. Its address is the tag of every
+// operation it queues on its completion queue.
+class AsyncCall {
+ public:
+  virtual ~AsyncCall() {}
+
+  // Called on a completion queue thread once the tagged operation is done.
+  virtual void proceed(bool ok) = 0;
+};
+
+// Serves one unary RPC by running the matching method of the synchronous
+// NFS::Service implementation, either inline on the completion queue thread
+// (cheap metadata RPCs) or on the I/O pool (anything that may block on disk).
+template <class Args, class Res>
+class AsyncUnaryCall : public AsyncCall {
+ public:
+  typedef void (AsyncNFSService::*RequestMethod)(ServerContext*, Args*, ServerAsyncResponseWriter<Res>*,
+                                                   grpc::CompletionQueue*, ServerCompletionQueue*, void*);
+  typedef Status (NFS::Service::*HandlerMethod)(ServerContext*, const Args*, Res*);
+
+  AsyncUnaryCall(AsyncNFSService *async_service, ServerCompletionQueue *cq, NFS::Service *handlers,
+                 WorkerPool *io_pool, RequestMethod request, HandlerMethod handler)
+    : async_service_(async_service), cq_(cq), handlers_(handlers), io_pool_(io_pool),
+      request_(request), handler_(handler), responder_(&context_), finished_(false) {
+    // Ask for the next incoming call of this kind.
+    (async_service_->*request_)(&context_, &args_, &responder_, cq_, cq_, this);
+  }
+
+  void proceed(bool ok) override {
+    if (!ok || finished_) {
+      // Either the server is shutting down or the reply has been sent.
+      delete this;
+      return;
+    }
+
+    // Keep accepting calls of this kind while this one is served.
+    new AsyncUnaryCall(async_service_, cq_, handlers_, io_pool_, request_, handler_);
+
+    if (io_pool_ == nullptr) {
+      serve();
+    } else {
+      io_pool_->submit(std::bind(&AsyncUnaryCall::serve, this));
+    }
+  }
+
+ private:
+  void serve() {
+    Status status = (handlers_->*handler_)(&context_, &args_, &res_);
+    finished_ = true;
+    responder_.Finish(res_, status, this);
+  }
+
+  AsyncNFSService *async_service_;
+  ServerCompletionQueue *cq_;
+  NFS::Service *handlers_;
+  WorkerPool *io_pool_;  // nullptr if the RPC is served inline.
+  RequestMethod request_;
+  HandlerMethod handler_;
+
+  ServerContext context_;
+  Args args_;
+  Res res_;
+  ServerAsyncResponseWriter<Res> responder_;
+  bool finished_;
+};
+
+// Serves READ without copying the file data (see nfs_server_zero_copy.h).
+// The request and reply travel as raw byte buffers, decoded and encoded by
+// hand on the I/O pool. Data that has to be read is read by the I/O engine,
+// whose completion sends the reply, so with io_uring the pool thread does
+// not wait for the disk.
+class AsyncRawReadCall : public AsyncCall {
+ public:
+  AsyncRawReadCall(AsyncNFSService *async_service, ServerCompletionQueue *cq, WorkerPool *io_pool)
+    : async_service_(async_service), cq_(cq), io_pool_(io_pool), responder_(&context_), start_ns_(0),
+      finished_(false) {
+    async_service_->RequestNFSPROC_READ(&context_, &request_, &responder_, cq_, cq_, this);
+  }
+
+  void proceed(bool ok) override {
+    if (!ok || finished_) {
+      delete this;
+      return;
+    }
+
+    new AsyncRawReadCall(async_service_, cq_, io_pool_);
+    io_pool_->submit(std::bind(&AsyncRawReadCall::serve, this));
+  }
+
+ private:
+  void serve() {
+    start_ns_ = statsClockNs();
+    READargs readArgs;
+    Status status = grpc::SerializationTraits<READargs>::Deserialize(&request_, &readArgs);
+    if (!status.ok()) {
+      finish(grpc::ByteBuffer(), status);
+      return;
+    }
+    buildZeroCopyReadReply(readArgs, [this](grpc::ByteBuffer *reply) { finish(*reply, Status::OK); });
+  }
+
+  void finish(const grpc::ByteBuffer &reply, const Status &status) {
+    serverStats.record(kStatRead, statsClockNs() - start_ns_);
+    finished_ = true;
+    responder_.Finish(reply, status, this);
+  }
+
+  AsyncNFSService *async_service_;
+  ServerCompletionQueue *cq_;
+  WorkerPool *io_pool_;
+
+  ServerContext context_;
+  grpc::ByteBuffer request_;
+  ServerAsyncResponseWriter<grpc::ByteBuffer> responder_;
+  uint64_t start_ns_;
+  bool finished_;
+};
+
+// Serves one server-streaming RPC from a Cursor (see nfs_server_streams.h).
+// Each message is produced on the I/O pool and only one write is in flight
+// at a time, so a slow reader throttles the producer instead of piling up
+// messages in memory. The whole stream is timed under stat.
+template <class Args, class Res, class Cursor>
+class AsyncServerStreamCall : public AsyncCall {
+ public:
+  typedef void (AsyncNFSService::*RequestMethod)(ServerContext*, Args*, ServerAsyncWriter<Res>*,
+                                                   grpc::CompletionQueue*, ServerCompletionQueue*, void*);
+
+  AsyncServerStreamCall(AsyncNFSService *async_service, ServerCompletionQueue *cq,
+                        WorkerPool *io_pool, RequestMethod request, StatId stat)
+    : async_service_(async_service), cq_(cq), io_pool_(io_pool), request_(request), stat_(stat),
+      writer_(&context_), state_(kRequested), start_ns_(0) {
+    (async_service_->*request_)(&context_, &args_, &writer_, cq_, cq_, this);
+  }
+
+  void proceed(bool ok) override {
+    switch (state_) {
+    case kRequested:
+      if (!ok) break;  // Shutting down.
+      new AsyncServerStreamCall(async_service_, cq_, io_pool_, request_, stat_);
+      state_ = kWriting;
+      start_ns_ = statsClockNs();
+      io_pool_->submit(std::bind(&AsyncServerStreamCall::writeNext, this));
+      return;
+    case kWriting:
+      if (ok) {
+	io_pool_->submit(std::bind(&AsyncServerStreamCall::writeNext, this));
+      } else {
+	// The client went away: end the call, and let its completion free it.
+	state_ = kFinishing;
+	writer_.Finish(Status(grpc::StatusCode::CANCELLED, "Write failed"), this);
+      }
+      return;
+    case kFinishing:
+      serverStats.record(stat_, statsClockNs() - start_ns_);
+      break;
+    }
+    delete this;
+  }
+
+ private:
+  enum CallState { kRequested, kWriting, kFinishing };
+
+  void writeNext() {
+    if (cursor_ == nullptr) cursor_.reset(new Cursor(args_));
+    res_.Clear();
+    if (cursor_->next(&res_)) {
+      writer_.Write(res_, this);
+    } else {
+      state_ = kFinishing;
+      writer_.Finish(Status::OK, this);
+    }
+  }
+
+  AsyncNFSService *async_service_;
+  ServerCompletionQueue *cq_;
+  WorkerPool *io_pool_;
+  RequestMethod request_;
+  StatId stat_;
+
+  ServerContext context_;
+  Args args_;
+  Res res_;
+  std::unique_ptr<Cursor> cursor_;
+  ServerAsyncWriter<Res> writer_;
+  CallState state_;
+  uint64_t start_ns_;
+};
+
+// Serves one client-streaming RPC into a Sink (see nfs_server_streams.h).
+// Every received message is consumed on the I/O pool before the next one is
+// read, and the single reply is sent once the client closes its side. The
+// whole stream is timed under stat.
+template <class Args, class Res, class Sink>
+class AsyncClientStreamCall : public AsyncCall {
+ public:
+  typedef void (AsyncNFSService::*RequestMethod)(ServerContext*, ServerAsyncReader<Res, Args>*,
+                                                   grpc::CompletionQueue*, ServerCompletionQueue*, void*);
+
+  AsyncClientStreamCall(AsyncNFSService *async_service, ServerCompletionQueue *cq,
+                        WorkerPool *io_pool, RequestMethod request, StatId stat)
+    : async_service_(async_service), cq_(cq), io_pool_(io_pool), request_(request), stat_(stat),
+      reader_(&context_), state_(kRequested), start_ns_(0) {
+    (async_service_->*request_)(&context_, &reader_, cq_, cq_, this);
+  }
+
+  void proceed(bool ok) override {
+    switch (state_) {
+    case kRequested:
+      if (!ok) break;
+      new AsyncClientStreamCall(async_service_, cq_, io_pool_, request_, stat_);
+      state_ = kReading;
+      start_ns_ = statsClockNs();
+      reader_.Read(&args_, this);
+      return;
+    case kReading:
+      // A failed read means the client is done sending.
+      io_pool_->submit(std::bind(ok ? &AsyncClientStreamCall::consumeAndReadNext
+                                    : &AsyncClientStreamCall::finish, this));
+      return;
+    case kFinishing:
+      serverStats.record(stat_, statsClockNs() - start_ns_);
+      break;
+    }
+    delete this;
+  }
+
+ private:
+  enum CallState { kRequested, kReading, kFinishing };
+
+  void consumeAndReadNext() {
+    sink_.consume(&args_);
+    args_.Clear();
+    reader_.Read(&args_, this);
+  }
+
+  void finish() {
+    sink_.finish(&res_);
+    state_ = kFinishing;
+    reader_.Finish(res_, Status::OK, this);
+  }
+
+  AsyncNFSService *async_service_;
+  ServerCompletionQueue *cq_;
+  WorkerPool *io_pool_;
+  RequestMethod request_;
+  StatId stat_;
+
+  ServerContext context_;
+  Args args_;
+  Res res_;
+  Sink sink_;
+  ServerAsyncReader<Res, Args> reader_;
+  CallState state_;
+  uint64_t start_ns_;
+};
+
+// Completion queue based NFS server. Each completion queue is polled by its
+// own thread, and RPCs that touch the disk are handed to a separate I/O pool,
+// so a slow COMMIT cannot starve GETATTR and LOOKUP.
+class AsyncNFSServer {
+ public:
+  AsyncNFSServer(NFS::Service *handlers, int num_cqs, int num_io_threads)
+    : handlers_(handlers), num_cqs_(num_cqs), io_pool_(num_io_threads) {
+  }
+
+  void run(const std::string &server_address) {
+    ServerBuilder builder;
+    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&async_service_);
+    for (int i = 0; i < num_cqs_; ++i) {
+      cqs_.push_back(builder.AddCompletionQueue());
+    }
+    server_ = builder.BuildAndStart();
+
+    std::vector<pthread_t> cq_threads(num_cqs_);
+    for (int i = 0; i < num_cqs_; ++i) {
+      acceptCalls(cqs_[i].get());
+      pthread_create(&cq_threads[i], nullptr, &AsyncNFSServer::pollCompletionQueue, cqs_[i].get());
+    }
+    for (pthread_t &cq_thread : cq_threads) {
+      pthread_join(cq_thread, nullptr);
+    }
+  }
+
+ private:
+  template <class Args, class Res>
+  void accept(ServerCompletionQueue *cq, bool blocking,
+              typename AsyncUnaryCall<Args, Res>::RequestMethod request,
+              typename AsyncUnaryCall<Args, Res>::HandlerMethod handler) {
+    new AsyncUnaryCall<Args, Res>(&async_service_, cq, handlers_, blocking ? &io_pool_ : nullptr,
+                                  request, handler);
+  }
+
+  template <class Args, class Res, class Cursor>
+  void acceptServerStream(ServerCompletionQueue *cq,
+                          typename AsyncServerStreamCall<Args, Res, Cursor>::RequestMethod request,
+                          StatId stat) {
+    new AsyncServerStreamCall<Args, Res, Cursor>(&async_service_, cq, &io_pool_, request, stat);
+  }
+
+  template <class Args, class Res, class Sink>
+  void acceptClientStream(ServerCompletionQueue *cq,
+                          typename AsyncClientStreamCall<Args, Res, Sink>::RequestMethod request,
+                          StatId stat) {
+    new AsyncClientStreamCall<Args, Res, Sink>(&async_service_, cq, &io_pool_, request, stat);
+  }
+
+  // Queues one pending call of every RPC kind on cq. GETATTR and LOOKUP
+  // are served inline: each costs a handle index lookup and at most two
+  // lstats, an index miss being a stale handle rather than a walk of the
+  // export. Anything that may do more I/O than that goes to the I/O pool.
+  void acceptCalls(ServerCompletionQueue *cq) {
+    accept<nfs::GETATTRargs, nfs::GETATTRres>(cq, false,
+        &AsyncNFSService::RequestNFSPROC_GETATTR, &NFS::Service::NFSPROC_GETATTR);
+    accept<nfs::LOOKUPargs, nfs::LOOKUPres>(cq, false,
+        &AsyncNFSService::RequestNFSPROC_LOOKUP, &NFS::Service::NFSPROC_LOOKUP);
+    accept<nfs::SETATTRargs, nfs::SETATTRres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_SETATTR, &NFS::Service::NFSPROC_SETATTR);
+    new AsyncRawReadCall(&async_service_, cq, &io_pool_);
+    acceptServerStream<nfs::READargs, nfs::READres, ReadStreamCursor>(cq,
+        &AsyncNFSService::RequestNFSPROC_READ_STREAM, kStatReadStream);
+    acceptServerStream<nfs::READDIRargs, nfs::READDIRres, ReadDirCursor>(cq,
+        &AsyncNFSService::RequestNFSPROC_READDIR, kStatReaddir);
+    acceptServerStream<nfs::READDIRargs, nfs::READDIRres, ReadDirPlusCursor>(cq,
+        &AsyncNFSService::RequestNFSPROC_READDIRPLUS, kStatReaddirplus);
+    accept<nfs::WRITEargs, nfs::WRITEres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_WRITE, &NFS::Service::NFSPROC_WRITE);
+    acceptClientStream<nfs::WRITEargs, nfs::WRITEres, WriteStreamSink>(cq,
+        &AsyncNFSService::RequestNFSPROC_WRITE_STREAM, kStatWriteStream);
+    accept<nfs::COMMITargs, nfs::COMMITres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_COMMIT, &NFS::Service::NFSPROC_COMMIT);
+    accept<nfs::CREATEargs, nfs::CREATEres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_CREATE, &NFS::Service::NFSPROC_CREATE);
+    accept<nfs::REMOVEargs, nfs::REMOVEres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_REMOVE, &NFS::Service::NFSPROC_REMOVE);
+    accept<nfs::MKDIRargs, nfs::MKDIRres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_MKDIR, &NFS::Service::NFSPROC_MKDIR);
+    accept<nfs::RMDIRargs, nfs::RMDIRres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_RMDIR, &NFS::Service::NFSPROC_RMDIR);
+    accept<nfs::COMPOUNDargs, nfs::COMPOUNDres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_COMPOUND, &NFS::Service::NFSPROC_COMPOUND);
+    accept<nfs::STATSargs, nfs::STATSres>(cq, true,
+        &AsyncNFSService::RequestNFSPROC_STATS, &NFS::Service::NFSPROC_STATS);
+  }
+
+  static void* pollCompletionQueue(void *args) {
+    ServerCompletionQueue *cq = static_cast<ServerCompletionQueue*>(args);
+    void *tag;
+    bool ok;
+    while (cq->Next(&tag, &ok)) {
+      static_cast<AsyncCall*>(tag)->proceed(ok);
+    }
+    return nullptr;
+  }
+
+  NFS::Service *handlers_;
+  int num_cqs_;
+  WorkerPool io_pool_;
+  AsyncNFSService async_service_;
+  std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
+  std::unique_ptr<Server> server_;
+};
+
+#endif  // _NFS_SERVER_ASYNC_H_
@@ -1,36 +1,184 @@
 #ifndef _NFS_SERVER_BATCH_OPTIMIZER_H_
 #define _NFS_SERVER_BATCH_OPTIMIZER_H_
 
-#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
 #include <set>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "nfs_server_utilities.h"
+#include "nfs_server_io_engine.h"
+#include "nfs_server_group_commit.h"
+#include "nfs_server_wal.h"
+#include "nfs_server_slab.h"
+
+#define BATCH_OPTIMIZER_SHARDS 16      // Independently locked groups of files.
+#define BUFFER_HARD_LIMIT (256L * 1024 * 1024)  // Buffered bytes past which writes go straight to disk.
 
-#define SCHEDULED_BATCH_COMMIT_SIZE 1
+// Monotonic time in microseconds.
+long monotonicMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 using nfs::nfs_fh;
+using nfs::WRITEargs;
 
-class BatchWriteRequest {
-  friend class BatchWriteOptimizer;
+// The buffered, not yet flushed writes to one file. Writes are merged into
+// non-overlapping extents as they arrive: a write that overlaps or touches
+// existing extents is folded into them, its own bytes winning over older
+// ones. A flush then costs one write per contiguous run of dirty bytes.
+//
+// Extent data lives in chains of slab chunks. A write that starts a new
+// extent or extends one at its end hands over its own chunks, so the bytes
+// copied out of the request are not copied again; only overwritten bytes
+// and the tail of an extent a write runs into are.
+class FileWriteBuffer {
  public:
-  BatchWriteRequest(uint32_t request_id)
-    :  request_id_(request_id) {
+  FileWriteBuffer()
+    : first_lsn(0), last_lsn(0), dirty_since(monotonicMicros()), bytes_(0) {
   }
 
-  BatchWriteRequest(uint32_t request_id, std::string fh_data, size_t offset, size_t count, const char *buf)
-     : request_id_(request_id),
-       fh_data_(fh_data),
-       offset_(offset),
-       count_(count) {
-     buf_.reset(new char[count]);
-     memcpy(buf_.get(), buf, count); 
+  // Log records of the first and latest write merged in, 0 without a log.
+  uint64_t first_lsn;
+  uint64_t last_lsn;
+  long dirty_since;  // When the oldest buffered write arrived.
+  std::list<std::string>::iterator queue_pos;  // Its entry in the shard's flush queue.
+
+  void insert(size_t offset, ChunkedData &&data) {
+    size_t count = data.length();
+    size_t end = offset + count;
+
+    // The first extent that overlaps or touches [offset, end), if any.
+    auto first = extents_.upper_bound(offset);
+    if (first != extents_.begin()) {
+      auto prev = std::prev(first);
+      if (extentEnd(prev) >= offset) first = prev;
+    }
+    if (first == extents_.end() || first->first > end) {
+      extents_.emplace_hint(first, offset, std::move(data));
+      bytes_ += count;
+      return;
+    }
+
+    // Extents in [first, after) are merged with the new write.
+    auto after = extents_.upper_bound(end);
+    auto last = std::prev(after);
+    size_t last_end = extentEnd(last);
+    for (auto it = first; it != after; ++it) bytes_ -= it->second.length();
+
+    size_t merged_offset = std::min(offset, first->first);
+    ChunkedData merged;
+    if (first->first <= offset) {
+      // Grow the first extent in place, which keeps sequential appends cheap.
+      merged.swap(first->second);
+      size_t overlap = std::min(end, merged_offset + merged.length()) - offset;
+      merged.overwrite(offset - merged_offset, data, 0, overlap);
+      if (overlap == 0) {
+	merged.append(std::move(data));
+      } else if (overlap < count) {
+	merged.appendTail(data, overlap);
+      }
+    } else {
+      merged.swap(data);
+    }
+    if (last_end > merged_offset + merged.length()) {
+      merged.appendTail(last->second, merged_offset + merged.length() - last->first);
+    }
+
+    extents_.erase(first, after);
+    bytes_ += merged.length();
+    extents_.emplace_hint(after, merged_offset, std::move(merged));
   }
+
+  // Writes every extent to fd, one writev per extent, all submitted to the
+  // I/O engine as one batch. Making them durable is up to the caller.
+  bool writeTo(int fd) {
+    std::vector<struct iovec> iovs;
+    std::vector<WritePiece> pieces;
+    for (auto &extent : extents_) {
+      size_t first = iovs.size();
+      extent.second.forEachSegment(0, extent.second.length(), [&iovs](const char *buf, size_t n) {
+	struct iovec iov;
+	iov.iov_base = const_cast<char*>(buf);
+	iov.iov_len = n;
+	iovs.push_back(iov);
+      });
+      size_t offset = extent.first;
+      for (size_t i = first; i < iovs.size(); i += IOV_MAX) {
+	WritePiece piece = { i, (int) std::min(iovs.size() - i, (size_t) IOV_MAX), offset, 0 };
+	for (int k = 0; k < piece.iovcnt; ++k) piece.length += iovs[i + k].iov_len;
+	pieces.push_back(piece);
+	offset += piece.length;
+      }
+    }
+
+    std::vector<IoOp> ops;
+    for (const WritePiece &piece : pieces) {
+      ops.push_back(writevOp(fd, &iovs[piece.first_iov], piece.iovcnt, piece.offset));
+    }
+    std::vector<ssize_t> results = ioEngine->submitAndWait(&ops);
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      if (results[i] < 0) return false;
+      // Short writes are rare enough to simply write the piece again.
+      if ((size_t) results[i] < pieces[i].length
+	  && !pwritevFully(fd, &iovs[pieces[i].first_iov], pieces[i].iovcnt, pieces[i].offset)) return false;
+    }
+    return true;
+  }
+
+  size_t bytes() const { return bytes_; }
+
  private:
-  uint32_t request_id_;
-  std::string fh_data_;
-  size_t offset_;
-  size_t count_;
-  std::unique_ptr<char> buf_;
+  // Up to IOV_MAX consecutive iovecs of one extent, written by one writev.
+  struct WritePiece {
+    size_t first_iov;
+    int iovcnt;
+    size_t offset;
+    size_t length;
+  };
+
+  size_t extentEnd(std::map<size_t, ChunkedData>::const_iterator extent) const {
+    return extent->first + extent->second.length();
+  }
+
+  // pwritev that retries until every byte of iov is written.
+  static bool pwritevFully(int fd, struct iovec *iov, int iovcnt, size_t offset) {
+    while (iovcnt > 0) {
+      ssize_t written = pwritev(fd, iov, iovcnt, offset);
+      if (written == -1) return false;
+      offset += written;
+      while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+        written -= iov->iov_len;
+        ++iov;
+        --iovcnt;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+        iov->iov_len -= written;
+      }
+    }
+    return true;
+  }
+
+  std::map<size_t, ChunkedData> extents_;  // offset -> data
+  size_t bytes_;
+};
+
+// What one round of background flushing wrote out.
+struct FlushRound {
+  int files;
+  size_t bytes;
 };
 
 enum BatchWriteStatus {
@@ -42,84 +190,469 @@ enum BatchWriteStatus {
   kFail
 };
 
-class BatchWriteOptimizer {
+// An UNSTABLE write on its way into a shard's buffers.
+struct PendingWrite {
+  std::string fh_data;
+  size_t offset;
+  ChunkedData data;
+  PendingWrite *next;
+};
+
+// Multi-producer, single-consumer queue of pending writes. Producers push
+// with a single compare-and-swap and never block; the consumer (whoever
+// holds the shard's lock) takes everything at once.
+class PendingWriteQueue {
  public:
-  struct request_queue_comparator {
-    bool operator() (const BatchWriteRequest& lhs, const BatchWriteRequest& rhs) const {
-      return lhs.request_id_  < rhs.request_id_;
+  PendingWriteQueue()
+    : head_(nullptr) {
+  }
+
+  void push(PendingWrite *write) {
+    write->next = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(write->next, write, std::memory_order_release,
+					std::memory_order_relaxed)) {
     }
-  };
-  
-  BatchWriteOptimizer() {
-    next_request_id = 0;
-    pthread_mutex_init(&request_queue_mutex, nullptr);
+  }
+
+  // Takes all queued writes, oldest first.
+  PendingWrite* takeAll() {
+    PendingWrite *newest = head_.exchange(nullptr, std::memory_order_acquire);
+    PendingWrite *oldest = nullptr;
+    while (newest != nullptr) {
+      PendingWrite *next = newest->next;
+      newest->next = oldest;
+      oldest = newest;
+      newest = next;
+    }
+    return oldest;
+  }
+
+ private:
+  std::atomic<PendingWrite*> head_;
+};
+
+// Buffers UNSTABLE writes in memory, per file, until a COMMIT for the file
+// or the background flusher writes them out.
+//
+// Files are spread over independently locked shards by file handle, so a
+// COMMIT or flush of one file only holds up files in the same shard, and
+// only while it copies data into the page cache: syncs happen after the
+// shard lock is released and go through the group committer, so concurrent
+// COMMITs of a file share one fdatasync. WRITEs do not take the shard lock
+// at all; they go through the shard's lock-free queue, which whoever next
+// holds the lock applies to the buffers.
+//
+// With the write-ahead log enabled, every buffered write is also logged,
+// in the order it is applied to its buffer. Once a file's buffer has been
+// synced to the file, a retire record tells replay to skip those writes,
+// and the log segments nobody needs any more are deleted. Logged writes
+// are applied under the shard lock: the log is serialized anyway, and
+// a retire record must never overtake a logged write still in a queue.
+class BatchWriteOptimizer {
+ public:
+  BatchWriteOptimizer()
+    : next_shard_(0), queued_bytes_(0), queued_files_(0), downgraded_writes_(0) {
+    pthread_mutex_init(&verf_mutex, nullptr);
   }
   
-  BatchWriteStatus createRequest(std::string fh_data, size_t offset, size_t count, const char *buf) {
-    BatchWriteRequest request(next_request_id++, fh_data, offset, count, buf);
-    batch_write_request_queue.insert(std::move(request));
-    
-    if (fh_map.find(fh_data) == fh_map.end()) {
-      std::vector<uint32_t> fh_ops;
-      fh_map.insert(make_pair(fh_data, fh_ops));
+  // Buffers a write. With the log enabled, *lsn is set to the LSN of its log
+  // record, which the caller must sync before acknowledging the write.
+  BatchWriteStatus createRequest(std::string fh_data, size_t offset, size_t count, const char *buf,
+				 uint64_t *lsn = nullptr) {
+    Shard &shard = shardFor(fh_data);
+    if (lsn != nullptr) *lsn = 0;
+
+    // The only copy of the data the buffer makes.
+    ChunkedData data(buf, count);
+    if (!data.valid()) return BatchWriteStatus::kCreateFailure;
+
+    if (!writeAheadLog.enabled()) {
+      PendingWrite *write = new PendingWrite();
+      write->fh_data.swap(fh_data);
+      write->offset = offset;
+      write->data.swap(data);
+      queued_bytes_ += count;  // Until applied, counted as is.
+      shard.pending.push(write);
+      // Keep the queue short, but never wait for a busy shard.
+      if (pthread_mutex_trylock(&shard.mutex) == 0) {
+	applyPendingWrites(&shard);
+	pthread_mutex_unlock(&shard.mutex);
+      }
+      return BatchWriteStatus::kCreateSuccess;
     }
 
-    fh_map[fh_data].push_back(request.request_id_);
-    
+    pthread_mutex_lock(&shard.mutex);
+    uint64_t record_lsn = writeAheadLog.append(WalRecord::kWrite, fh_data, offset, buf, count);
+    if (record_lsn == 0) {
+      pthread_mutex_unlock(&shard.mutex);
+      return BatchWriteStatus::kCreateFailure;
+    }
+    applyWrite(&shard, fh_data, offset, std::move(data), record_lsn);
+    pthread_mutex_unlock(&shard.mutex);
+    if (lsn != nullptr) *lsn = record_lsn;
     return BatchWriteStatus::kCreateSuccess;
   }
   
   BatchWriteStatus commitRequestFor(std::string fh_data, size_t offset, size_t count) {
-    if (fh_map.find(fh_data) == fh_map.end()) {
-      return BatchWriteStatus::kCommitNone;
+    // The whole file is committed, whatever the given offset and count.
+    Shard &shard = shardFor(fh_data);
+    ScopedFileDescriptor fd(&fdCache, acquireFileDescriptor(fh_data));
+
+    // Acquire the shard's lock and write out what is buffered for this fh.
+    pthread_mutex_lock(&shard.mutex);
+    applyPendingWrites(&shard);
+
+    BatchWriteStatus status = BatchWriteStatus::kCommitNone;
+    std::vector<WrittenFile> written;
+    auto it = shard.fh_map.find(fh_data);
+    if (it != shard.fh_map.end()) {
+      shard.flush_queue.erase(it->second.queue_pos);
+      status = writeFile(&shard, it, fd.get(), &written) ? BatchWriteStatus::kCommitSuccess : BatchWriteStatus::kCommitFailure;
     }
     
-    // Acquire the lock and commit for this fh using the given offset and count.
-    pthread_mutex_lock(&request_queue_mutex);
-
-    std::vector<uint32_t> &fh_ops = fh_map[fh_data];
-    for (uint32_t fh_op : fh_ops) {
-      BatchWriteRequest key(fh_op);
-      auto request = batch_write_request_queue.find(key);
-      if (request != batch_write_request_queue.end()) {
-	std::unique_ptr<const std::string> server_path(getServerPath(request->fh_data_));
-	synchronous_write(server_path.get(), request->offset_, request->count_, request->buf_.get());
-	batch_write_request_queue.erase(request);
+    // Release the lock.
+    pthread_mutex_unlock(&shard.mutex);
+
+    // Sync even if nothing was buffered: the background flusher may have
+    // written this file's data without having synced it yet.
+    bool synced = (fd.get() != -1 && groupCommitter.sync(fh_data, fd.get()) == 0);
+    if (fd.get() != -1 && !synced) loseUnstableWrites();
+    retire(&shard, written, synced);
+    if (status == BatchWriteStatus::kCommitFailure || fd.get() == -1) return status;
+    return synced ? status : BatchWriteStatus::kCommitFailure;
+  }
+
+  // Writes out up to max_files of the files that have been dirty the
+  // longest, skipping those dirty for less than min_age_us. The shards are
+  // visited in turn so that none of them starves.
+  FlushRound scheduledCommit(int max_files, long min_age_us) {
+    FlushRound round = { 0, 0 };
+    long dirty_before = monotonicMicros() - min_age_us;
+    for (int i = 0; i < BATCH_OPTIMIZER_SHARDS && round.files < max_files; ++i) {
+      Shard &shard = shards_[next_shard_];
+      next_shard_ = (next_shard_ + 1) % BATCH_OPTIMIZER_SHARDS;
+      scheduledCommit(&shard, max_files - round.files, dirty_before, &round);
+    }
+    return round;
+  }
+
+  // Bytes buffered, including writes not yet applied to their buffers.
+  long queuedBytes() const { return queued_bytes_; }
+
+  long queuedFiles() const { return queued_files_; }
+
+  // How long the oldest buffered write has been waiting, 0 if none is.
+  long oldestDirtyAgeUs() {
+    long oldest = 0;
+    for (int i = 0; i < BATCH_OPTIMIZER_SHARDS; ++i) {
+      pthread_mutex_lock(&shards_[i].mutex);
+      if (!shards_[i].flush_queue.empty()) {
+	long since = shards_[i].fh_map[shards_[i].flush_queue.front()].dirty_since;
+	if (oldest == 0 || since < oldest) oldest = since;
       }
+      pthread_mutex_unlock(&shards_[i].mutex);
     }
-    
-    // Release the lock.
-    pthread_mutex_unlock(&request_queue_mutex);
+    return oldest == 0 ? 0 : monotonicMicros() - oldest;
+  }
 
-    return BatchWriteStatus::kCommitSuccess;
+  // Whether an UNSTABLE write may be buffered. Past the hard limit it is
+  // made stable right away instead, which slows writers down to the pace of
+  // the disk until the flusher catches up.
+  bool admitUnstableWrite() {
+    if (queued_bytes_ <= BUFFER_HARD_LIMIT) return true;
+    ++downgraded_writes_;
+    return false;
   }
 
-  void scheduledCommit() {
-    // Acquire the lock and commit the requests pending at the head of the queue.
-    pthread_mutex_lock(&request_queue_mutex);
+  long downgradedWrites() const { return downgraded_writes_; }
 
-    for (int i = 0; i < SCHEDULED_BATCH_COMMIT_SIZE; ++i) {
-      if (batch_write_request_queue.empty()) break;
-      auto request = batch_write_request_queue.begin();
-      #ifdef DEBUG
-      std::cout << "Scheduled commit for: " << request->request_id_ << std::endl;
-      #endif
-      std::unique_ptr<const std::string> server_path(getServerPath(request->fh_data_));
-      synchronous_write(server_path.get(), request->offset_, request->count_, request->buf_.get());
-      batch_write_request_queue.erase(request);
+  // Drops whatever is buffered for a file that is being removed, and makes
+  // sure replay will not apply its logged writes to whichever file reuses
+  // the handle.
+  void discard(const std::string &fh_data) {
+    Shard &shard = shardFor(fh_data);
+    pthread_mutex_lock(&shard.mutex);
+    applyPendingWrites(&shard);
+
+    auto it = shard.fh_map.find(fh_data);
+    if (it != shard.fh_map.end()) {
+      if (it->second.first_lsn != 0) shard.pinned_lsns.erase(shard.pinned_lsns.find(it->second.first_lsn));
+      forget(it->second);
+      shard.flush_queue.erase(it->second.queue_pos);
+      shard.fh_map.erase(it);
+    }
+    uint64_t lsn = 0;
+    if (writeAheadLog.enabled()) {
+      // Writes are logged under this lock, so all of fh_data's are older.
+      lsn = writeAheadLog.append(WalRecord::kRetire, fh_data, writeAheadLog.nextLsn(), "", 0);
     }
 
-    // Release the lock.
-    pthread_mutex_unlock(&request_queue_mutex);
+    pthread_mutex_unlock(&shard.mutex);
+    writeAheadLog.sync(lsn);
+  }
+
+  // Waits until nothing written to fh_data through this optimizer can be
+  // replayed over later changes to the file: its buffer is synced and the
+  // retire records of all its flushes are durable. Stable writes and
+  // truncation call this before touching a file.
+  void settle(const std::string &fh_data) {
+    Shard &shard = shardFor(fh_data);
+    pthread_mutex_lock(&shard.mutex);
+    applyPendingWrites(&shard);
+    bool buffered = (shard.fh_map.find(fh_data) != shard.fh_map.end());
+    pthread_mutex_unlock(&shard.mutex);
+    if (buffered) commitRequestFor(fh_data, 0, 0);
+
+    pthread_mutex_lock(&shard.mutex);
+    while (shard.retiring.find(fh_data) != shard.retiring.end()) {
+      pthread_cond_wait(&shard.retired_cond, &shard.mutex);
+    }
+    pthread_mutex_unlock(&shard.mutex);
   }
  
  private:
-  uint32_t next_request_id;
-  std::unordered_map<std::string, std::vector<uint32_t>> fh_map;
-  std::set<BatchWriteRequest, request_queue_comparator> batch_write_request_queue;  // A sorted queue based on req_id
-  pthread_mutex_t request_queue_mutex;
+  struct Shard {
+    Shard() {
+      pthread_mutex_init(&mutex, nullptr);
+      pthread_cond_init(&retired_cond, nullptr);
+    }
+
+    PendingWriteQueue pending;
+    pthread_mutex_t mutex;  // Guards everything below.
+    std::unordered_map<std::string, FileWriteBuffer> fh_map;
+    std::list<std::string> flush_queue;  // Dirty files, oldest first.
+    std::multiset<uint64_t> pinned_lsns;  // First logged write of every unretired buffer.
+    std::unordered_map<std::string, int> retiring;  // Written out, not yet retired.
+    pthread_cond_t retired_cond;
+  };
+
+  // A buffer that has been written to its file, but not yet retired.
+  struct WrittenFile {
+    std::string fh_data;
+    uint64_t first_lsn;
+    uint64_t last_lsn;
+  };
+
+  Shard &shardFor(const std::string &fh_data) {
+    return shards_[std::hash<std::string>()(fh_data) % BATCH_OPTIMIZER_SHARDS];
+  }
+
+  // Writes out up to max_files of the shard's oldest files dirty since
+  // before dirty_before, and adds them to round.
+  void scheduledCommit(Shard *shard, int max_files, long dirty_before, FlushRound *round) {
+    pthread_mutex_lock(&shard->mutex);
+    applyPendingWrites(shard);
+
+    std::vector<std::string> flushed;
+    std::vector<WrittenFile> written;
+    while ((int) flushed.size() < max_files && !shard->flush_queue.empty()) {
+      std::string fh_data = shard->flush_queue.front();
+      auto it = shard->fh_map.find(fh_data);
+      if (it->second.dirty_since > dirty_before) break;  // The rest are younger.
+      shard->flush_queue.pop_front();
+      #ifdef DEBUG
+      std::cout << "Scheduled commit for: " << fh_data << std::endl;
+      #endif
+      size_t bytes = it->second.bytes();
+      ScopedFileDescriptor fd(&fdCache, acquireFileDescriptor(fh_data));
+      if (writeFile(shard, it, fd.get(), &written)) {
+	flushed.push_back(fh_data);
+	round->bytes += bytes;
+      }
+    }
+    round->files += flushed.size();
+
+    // Release the lock, then sync what was written, all files at once.
+    pthread_mutex_unlock(&shard->mutex);
+
+    bool synced = true;
+    std::vector<std::unique_ptr<ScopedFileDescriptor>> fds;
+    std::vector<int> sync_fds;
+    for (const std::string &fh_data : flushed) {
+      fds.emplace_back(new ScopedFileDescriptor(&fdCache, acquireFileDescriptor(fh_data)));
+      if (fds.back()->get() == -1) synced = false;
+      else sync_fds.push_back(fds.back()->get());
+    }
+    if (groupCommitter.syncAll(sync_fds) != 0) {
+      synced = false;
+      loseUnstableWrites();
+    }
+    retire(shard, written, synced && flushed.size() == written.size());
+  }
+
+  // Takes a buffer that is about to be dropped out of the accounting.
+  void forget(const FileWriteBuffer &buffer) {
+    queued_bytes_ -= buffer.bytes();
+    --queued_files_;
+  }
+
+  // Moves the shard's queued writes into its buffers. Called with the
+  // shard's lock held.
+  void applyPendingWrites(Shard *shard) {
+    PendingWrite *write = shard->pending.takeAll();
+    while (write != nullptr) {
+      queued_bytes_ -= write->data.length();
+      applyWrite(shard, write->fh_data, write->offset, std::move(write->data), 0);
+      PendingWrite *next = write->next;
+      delete write;
+      write = next;
+    }
+  }
+
+  void applyWrite(Shard *shard, const std::string &fh_data, size_t offset, ChunkedData &&data,
+		  uint64_t lsn) {
+    auto it = shard->fh_map.find(fh_data);
+    if (it == shard->fh_map.end()) {
+      it = shard->fh_map.insert(make_pair(fh_data, FileWriteBuffer())).first;
+      it->second.queue_pos = shard->flush_queue.insert(shard->flush_queue.end(), fh_data);
+      ++queued_files_;
+      if (lsn != 0) {
+	it->second.first_lsn = lsn;
+	shard->pinned_lsns.insert(lsn);  // Keeps its log segment around.
+      }
+    }
+    long bytes_before = it->second.bytes();
+    it->second.insert(offset, std::move(data));
+    queued_bytes_ += (long) it->second.bytes() - bytes_before;
+    it->second.last_lsn = lsn;
+  }
+
+  // Writes out and forgets the buffered writes of one file. Writes that
+  // cannot be written out, to a file that no longer exists at the server
+  // (fd is -1) say, are dropped and the verifier changed. Logged writes are
+  // added to written, to be retired once synced.
+  bool writeFile(Shard *shard, std::unordered_map<std::string, FileWriteBuffer>::iterator it, int fd,
+		 std::vector<WrittenFile> *written) {
+    bool written_out = (fd != -1 && it->second.writeTo(fd));
+    if (written_out) serverStats.record(kStatFlushBytes, it->second.bytes());
+    else loseUnstableWrites();
+    blockCache.invalidate(it->first);
+    if (it->second.first_lsn != 0) {
+      WrittenFile file = { it->first, it->second.first_lsn, it->second.last_lsn };
+      written->push_back(file);
+      ++shard->retiring[it->first];
+    }
+    forget(it->second);
+    shard->fh_map.erase(it);
+    return written_out;
+  }
+
+  // Acknowledged UNSTABLE writes did not make it to disk. Changing the
+  // verifier makes their clients send them again, as they would after a
+  // crash, so the writes need neither be held on to nor replayed. The new
+  // verifier is persisted before any of their log records can be
+  // reclaimed.
+  void loseUnstableWrites() {
+    pthread_mutex_lock(&verf_mutex);
+    long previous = atol(serverVerifier().c_str());
+    long now = std::chrono::system_clock::now().time_since_epoch() / std::chrono::milliseconds(1);
+    std::string verf = std::to_string(std::max(now, previous + 1));
+    if (writeAheadLog.enabled()) verf = writeAheadLog.loadVerifier(verf, false);
+    setServerVerifier(verf);
+    pthread_mutex_unlock(&verf_mutex);
+  }
+
+  // Logs that the written files no longer need replaying if their syncs
+  // succeeded, then unpins their log records either way; failed ones have
+  // changed the verifier already.
+  void retire(Shard *shard, const std::vector<WrittenFile> &written, bool synced) {
+    if (written.empty()) return;
+    uint64_t lsn = 0;
+    if (synced) {
+      for (const WrittenFile &file : written) {
+	lsn = std::max(lsn, writeAheadLog.append(WalRecord::kRetire, file.fh_data, file.last_lsn, "", 0));
+      }
+      writeAheadLog.sync(lsn);
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    for (const WrittenFile &file : written) {
+      shard->pinned_lsns.erase(shard->pinned_lsns.find(file.first_lsn));
+      auto it = shard->retiring.find(file.fh_data);
+      if (--it->second == 0) shard->retiring.erase(it);
+    }
+    pthread_cond_broadcast(&shard->retired_cond);
+    pthread_mutex_unlock(&shard->mutex);
+
+    writeAheadLog.reclaim(oldestNeededLsn());
+  }
+
+  // The oldest log record some buffer still needs.
+  uint64_t oldestNeededLsn() {
+    // Read before the shards: a write logged meanwhile is newer anyway.
+    uint64_t oldest = writeAheadLog.nextLsn();
+    for (int i = 0; i < BATCH_OPTIMIZER_SHARDS; ++i) {
+      pthread_mutex_lock(&shards_[i].mutex);
+      if (!shards_[i].pinned_lsns.empty()) oldest = std::min(oldest, *shards_[i].pinned_lsns.begin());
+      pthread_mutex_unlock(&shards_[i].mutex);
+    }
+    return oldest;
+  }
+
+  Shard shards_[BATCH_OPTIMIZER_SHARDS];
+  int next_shard_;  // Where the background flusher resumes.
+  std::atomic<long> queued_bytes_;
+  std::atomic<long> queued_files_;
+  std::atomic<long> downgraded_writes_;
+  pthread_mutex_t verf_mutex;  // Serializes changes of the verifier.
 };
 
+static BatchWriteOptimizer batchWriteOptimizer;
+
+// Hands an UNSTABLE write to the batch optimizer. Returns false if the file
+// handle does not resolve to a file at the server or the write could not
+// be logged. With the log enabled, *lsn must be synced before the write is
+// acknowledged (see syncUnstableWrites). If wcc is given, it is filled in
+// from the file as it stands at the server; the size after includes this
+// write, whose data has yet to reach the file.
+bool bufferUnstableWrite(const WRITEargs &writeArgs, uint64_t *lsn, wcc_data *wcc = nullptr) {
+  struct stat sb;
+  std::unique_ptr<const std::string> server_path(getServerPath(writeArgs.file(), &sb));
+  if (server_path == nullptr) return false;
+
+  size_t count = std::min((size_t) writeArgs.count(), writeArgs.data().size());
+  if (batchWriteOptimizer.createRequest(writeArgs.file().data(), writeArgs.offset(), count,
+					writeArgs.data().data(), lsn) != BatchWriteStatus::kCreateSuccess) {
+    return false;
+  }
+  if (wcc != nullptr) {
+    struct stat after = sb;
+    after.st_size = std::max((size_t) sb.st_size, (size_t) writeArgs.offset() + count);
+    fillWcc(&sb, &after, wcc);
+  }
+  return true;
+}
+
+// Writes straight to the file and syncs it, returning the number of bytes
+// written or -1. settle_first makes sure no buffered write to the file can
+// land or be replayed over this one later. If wcc is given, it is filled in
+// with the file's attributes around the write.
+ssize_t writeStable(const WRITEargs &writeArgs, bool settle_first, wcc_data *wcc = nullptr) {
+  const std::string &fh_data = writeArgs.file().data();
+  if (settle_first) batchWriteOptimizer.settle(fh_data);
+  ScopedFileDescriptor fd(&fdCache, acquireFileDescriptor(fh_data));
+  if (fd.get() == -1) return -1;
+
+  struct stat before, after;
+  bool have_before = (wcc != nullptr && fstat(fd.get(), &before) != -1);
+  size_t count = std::min((size_t) writeArgs.count(), writeArgs.data().size());
+  ssize_t bytes_written;
+  {
+    StatTimer timer(kStatDiskWrite);
+    bytes_written = pwrite(fd.get(), writeArgs.data().data(), count, writeArgs.offset());
+  }
+  blockCache.invalidate(fh_data);
+  if (bytes_written == -1 || groupCommitter.sync(fh_data, fd.get()) != 0) return -1;
+  if (wcc != nullptr && fstat(fd.get(), &after) != -1) {
+    fillWcc(have_before ? &before : nullptr, &after, wcc);
+  }
+  return bytes_written;
+}
 
+// Makes the buffered writes up to lsn survive a restart. Always succeeds
+// without the write-ahead log, whose absence the verifier accounts for.
+bool syncUnstableWrites(uint64_t lsn) {
+  return writeAheadLog.sync(lsn);
+}
 
 #endif // _NFS_SERVER_BATCH_OPTIMIZER_H_
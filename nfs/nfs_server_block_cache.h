@@ -0,0 +1,471 @@
+#ifndef _NFS_SERVER_BLOCK_CACHE_H_
+#define _NFS_SERVER_BLOCK_CACHE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "nfs_server_slab.h"
+#include "nfs_server_stats.h"
+
+#define BLOCK_SIZE 65536                  // Unit of caching and read-ahead, one slab chunk.
+#define BLOCK_CACHE_DEFAULT_MB 256        // Default --read-cache-mb; 0 turns the cache off.
+#define BLOCK_CACHE_SHARDS 16
+#define BLOCK_CACHE_SHARD_RUN 16          // Consecutive blocks of a file kept in the same shard.
+#define BLOCK_CACHE_A1IN_PERCENT 25       // Share of the cache for blocks read only once so far.
+#define BLOCK_CACHE_A1OUT_PERCENT 50      // Evicted blocks remembered, relative to blocks cached.
+#define READ_AHEAD_TRIGGER 2              // Back-to-back reads that make a stream sequential.
+#define READ_AHEAD_BLOCKS 16              // How far ahead of a sequential reader to prefetch.
+#define READ_AHEAD_THREADS 4
+#define READ_AHEAD_QUEUE_MAX 1024         // Prefetches queued beyond this are dropped.
+#define READ_STREAMS_PER_SHARD 256        // Files whose access pattern is tracked, per shard.
+
+// A snapshot of the block cache's counters.
+struct BlockCacheMetrics {
+  long hits;               // Blocks found in the cache.
+  long misses;             // Blocks read from disk for a client.
+  long cached_bytes;
+  long prefetched_blocks;
+  long prefetched_bytes;
+  long prefetch_hits;      // Prefetched blocks later read by a client.
+};
+
+// What a file looked like when a block of it was read: a block is only
+// served while its file's modification time and size are unchanged, so
+// that changes made behind the server's back are not hidden by the cache.
+struct FileVersion {
+  explicit FileVersion(const struct stat &sb)
+    : mtime_sec(sb.st_mtim.tv_sec), mtime_nsec(sb.st_mtim.tv_nsec), size(sb.st_size) {
+  }
+
+  bool operator==(const FileVersion &other) const {
+    return mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec && size == other.size;
+  }
+
+  long mtime_sec;
+  long mtime_nsec;
+  off_t size;
+};
+
+// A block of a file: BLOCK_SIZE bytes at a multiple of BLOCK_SIZE, fewer
+// if the file ended within it when it was read.
+struct CachedBlock {
+  explicit CachedBlock(const FileVersion &version)
+    : data(BLOCK_SIZE), version(version) {
+  }
+
+  SlabChunk data;
+  FileVersion version;
+};
+
+// Caches file blocks read by READs, in memory bounded by the configured
+// capacity, and prefetches ahead of clients reading a file sequentially.
+//
+// A file's blocks are spread over the shards in runs of
+// BLOCK_CACHE_SHARD_RUN, so one large file can fill the whole cache.
+// Each shard is managed with 2Q: blocks enter a FIFO (A1in) on their first
+// read and only move to the LRU list (Am) if they are read again after
+// falling out of it, which the shard notices from a list of recently
+// evicted blocks (A1out). A large scan thus cycles through A1in without
+// pushing out the blocks that are read over and over.
+//
+// Writes to a file must call invalidate() once their data is in the file.
+// Blocks read before that, but inserted after it, are dropped rather than
+// cached: every invalidation bumps its shard's epoch, and a block is only
+// inserted if the epoch has not moved since it was read. Changes made
+// behind the server's back are caught on lookup instead: blocks carry the
+// file's modification time and size from before they were read, and are
+// dropped once the file no longer matches.
+class BlockCache {
+ public:
+  BlockCache()
+    : shard_capacity_(0), enabled_(false), hits_(0), misses_(0), prefetched_blocks_(0),
+      prefetched_bytes_(0), prefetch_hits_(0) {
+    pthread_mutex_init(&queue_mutex, nullptr);
+    pthread_cond_init(&queue_cond, nullptr);
+  }
+
+  // Sizes the cache and starts the read-ahead threads. Without a call, or
+  // with 0 bytes, reads go straight to the file.
+  bool start(size_t capacity_bytes) {
+    shard_capacity_ = capacity_bytes / BLOCK_SIZE / BLOCK_CACHE_SHARDS;
+    if (shard_capacity_ == 0) return true;
+    for (int i = 0; i < READ_AHEAD_THREADS; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, nullptr, &BlockCache::runPrefetcher, this) != 0) return false;
+      pthread_detach(thread);
+    }
+    enabled_ = true;
+    return true;
+  }
+
+  bool enabled() const { return enabled_; }
+
+  // Reads count bytes at offset of the file fh_data, open as fd, into buf
+  // through the cache. Returns the number of bytes read, fewer at the end of
+  // the file, or -1.
+  ssize_t read(const std::string &fh_data, int fd, char *buf, size_t count, size_t offset) {
+    if (!enabled_) {
+      StatTimer timer(kStatDiskRead);
+      return pread(fd, buf, count, offset);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) return -1;
+    FileVersion version(sb);
+
+    size_t done = 0;
+    bool eof = false;
+    while (done < count && !eof) {
+      size_t pos = offset + done;
+      uint64_t index = pos / BLOCK_SIZE;
+      Shard &shard = shardFor(fh_data, index);
+      std::shared_ptr<CachedBlock> block = lookup(&shard, fh_data, index, version);
+      if (block == nullptr) block = fetch(&shard, fh_data, fd, index, version, false);
+      if (block == nullptr) {
+	// Out of memory or a failed read: read the rest directly.
+	StatTimer timer(kStatDiskRead);
+	ssize_t res = pread(fd, buf + done, count - done, pos);
+	if (res == -1) return -1;
+	done += res;
+	eof = true;
+	break;
+      }
+      size_t in_block = pos - index * BLOCK_SIZE;
+      size_t length = block->data.length();
+      if (in_block >= length) break;
+      size_t n = std::min(count - done, length - in_block);
+      memcpy(buf + done, block->data.data() + in_block, n);
+      done += n;
+      eof = (length < BLOCK_SIZE && in_block + n == length);
+    }
+    noteRead(fh_data, offset, done, eof || done < count);
+    return done;
+  }
+
+  // Drops the cached blocks of a file whose data just changed.
+  void invalidate(const std::string &fh_data) {
+    if (!enabled_) return;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; ++i) {
+      Shard &shard = shards_[i];
+      pthread_mutex_lock(&shard.mutex);
+      ++shard.epoch;
+      auto file = shard.file_blocks.find(fh_data);
+      if (file != shard.file_blocks.end()) {
+	std::vector<uint64_t> indexes(file->second.begin(), file->second.end());
+	for (uint64_t index : indexes) erase(&shard, BlockKey(fh_data, index));
+      }
+      shard.streams.erase(fh_data);
+      pthread_mutex_unlock(&shard.mutex);
+    }
+  }
+
+  BlockCacheMetrics metrics() {
+    BlockCacheMetrics metrics;
+    metrics.hits = hits_;
+    metrics.misses = misses_;
+    metrics.cached_bytes = 0;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; ++i) {
+      pthread_mutex_lock(&shards_[i].mutex);
+      metrics.cached_bytes += shards_[i].cached_bytes;
+      pthread_mutex_unlock(&shards_[i].mutex);
+    }
+    metrics.prefetched_blocks = prefetched_blocks_;
+    metrics.prefetched_bytes = prefetched_bytes_;
+    metrics.prefetch_hits = prefetch_hits_;
+    return metrics;
+  }
+
+ private:
+  struct BlockKey {
+    BlockKey(const std::string &fh_data, uint64_t index)
+      : fh_data(fh_data), index(index) {
+    }
+
+    bool operator==(const BlockKey &other) const {
+      return index == other.index && fh_data == other.fh_data;
+    }
+
+    std::string fh_data;
+    uint64_t index;
+  };
+
+  struct BlockKeyHash {
+    size_t operator()(const BlockKey &key) const {
+      return std::hash<std::string>()(key.fh_data) ^ std::hash<uint64_t>()(key.index);
+    }
+  };
+
+  struct Entry {
+    std::shared_ptr<CachedBlock> block;
+    bool in_am;       // On the LRU list, else on the A1in FIFO.
+    bool prefetched;  // Read ahead and not read by a client since.
+    std::list<BlockKey>::iterator position;
+  };
+
+  // What a shard knows about the latest reads of a file.
+  struct ReadStream {
+    ReadStream()
+      : next_offset(0), sequential(0), prefetched_to(0) {
+    }
+
+    size_t next_offset;      // Where a sequential reader reads next.
+    int sequential;          // Reads in a row that started there.
+    uint64_t prefetched_to;  // Blocks before this one were already prefetched.
+  };
+
+  struct Shard {
+    Shard()
+      : epoch(0), cached_bytes(0) {
+      pthread_mutex_init(&mutex, nullptr);
+    }
+
+    pthread_mutex_t mutex;  // Guards everything below.
+    std::unordered_map<BlockKey, Entry, BlockKeyHash> entries;
+    std::list<BlockKey> a1in;   // Newest first.
+    std::list<BlockKey> am;     // Most recently used first.
+    std::list<BlockKey> a1out;  // Newest first.
+    std::unordered_map<BlockKey, std::list<BlockKey>::iterator, BlockKeyHash> ghosts;  // Of a1out.
+    std::unordered_map<std::string, std::unordered_set<uint64_t>> file_blocks;
+    std::unordered_set<BlockKey, BlockKeyHash> prefetching;  // Queued or being read.
+    std::unordered_map<std::string, ReadStream> streams;     // Of files whose first run is here.
+    uint64_t epoch;
+    long cached_bytes;
+  };
+
+  struct PrefetchRequest {
+    std::string fh_data;
+    uint64_t index;
+  };
+
+  Shard &shardFor(const std::string &fh_data, uint64_t index) {
+    return shards_[(std::hash<std::string>()(fh_data) + index / BLOCK_CACHE_SHARD_RUN) % BLOCK_CACHE_SHARDS];
+  }
+
+  // The cached block index of the file, if it was read from the file as it
+  // is now. Blocks of an older version are dropped.
+  std::shared_ptr<CachedBlock> lookup(Shard *shard, const std::string &fh_data, uint64_t index,
+				      const FileVersion &version) {
+    std::shared_ptr<CachedBlock> block;
+    pthread_mutex_lock(&shard->mutex);
+    auto it = shard->entries.find(BlockKey(fh_data, index));
+    if (it != shard->entries.end() && !(it->second.block->version == version)) {
+      erase(shard, BlockKey(fh_data, index));
+      it = shard->entries.end();
+    }
+    if (it != shard->entries.end()) {
+      Entry &entry = it->second;
+      if (entry.in_am) shard->am.splice(shard->am.begin(), shard->am, entry.position);
+      if (entry.prefetched) {
+	entry.prefetched = false;
+	++prefetch_hits_;
+      }
+      block = entry.block;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (block != nullptr) ++hits_;
+    else ++misses_;
+    return block;
+  }
+
+  // Reads block index of the file from fd and caches it, unless the file
+  // changed meanwhile. version is that of the file as of before the read.
+  // Returns nullptr if the block could not be read.
+  std::shared_ptr<CachedBlock> fetch(Shard *shard, const std::string &fh_data, int fd, uint64_t index,
+				     const FileVersion &version, bool prefetch) {
+    pthread_mutex_lock(&shard->mutex);
+    uint64_t epoch = shard->epoch;
+    pthread_mutex_unlock(&shard->mutex);
+
+    std::shared_ptr<CachedBlock> block(new CachedBlock(version));
+    if (block->data.data() == nullptr) return nullptr;
+    ssize_t bytes_read;
+    {
+      StatTimer timer(kStatDiskRead);
+      bytes_read = pread(fd, block->data.data(), BLOCK_SIZE, index * BLOCK_SIZE);
+    }
+    if (bytes_read == -1) return nullptr;
+    block->data.resize(bytes_read);
+    if (bytes_read > 0) insert(shard, BlockKey(fh_data, index), block, epoch, prefetch);
+    return block;
+  }
+
+  void insert(Shard *shard, const BlockKey &key, const std::shared_ptr<CachedBlock> &block, uint64_t epoch,
+	      bool prefetch) {
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->epoch != epoch || shard->entries.find(key) != shard->entries.end()) {
+      pthread_mutex_unlock(&shard->mutex);
+      return;
+    }
+    Entry entry;
+    entry.block = block;
+    entry.prefetched = prefetch;
+    auto ghost = shard->ghosts.find(key);
+    if (ghost != shard->ghosts.end()) {
+      // Read again since it was evicted from A1in: worth keeping for longer.
+      shard->a1out.erase(ghost->second);
+      shard->ghosts.erase(ghost);
+      entry.in_am = true;
+      shard->am.push_front(key);
+      entry.position = shard->am.begin();
+    } else {
+      entry.in_am = false;
+      shard->a1in.push_front(key);
+      entry.position = shard->a1in.begin();
+    }
+    shard->entries.insert(std::make_pair(key, entry));
+    shard->file_blocks[key.fh_data].insert(key.index);
+    shard->cached_bytes += block->data.length();
+    reclaim(shard);
+    pthread_mutex_unlock(&shard->mutex);
+  }
+
+  // Evicts blocks until the shard is within its capacity: from A1in while
+  // it holds more than its share, remembering them on A1out, else from Am.
+  void reclaim(Shard *shard) {
+    size_t a1in_capacity = std::max((size_t) 1, shard_capacity_ * BLOCK_CACHE_A1IN_PERCENT / 100);
+    size_t a1out_capacity = shard_capacity_ * BLOCK_CACHE_A1OUT_PERCENT / 100;
+    while (shard->entries.size() > shard_capacity_) {
+      if (!shard->a1in.empty() && (shard->a1in.size() > a1in_capacity || shard->am.empty())) {
+	BlockKey victim = shard->a1in.back();
+	erase(shard, victim);
+	shard->a1out.push_front(victim);
+	shard->ghosts[victim] = shard->a1out.begin();
+	while (shard->a1out.size() > a1out_capacity) {
+	  shard->ghosts.erase(shard->a1out.back());
+	  shard->a1out.pop_back();
+	}
+      } else {
+	erase(shard, BlockKey(shard->am.back()));
+      }
+    }
+  }
+
+  void erase(Shard *shard, const BlockKey &key) {
+    auto it = shard->entries.find(key);
+    if (it == shard->entries.end()) return;
+    if (it->second.in_am) shard->am.erase(it->second.position);
+    else shard->a1in.erase(it->second.position);
+    shard->cached_bytes -= it->second.block->data.length();
+    auto file = shard->file_blocks.find(key.fh_data);
+    file->second.erase(key.index);
+    if (file->second.empty()) shard->file_blocks.erase(file);
+    shard->entries.erase(it);
+  }
+
+  // Follows the reads of a file, and once they look sequential, queues the
+  // READ_AHEAD_BLOCKS blocks past the latest one for prefetching.
+  void noteRead(const std::string &fh_data, size_t offset, size_t count, bool eof) {
+    Shard *home = &shardFor(fh_data, 0);
+    uint64_t first = 0, last = 0;
+    pthread_mutex_lock(&home->mutex);
+    if (home->streams.size() >= READ_STREAMS_PER_SHARD && home->streams.find(fh_data) == home->streams.end()) {
+      home->streams.erase(home->streams.begin());
+    }
+    ReadStream &stream = home->streams[fh_data];
+    if (offset == stream.next_offset) {
+      ++stream.sequential;
+    } else {
+      stream.sequential = 1;
+      stream.prefetched_to = 0;
+    }
+    stream.next_offset = offset + count;
+    if (stream.sequential >= READ_AHEAD_TRIGGER && !eof) {
+      first = std::max(stream.prefetched_to, (uint64_t) (offset + count) / BLOCK_SIZE);
+      last = (offset + count) / BLOCK_SIZE + READ_AHEAD_BLOCKS;
+      stream.prefetched_to = std::max(stream.prefetched_to, last);
+    }
+    pthread_mutex_unlock(&home->mutex);
+
+    std::vector<PrefetchRequest> requests;
+    for (uint64_t index = first; index < last; ++index) {
+      Shard &shard = shardFor(fh_data, index);
+      BlockKey key(fh_data, index);
+      pthread_mutex_lock(&shard.mutex);
+      bool wanted = (shard.entries.find(key) == shard.entries.end() && shard.prefetching.insert(key).second);
+      pthread_mutex_unlock(&shard.mutex);
+      if (!wanted) continue;
+      PrefetchRequest request = { fh_data, index };
+      requests.push_back(request);
+    }
+    if (requests.empty()) return;
+
+    pthread_mutex_lock(&queue_mutex);
+    size_t queued = 0;
+    while (queued < requests.size() && queue_.size() < READ_AHEAD_QUEUE_MAX) {
+      queue_.push_back(requests[queued++]);
+    }
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    // Behind already: forget the rest, so that they can be queued again.
+    for (; queued < requests.size(); ++queued) finishPrefetch(requests[queued]);
+  }
+
+  void finishPrefetch(const PrefetchRequest &request) {
+    Shard &shard = shardFor(request.fh_data, request.index);
+    pthread_mutex_lock(&shard.mutex);
+    shard.prefetching.erase(BlockKey(request.fh_data, request.index));
+    pthread_mutex_unlock(&shard.mutex);
+  }
+
+  static void* runPrefetcher(void *args) {
+    BlockCache *cache = static_cast<BlockCache*>(args);
+    cache->prefetchLoop();
+    return nullptr;
+  }
+
+  void prefetchLoop() {
+    while (1) {
+      pthread_mutex_lock(&queue_mutex);
+      while (queue_.empty()) pthread_cond_wait(&queue_cond, &queue_mutex);
+      PrefetchRequest request = queue_.front();
+      queue_.pop_front();
+      pthread_mutex_unlock(&queue_mutex);
+      prefetch(request);
+    }
+  }
+
+  void prefetch(const PrefetchRequest &request) {
+    Shard &shard = shardFor(request.fh_data, request.index);
+    ScopedFileDescriptor fd(&fdCache, acquireFileDescriptor(request.fh_data));
+    struct stat sb;
+    if (fd.get() != -1 && fstat(fd.get(), &sb) != -1) {
+      std::shared_ptr<CachedBlock> block = fetch(&shard, request.fh_data, fd.get(), request.index,
+						 FileVersion(sb), true);
+      if (block != nullptr && block->data.length() > 0) {
+	++prefetched_blocks_;
+	prefetched_bytes_ += block->data.length();
+      }
+    }
+    finishPrefetch(request);
+  }
+
+  size_t shard_capacity_;  // In blocks.
+  bool enabled_;
+  Shard shards_[BLOCK_CACHE_SHARDS];
+
+  std::deque<PrefetchRequest> queue_;
+  pthread_mutex_t queue_mutex;  // Guards queue_.
+  pthread_cond_t queue_cond;
+
+  std::atomic<long> hits_;
+  std::atomic<long> misses_;
+  std::atomic<long> prefetched_blocks_;
+  std::atomic<long> prefetched_bytes_;
+  std::atomic<long> prefetch_hits_;
+};
+
+static BlockCache blockCache;
+
+#endif  // _NFS_SERVER_BLOCK_CACHE_H_
@@ -0,0 +1,164 @@
+#ifndef _NFS_SERVER_FD_CACHE_H_
+#define _NFS_SERVER_FD_CACHE_H_
+
+#include <list>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <unistd.h>
+
+#define FD_CACHE_SIZE 256  // Maximum number of idle descriptors kept open.
+
+// An open descriptor shared by all RPCs working on the same file handle.
+struct CachedFileDescriptor {
+  CachedFileDescriptor(const std::string &fh_data, int fd)
+    : fh_data(fh_data), fd(fd), refs(0), cached(true) {
+  }
+
+  std::string fh_data;
+  int fd;
+  int refs;     // Number of RPCs currently using the descriptor.
+  bool cached;  // False once evicted or invalidated, closed on last release.
+  std::list<CachedFileDescriptor*>::iterator lru_position;
+};
+
+// LRU cache of open file descriptors keyed by file handle. An entry is
+// pinned while an RPC holds a reference to it, so eviction and invalidation
+// only close descriptors nobody is using; busy ones are closed by the last
+// release().
+class FileDescriptorCache {
+ public:
+  FileDescriptorCache(size_t capacity = FD_CACHE_SIZE)
+    : capacity_(capacity), generation_(0) {
+    pthread_mutex_init(&cache_mutex, nullptr);
+  }
+
+  // Returns the cached descriptor for fh_data with a reference held, or
+  // nullptr if the handle has no open descriptor. On a miss, *generation is
+  // set to what the caller passes to insert() once it opened the file.
+  CachedFileDescriptor* lookup(const std::string &fh_data, uint64_t *generation) {
+    pthread_mutex_lock(&cache_mutex);
+    CachedFileDescriptor *entry = nullptr;
+    auto it = entries_.find(fh_data);
+    if (it != entries_.end()) {
+      entry = it->second;
+      touch(entry);
+    }
+    *generation = generation_;
+    pthread_mutex_unlock(&cache_mutex);
+    return entry;
+  }
+
+  // Caches a freshly opened fd for fh_data and returns it with a reference
+  // held. If another RPC cached the same handle meanwhile, fd is closed and
+  // the existing entry is returned instead. If a descriptor was invalidated
+  // since the lookup that missed, the file may have been removed after it
+  // was opened: fd is then returned uncached, closed on its release.
+  CachedFileDescriptor* insert(const std::string &fh_data, int fd, uint64_t generation) {
+    pthread_mutex_lock(&cache_mutex);
+    CachedFileDescriptor *entry;
+    if (generation != generation_) {
+      entry = new CachedFileDescriptor(fh_data, fd);
+      entry->cached = false;
+      entry->refs = 1;
+      pthread_mutex_unlock(&cache_mutex);
+      return entry;
+    }
+    auto it = entries_.find(fh_data);
+    if (it != entries_.end()) {
+      close(fd);
+      entry = it->second;
+    } else {
+      entry = new CachedFileDescriptor(fh_data, fd);
+      lru_.push_front(entry);
+      entry->lru_position = lru_.begin();
+      entries_[fh_data] = entry;
+    }
+    touch(entry);
+    evictIdleEntries();
+    pthread_mutex_unlock(&cache_mutex);
+    return entry;
+  }
+
+  void release(CachedFileDescriptor *entry) {
+    pthread_mutex_lock(&cache_mutex);
+    --entry->refs;
+    if (entry->refs == 0 && !entry->cached) {
+      destroy(entry);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+  }
+
+  // Drops the descriptor for fh_data, e.g. because the file was removed.
+  void invalidate(const std::string &fh_data) {
+    pthread_mutex_lock(&cache_mutex);
+    ++generation_;
+    auto it = entries_.find(fh_data);
+    if (it != entries_.end()) {
+      CachedFileDescriptor *entry = it->second;
+      detach(entry);
+      if (entry->refs == 0) destroy(entry);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+  }
+
+ private:
+  void touch(CachedFileDescriptor *entry) {
+    lru_.splice(lru_.begin(), lru_, entry->lru_position);
+    ++entry->refs;
+  }
+
+  void detach(CachedFileDescriptor *entry) {
+    entries_.erase(entry->fh_data);
+    lru_.erase(entry->lru_position);
+    entry->cached = false;
+  }
+
+  void destroy(CachedFileDescriptor *entry) {
+    close(entry->fd);
+    delete entry;
+  }
+
+  // Closes least recently used descriptors until the cache fits its
+  // capacity again. Descriptors in use are skipped.
+  void evictIdleEntries() {
+    auto it = lru_.end();
+    while (entries_.size() > capacity_ && it != lru_.begin()) {
+      CachedFileDescriptor *victim = *(--it);
+      if (victim->refs > 0) continue;
+      ++it;  // detach() invalidates the victim's position.
+      detach(victim);
+      destroy(victim);
+    }
+  }
+
+  size_t capacity_;
+  std::list<CachedFileDescriptor*> lru_;  // Most recently used first.
+  std::unordered_map<std::string, CachedFileDescriptor*> entries_;
+  uint64_t generation_;  // Bumped by every invalidate().
+  pthread_mutex_t cache_mutex;
+};
+
+// Holds a reference to a cached descriptor for the duration of an RPC.
+class ScopedFileDescriptor {
+ public:
+  ScopedFileDescriptor(FileDescriptorCache *cache, CachedFileDescriptor *entry)
+    : cache_(cache), entry_(entry) {
+  }
+
+  ~ScopedFileDescriptor() {
+    if (entry_ != nullptr) cache_->release(entry_);
+  }
+
+  int get() const { return entry_ == nullptr ? -1 : entry_->fd; }
+
+ private:
+  ScopedFileDescriptor(const ScopedFileDescriptor&);
+  ScopedFileDescriptor& operator=(const ScopedFileDescriptor&);
+
+  FileDescriptorCache *cache_;
+  CachedFileDescriptor *entry_;
+};
+
+#endif  // _NFS_SERVER_FD_CACHE_H_
@@ -0,0 +1,105 @@
+#ifndef _NFS_SERVER_FLUSHER_H_
+#define _NFS_SERVER_FLUSHER_H_
+
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "nfs_server_batch_optimizer.h"
+
+#define FLUSH_INTERVAL_US 10000                      // Pause between rounds when keeping up.
+#define FLUSH_MAX_AGE_US 50000                       // Files dirty for longer are always flushed.
+#define FLUSH_LOW_WATERMARK (16L * 1024 * 1024)      // Below it, only old files are flushed.
+#define FLUSH_HIGH_WATERMARK (64L * 1024 * 1024)     // Above it, everything is, back to back.
+#define FLUSH_MAX_FILES_PER_ROUND 256
+
+// A snapshot of the write buffer and the flusher draining it.
+struct FlusherMetrics {
+  long queued_bytes;
+  long queued_files;
+  long oldest_age_us;
+  long drain_bytes_per_sec;  // Written out by the flusher over the last second.
+  long downgraded_writes;    // UNSTABLE writes made stable by a full buffer.
+};
+
+// Drains the batch optimizer in the background at a pace set by how much
+// is buffered and for how long:
+//
+//  - files dirty for longer than FLUSH_MAX_AGE_US are flushed every round,
+//    which bounds how stale the files at the server get when idle;
+//  - between the low and high watermarks, a share of the younger files
+//    growing with the buffered bytes is flushed as well;
+//  - above the high watermark, rounds run back to back until the buffer
+//    is below it again.
+//
+// Past BUFFER_HARD_LIMIT the optimizer stops admitting UNSTABLE writes
+// altogether, see BatchWriteOptimizer::admitUnstableWrite().
+class AdaptiveFlusher {
+ public:
+  AdaptiveFlusher()
+    : window_start_us_(0), window_bytes_(0), drain_bytes_per_sec_(0) {
+    pthread_mutex_init(&metrics_mutex, nullptr);
+  }
+
+  void run() {
+    window_start_us_ = monotonicMicros();
+    while (1) {
+      FlushRound round = flushRound();
+      updateDrainRate(round.bytes);
+
+      bool behind = batchWriteOptimizer.queuedBytes() > FLUSH_HIGH_WATERMARK
+	|| batchWriteOptimizer.oldestDirtyAgeUs() > 2 * FLUSH_MAX_AGE_US;
+      if (!behind || round.files == 0) usleep(FLUSH_INTERVAL_US);
+    }
+  }
+
+  FlusherMetrics metrics() {
+    FlusherMetrics metrics;
+    metrics.queued_bytes = batchWriteOptimizer.queuedBytes();
+    metrics.queued_files = batchWriteOptimizer.queuedFiles();
+    metrics.oldest_age_us = batchWriteOptimizer.oldestDirtyAgeUs();
+    pthread_mutex_lock(&metrics_mutex);
+    metrics.drain_bytes_per_sec = drain_bytes_per_sec_;
+    pthread_mutex_unlock(&metrics_mutex);
+    metrics.downgraded_writes = batchWriteOptimizer.downgradedWrites();
+    return metrics;
+  }
+
+ private:
+  FlushRound flushRound() {
+    FlushRound round = batchWriteOptimizer.scheduledCommit(FLUSH_MAX_FILES_PER_ROUND, FLUSH_MAX_AGE_US);
+
+    long bytes = batchWriteOptimizer.queuedBytes();
+    if (bytes > FLUSH_LOW_WATERMARK) {
+      long files = batchWriteOptimizer.queuedFiles();
+      if (bytes < FLUSH_HIGH_WATERMARK) {
+	files = files * (bytes - FLUSH_LOW_WATERMARK) / (FLUSH_HIGH_WATERMARK - FLUSH_LOW_WATERMARK);
+      }
+      files = std::min(std::max(files, 1L), (long) FLUSH_MAX_FILES_PER_ROUND - round.files);
+      FlushRound young = batchWriteOptimizer.scheduledCommit(files, 0);
+      round.files += young.files;
+      round.bytes += young.bytes;
+    }
+    return round;
+  }
+
+  void updateDrainRate(size_t bytes) {
+    window_bytes_ += bytes;
+    long elapsed = monotonicMicros() - window_start_us_;
+    if (elapsed < 1000000) return;
+    pthread_mutex_lock(&metrics_mutex);
+    drain_bytes_per_sec_ = window_bytes_ * 1000000 / elapsed;
+    pthread_mutex_unlock(&metrics_mutex);
+    window_start_us_ += elapsed;
+    window_bytes_ = 0;
+  }
+
+  long window_start_us_;
+  size_t window_bytes_;
+  long drain_bytes_per_sec_;
+  pthread_mutex_t metrics_mutex;  // Guards drain_bytes_per_sec_.
+};
+
+static AdaptiveFlusher backgroundFlusher;
+
+#endif  // _NFS_SERVER_FLUSHER_H_
@@ -0,0 +1,140 @@
+#ifndef _NFS_SERVER_GROUP_COMMIT_H_
+#define _NFS_SERVER_GROUP_COMMIT_H_
+
+#include <errno.h>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <unistd.h>
+#include <vector>
+
+#include "nfs_server_io_engine.h"
+
+#define GROUP_COMMIT_MAX_WAIT_US 200  // Longest a sync waits for others to join it.
+
+// One sync shared by every request that joined it before it started.
+struct SyncBatch {
+  SyncBatch()
+    : members(0), done(false), error(0) {
+  }
+
+  int members;
+  bool done;
+  int error;  // errno of the failed sync, 0 on success.
+};
+
+// Makes concurrent durability requests share their syncs. A request that
+// finds no sync running for its file becomes the leader: it waits up to
+// the configured window for other requests to join, then syncs once and
+// answers all of them. Requests arriving while a sync is running cannot be
+// covered by it, so they join the next batch, whose leader is elected among
+// them once the running sync finishes.
+//
+// The window is only waited for when the previous batch of the file had
+// company, so a lone client never pays for it.
+class GroupCommitter {
+ public:
+  GroupCommitter()
+    : max_wait_us_(GROUP_COMMIT_MAX_WAIT_US), use_syncfs_(false) {
+    pthread_mutex_init(&group_commit_mutex, nullptr);
+    pthread_cond_init(&group_commit_cond, nullptr);
+  }
+
+  // With use_syncfs, all files share one group and a sync covers the whole
+  // filesystem, which pays off when clients commit many distinct files.
+  void configure(long max_wait_us, bool use_syncfs) {
+    max_wait_us_ = max_wait_us;
+    use_syncfs_ = use_syncfs;
+  }
+
+  // Returns once the data already written to fd (the descriptor of fh_data)
+  // is durable: 0 on success, the errno of the failed sync otherwise.
+  int sync(const std::string &fh_data, int fd) {
+    const std::string &key = use_syncfs_ ? kFilesystemKey : fh_data;
+
+    pthread_mutex_lock(&group_commit_mutex);
+    FileGroup &group = groups_[key];
+    ++group.users;
+    if (!group.open) group.open = std::make_shared<SyncBatch>();
+    std::shared_ptr<SyncBatch> batch = group.open;
+    ++batch->members;
+
+    while (!batch->done) {
+      if (group.syncing) {
+	pthread_cond_wait(&group_commit_cond, &group_commit_mutex);
+	continue;
+      }
+      lead(&group, fd);
+    }
+    int error = batch->error;
+
+    if (--group.users == 0) groups_.erase(key);
+    pthread_mutex_unlock(&group_commit_mutex);
+    return error;
+  }
+
+  // Syncs several files at once, all their syncs submitted to the I/O engine
+  // in one batch instead of one after another. Does not join other requests'
+  // groups, except that with syncfs one filesystem sync covers every file.
+  // Returns 0 if all syncs succeeded, the errno of a failed one otherwise.
+  int syncAll(const std::vector<int> &fds) {
+    if (fds.empty()) return 0;
+    if (use_syncfs_) return sync(kFilesystemKey, fds.front());
+
+    std::vector<IoOp> ops;
+    for (int fd : fds) ops.push_back(syncOp(fd));
+    for (ssize_t res : ioEngine->submitAndWait(&ops)) {
+      if (res < 0) return -res;
+    }
+    return 0;
+  }
+
+ private:
+  struct FileGroup {
+    FileGroup()
+      : users(0), syncing(false), last_members(1) {
+    }
+
+    int users;                        // Requests in sync() for this group.
+    bool syncing;
+    int last_members;                 // Size of the previous batch.
+    std::shared_ptr<SyncBatch> open;  // Batch still accepting members.
+  };
+
+  // Runs the open batch of group. Called, and returns, with the mutex held.
+  void lead(FileGroup *group, int fd) {
+    group->syncing = true;
+    if (max_wait_us_ > 0 && group->last_members > 1) {
+      pthread_mutex_unlock(&group_commit_mutex);
+      usleep(max_wait_us_);
+      pthread_mutex_lock(&group_commit_mutex);
+    }
+    std::shared_ptr<SyncBatch> batch;
+    batch.swap(group->open);
+
+    pthread_mutex_unlock(&group_commit_mutex);
+    uint64_t start_ns = statsClockNs();
+    int res = use_syncfs_ ? syncfs(fd) : fdatasync(fd);
+    int error = (res == -1) ? errno : 0;
+    serverStats.record(kStatFsync, statsClockNs() - start_ns);
+    pthread_mutex_lock(&group_commit_mutex);
+
+    batch->done = true;
+    batch->error = error;
+    group->last_members = batch->members;
+    group->syncing = false;
+    pthread_cond_broadcast(&group_commit_cond);
+  }
+
+  const std::string kFilesystemKey;
+  long max_wait_us_;
+  bool use_syncfs_;
+  std::unordered_map<std::string, FileGroup> groups_;
+  pthread_mutex_t group_commit_mutex;
+  pthread_cond_t group_commit_cond;
+};
+
+static GroupCommitter groupCommitter;
+
+#endif  // _NFS_SERVER_GROUP_COMMIT_H_
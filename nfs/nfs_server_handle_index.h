@@ -0,0 +1,105 @@
+#ifndef _NFS_SERVER_HANDLE_INDEX_H_
+#define _NFS_SERVER_HANDLE_INDEX_H_
+
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <dirent.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define HANDLE_INDEX_SHARDS 64  // Number of independently locked shards.
+
+// Maps a file handle (the inode number of a file at the server) to its path
+// under the export. The index is built once at startup and kept up to date
+// by CREATE, MKDIR, REMOVE and RMDIR, so resolving a handle is a hash lookup
+// instead of a walk over the whole export.
+class HandleIndex {
+ public:
+  HandleIndex() {
+    for (int i = 0; i < HANDLE_INDEX_SHARDS; ++i) {
+      pthread_rwlock_init(&shards_[i].lock, nullptr);
+    }
+  }
+
+  // Walks the directory tree rooted at root and indexes every entry in it,
+  // including root itself.
+  void build(const std::string &root) {
+    struct stat sb;
+    if (lstat(root.c_str(), &sb) == -1) return;
+    insert(sb.st_ino, root);
+    buildFrom(root);
+  }
+
+  bool lookup(long inode_no, std::string *path) {
+    Shard &shard = shardFor(inode_no);
+    pthread_rwlock_rdlock(&shard.lock);
+    auto entry = shard.paths.find(inode_no);
+    bool found = (entry != shard.paths.end());
+    if (found) *path = entry->second;
+    pthread_rwlock_unlock(&shard.lock);
+    return found;
+  }
+
+  void insert(long inode_no, const std::string &path) {
+    Shard &shard = shardFor(inode_no);
+    pthread_rwlock_wrlock(&shard.lock);
+    shard.paths[inode_no] = path;
+    pthread_rwlock_unlock(&shard.lock);
+  }
+
+  void erase(long inode_no) {
+    Shard &shard = shardFor(inode_no);
+    pthread_rwlock_wrlock(&shard.lock);
+    shard.paths.erase(inode_no);
+    pthread_rwlock_unlock(&shard.lock);
+  }
+
+  size_t size() {
+    size_t total = 0;
+    for (int i = 0; i < HANDLE_INDEX_SHARDS; ++i) {
+      pthread_rwlock_rdlock(&shards_[i].lock);
+      total += shards_[i].paths.size();
+      pthread_rwlock_unlock(&shards_[i].lock);
+    }
+    return total;
+  }
+
+ private:
+  struct Shard {
+    pthread_rwlock_t lock;
+    std::unordered_map<long, std::string> paths;
+  };
+
+  Shard &shardFor(long inode_no) {
+    return shards_[(unsigned long) inode_no % HANDLE_INDEX_SHARDS];
+  }
+
+  void buildFrom(const std::string &path) {
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) return;
+
+    dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      const char *d_name = entry->d_name;
+      if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0) continue;
+
+      std::string r_path = path + "/" + std::string(d_name);
+      unsigned char d_type = entry->d_type;
+      if (d_type == DT_UNKNOWN) {
+        // Some filesystems do not fill in d_type, fall back to lstat.
+        struct stat sb;
+        if (lstat(r_path.c_str(), &sb) == -1) continue;
+        d_type = S_ISDIR(sb.st_mode) ? DT_DIR : DT_REG;
+      }
+      insert(entry->d_ino, r_path);
+      if (d_type == DT_DIR) buildFrom(r_path);
+    }
+    closedir(dir);
+  }
+
+  Shard shards_[HANDLE_INDEX_SHARDS];
+};
+
+#endif  // _NFS_SERVER_HANDLE_INDEX_H_
@@ -0,0 +1,296 @@
+#ifndef _NFS_SERVER_IO_ENGINE_H_
+#define _NFS_SERVER_IO_ENGINE_H_
+
+#include <algorithm>
+#include <errno.h>
+#include <functional>
+#include <iterator>
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "nfs_server_stats.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define IO_URING_QUEUE_DEPTH 256  // Submission queue entries of the io_uring engine.
+
+// Called once an operation completes, with what the matching system call
+// returns on success (bytes transferred, or 0 for a sync) or -errno.
+typedef std::function<void(ssize_t)> IoCallback;
+
+enum IoOpcode {
+  kIoRead,
+  kIoWritev,
+  kIoSync  // fdatasync
+};
+
+// One disk operation. Buffers must stay valid until it completes.
+struct IoOp {
+  IoOpcode opcode;
+  int fd;
+  char *buf;                // kIoRead
+  size_t count;             // kIoRead
+  const struct iovec *iov;  // kIoWritev
+  int iovcnt;               // kIoWritev
+  off_t offset;
+  IoCallback done;
+};
+
+IoOp readOp(int fd, char *buf, size_t count, off_t offset, IoCallback done = IoCallback()) {
+  IoOp op = { kIoRead, fd, buf, count, nullptr, 0, offset, done };
+  return op;
+}
+
+IoOp writevOp(int fd, const struct iovec *iov, int iovcnt, off_t offset, IoCallback done = IoCallback()) {
+  IoOp op = { kIoWritev, fd, nullptr, 0, iov, iovcnt, offset, done };
+  return op;
+}
+
+IoOp syncOp(int fd, IoCallback done = IoCallback()) {
+  IoOp op = { kIoSync, fd, nullptr, 0, nullptr, 0, 0, done };
+  return op;
+}
+
+// The disk time histogram an operation counts towards.
+StatId ioStat(IoOpcode opcode) {
+  switch (opcode) {
+  case kIoRead: return kStatDiskRead;
+  case kIoWritev: return kStatDiskWrite;
+  default: return kStatFsync;
+  }
+}
+
+// Where the server's reads, writes and syncs go. submit() hands a batch of
+// operations to the engine in one go; each op's callback runs when it
+// completes, which may be before submit() returns or later on another
+// thread, and must not block.
+class IoEngine {
+ public:
+  virtual ~IoEngine() {}
+
+  virtual const char* name() const = 0;
+
+  virtual void submit(std::vector<IoOp> *ops) = 0;
+
+  // Submits ops and waits for all of them, returning their results in order.
+  // Callbacks already set on ops are not run.
+  std::vector<ssize_t> submitAndWait(std::vector<IoOp> *ops) {
+    std::vector<ssize_t> results(ops->size());
+    Latch latch(ops->size());
+    for (size_t i = 0; i < ops->size(); ++i) {
+      ssize_t *result = &results[i];
+      (*ops)[i].done = [result, &latch](ssize_t res) {
+	*result = res;
+	latch.countDown();
+      };
+    }
+    submit(ops);
+    latch.wait();
+    return results;
+  }
+
+ private:
+  struct Latch {
+    Latch(size_t count)
+      : count(count) {
+      pthread_mutex_init(&mutex, nullptr);
+      pthread_cond_init(&cond, nullptr);
+    }
+
+    ~Latch() {
+      pthread_mutex_destroy(&mutex);
+      pthread_cond_destroy(&cond);
+    }
+
+    void countDown() {
+      pthread_mutex_lock(&mutex);
+      if (--count == 0) pthread_cond_signal(&cond);
+      pthread_mutex_unlock(&mutex);
+    }
+
+    void wait() {
+      pthread_mutex_lock(&mutex);
+      while (count > 0) pthread_cond_wait(&cond, &mutex);
+      pthread_mutex_unlock(&mutex);
+    }
+
+    size_t count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+  };
+};
+
+// Runs every operation with the plain system call on the submitting
+// thread, so callbacks run before submit() returns.
+class BlockingIoEngine : public IoEngine {
+ public:
+  const char* name() const override { return "blocking"; }
+
+  void submit(std::vector<IoOp> *ops) override {
+    for (IoOp &op : *ops) {
+      uint64_t start_ns = statsClockNs();
+      ssize_t res;
+      switch (op.opcode) {
+      case kIoRead: res = pread(op.fd, op.buf, op.count, op.offset); break;
+      case kIoWritev: res = pwritev(op.fd, op.iov, op.iovcnt, op.offset); break;
+      case kIoSync: res = fdatasync(op.fd); break;
+      default: res = -1; errno = EINVAL; break;
+      }
+      if (res == -1) res = -errno;
+      serverStats.record(ioStat(op.opcode), statsClockNs() - start_ns);
+      op.done(res);
+    }
+  }
+};
+
+static BlockingIoEngine blockingIoEngine;
+
+#ifdef HAVE_LIBURING
+// Queues operations on an io_uring, a whole batch per io_uring_enter, and
+// runs their callbacks on a thread of its own as completions come in. Disk
+// I/O in flight is then bounded by the ring, not by how many threads the
+// server is willing to block. Only built with -DHAVE_LIBURING, linking
+// against liburing (-luring).
+class IoUringEngine : public IoEngine {
+ public:
+  IoUringEngine() {
+    pthread_mutex_init(&submit_mutex, nullptr);
+  }
+
+  // Sets up the ring; false if the kernel does not support io_uring.
+  bool start(unsigned entries) {
+    if (io_uring_queue_init(entries, &ring_, 0) < 0) return false;
+    pthread_t reaper;
+    if (pthread_create(&reaper, nullptr, &IoUringEngine::reap, this) != 0) {
+      io_uring_queue_exit(&ring_);
+      return false;
+    }
+    pthread_detach(reaper);
+    return true;
+  }
+
+  const char* name() const override { return "io_uring"; }
+
+  void submit(std::vector<IoOp> *ops) override {
+    pthread_mutex_lock(&submit_mutex);
+    std::vector<PendingOp> pending;
+    size_t i = 0;
+    for (; i < ops->size(); ++i) {
+      IoOp &op = (*ops)[i];
+      struct io_uring_sqe *sqe;
+      // If the submission queue is full, hand what is queued to the kernel.
+      while ((sqe = io_uring_get_sqe(&ring_)) == nullptr && submitPending(&pending)) {}
+      if (sqe == nullptr) break;
+      switch (op.opcode) {
+      case kIoRead: io_uring_prep_read(sqe, op.fd, op.buf, op.count, op.offset); break;
+      case kIoWritev: io_uring_prep_writev(sqe, op.fd, op.iov, op.iovcnt, op.offset); break;
+      case kIoSync: io_uring_prep_fsync(sqe, op.fd, IORING_FSYNC_DATASYNC); break;
+      }
+      // Times the operation from its submission to its completion.
+      IoCallback done = std::move(op.done);
+      StatId stat = ioStat(op.opcode);
+      uint64_t start_ns = statsClockNs();
+      IoCallback *callback = new IoCallback([done, stat, start_ns](ssize_t res) {
+	serverStats.record(stat, statsClockNs() - start_ns);
+	done(res);
+      });
+      io_uring_sqe_set_data(sqe, callback);
+      pending.push_back(PendingOp(sqe, callback));
+    }
+    if (i == ops->size()) submitPending(&pending);
+    pthread_mutex_unlock(&submit_mutex);
+
+    if (i < ops->size()) {
+      // The ring is unusable: run the rest of the batch without it.
+      std::vector<IoOp> rest(std::make_move_iterator(ops->begin() + i),
+			     std::make_move_iterator(ops->end()));
+      blockingIoEngine.submit(&rest);
+    }
+  }
+
+ private:
+  // An operation queued on the ring that the kernel has not taken yet.
+  typedef std::pair<struct io_uring_sqe*, IoCallback*> PendingOp;
+
+  // Submits the queued operations. On an error other than a transient one,
+  // those the kernel did not take are failed with it and turned into no-ops,
+  // so that their callbacks run exactly once. Called with submit_mutex held.
+  bool submitPending(std::vector<PendingOp> *pending) {
+    int res;
+    do {
+      res = io_uring_submit(&ring_);
+    } while (res == -EINTR || res == -EAGAIN || res == -EBUSY);
+
+    // Whatever is still in the submission queue is the tail of pending.
+    size_t unsubmitted = std::min((size_t) io_uring_sq_ready(&ring_), pending->size());
+    if (res >= 0) {
+      pending->erase(pending->begin(), pending->end() - unsubmitted);
+      return true;
+    }
+    for (size_t i = pending->size() - unsubmitted; i < pending->size(); ++i) {
+      io_uring_prep_nop((*pending)[i].first);
+      io_uring_sqe_set_data((*pending)[i].first, nullptr);
+      (*(*pending)[i].second)(res);
+      delete (*pending)[i].second;
+    }
+    pending->clear();
+    return false;
+  }
+
+  static void* reap(void *args) {
+    IoUringEngine *engine = static_cast<IoUringEngine*>(args);
+    while (1) {
+      struct io_uring_cqe *cqe;
+      int res = io_uring_wait_cqe(&engine->ring_, &cqe);
+      if (res == -EINTR) continue;
+      if (res < 0) break;
+      IoCallback *done = static_cast<IoCallback*>(io_uring_cqe_get_data(cqe));
+      ssize_t result = cqe->res;
+      io_uring_cqe_seen(&engine->ring_, cqe);
+      if (done == nullptr) continue;  // An operation already failed by submit().
+      (*done)(result);
+      delete done;
+    }
+    return nullptr;
+  }
+
+  struct io_uring ring_;
+  pthread_mutex_t submit_mutex;  // Guards the submission queue.
+};
+
+static IoUringEngine ioUringEngine;
+#endif
+
+static IoEngine *ioEngine = &blockingIoEngine;
+
+// Switches the server to the named engine. io_uring falls back to the
+// blocking engine, and says so, if it is unavailable.
+bool selectIoEngine(const std::string &name) {
+  if (name == "blocking") {
+    ioEngine = &blockingIoEngine;
+    return true;
+  }
+  if (name != "io_uring") return false;
+  #ifdef HAVE_LIBURING
+  if (ioUringEngine.start(IO_URING_QUEUE_DEPTH)) {
+    ioEngine = &ioUringEngine;
+    return true;
+  }
+  fprintf(stderr, "io_uring is not available, using blocking I/O\n");
+  #else
+  fprintf(stderr, "Built without liburing, using blocking I/O\n");
+  #endif
+  ioEngine = &blockingIoEngine;
+  return true;
+}
+
+#endif  // _NFS_SERVER_IO_ENGINE_H_
@@ -0,0 +1,271 @@
+#ifndef _NFS_SERVER_SLAB_H_
+#define _NFS_SERVER_SLAB_H_
+
+#include <algorithm>
+#include <atomic>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define SLAB_MIN_CHUNK 512                       // Smallest size class.
+#define SLAB_MAX_CHUNK 65536                     // Largest size class, longer data is chained.
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_MAX_IDLE_BYTES (16L * 1024 * 1024)  // Free chunks kept per size class.
+
+// Pool of power-of-two sized chunks for buffered write data. Chunks from a
+// page up are page aligned, smaller ones are aligned to their size. Freed
+// chunks go back on their class's free list, up to SLAB_MAX_IDLE_BYTES per
+// class, so a steady write load recycles the same memory instead of
+// churning through malloc.
+class SlabPool {
+ public:
+  SlabPool()
+    : allocated_bytes_(0), recycled_chunks_(0) {
+    for (int i = 0; i < kNumClasses; ++i) pthread_mutex_init(&classes_[i].mutex, nullptr);
+  }
+
+  // The capacity of the chunk allocate() returns for size bytes.
+  static size_t chunkSize(size_t size) {
+    size_t capacity = SLAB_MIN_CHUNK;
+    while (capacity < size && capacity < SLAB_MAX_CHUNK) capacity <<= 1;
+    return capacity;
+  }
+
+  char* allocate(size_t capacity) {
+    SizeClass &size_class = classes_[classIndex(capacity)];
+    pthread_mutex_lock(&size_class.mutex);
+    char *data = nullptr;
+    if (!size_class.free_chunks.empty()) {
+      data = size_class.free_chunks.back();
+      size_class.free_chunks.pop_back();
+    }
+    pthread_mutex_unlock(&size_class.mutex);
+    if (data != nullptr) {
+      ++recycled_chunks_;
+      return data;
+    }
+
+    void *memory = nullptr;
+    if (posix_memalign(&memory, std::min(capacity, (size_t) SLAB_PAGE_SIZE), capacity) != 0) return nullptr;
+    allocated_bytes_ += capacity;
+    return static_cast<char*>(memory);
+  }
+
+  void release(char *data, size_t capacity) {
+    SizeClass &size_class = classes_[classIndex(capacity)];
+    pthread_mutex_lock(&size_class.mutex);
+    bool keep = (size_class.free_chunks.size() + 1) * capacity <= SLAB_MAX_IDLE_BYTES;
+    if (keep) size_class.free_chunks.push_back(data);
+    pthread_mutex_unlock(&size_class.mutex);
+    if (!keep) {
+      free(data);
+      allocated_bytes_ -= capacity;
+    }
+  }
+
+  // Memory held by the pool, in use or idle.
+  long allocatedBytes() const { return allocated_bytes_; }
+
+  long recycledChunks() const { return recycled_chunks_; }
+
+ private:
+  static const int kNumClasses = 8;  // SLAB_MIN_CHUNK << 0 .. 7
+
+  struct SizeClass {
+    pthread_mutex_t mutex;
+    std::vector<char*> free_chunks;
+  };
+
+  static int classIndex(size_t capacity) {
+    int index = 0;
+    while ((size_t) (SLAB_MIN_CHUNK << index) < capacity) ++index;
+    return index;
+  }
+
+  SizeClass classes_[kNumClasses];
+  std::atomic<long> allocated_bytes_;
+  std::atomic<long> recycled_chunks_;
+};
+
+static SlabPool slabPool;
+
+// A chunk of the slab pool holding the first length bytes of some data.
+// Returns its memory to the pool when destroyed; movable, not copyable.
+class SlabChunk {
+ public:
+  explicit SlabChunk(size_t capacity)
+    : data_(slabPool.allocate(capacity)), capacity_(capacity), length_(0) {
+  }
+
+  SlabChunk(SlabChunk &&other) noexcept
+    : data_(other.data_), capacity_(other.capacity_), length_(other.length_) {
+    other.data_ = nullptr;
+  }
+
+  SlabChunk& operator=(SlabChunk &&other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(length_, other.length_);
+    return *this;
+  }
+
+  ~SlabChunk() {
+    if (data_ != nullptr) slabPool.release(data_, capacity_);
+  }
+
+  char* data() const { return data_; }
+  size_t capacity() const { return capacity_; }
+  size_t length() const { return length_; }
+  size_t room() const { return capacity_ - length_; }
+
+  // Sets how many bytes hold data, after filling them in through data().
+  void resize(size_t length) {
+    length_ = std::min(length, capacity_);
+  }
+
+  // Appends as much of buf as fits and returns how much that was.
+  size_t append(const char *buf, size_t count) {
+    if (data_ == nullptr) return 0;
+    size_t n = std::min(count, room());
+    memcpy(data_ + length_, buf, n);
+    length_ += n;
+    return n;
+  }
+
+ private:
+  SlabChunk(const SlabChunk&);
+  SlabChunk& operator=(const SlabChunk&);
+
+  char *data_;
+  size_t capacity_;
+  size_t length_;
+};
+
+// A run of contiguous bytes kept in a chain of slab chunks. Appending never
+// moves what is already there, and appending another chain just takes over
+// its chunks.
+class ChunkedData {
+ public:
+  ChunkedData()
+    : length_(0) {
+  }
+
+  ChunkedData(const char *buf, size_t count)
+    : length_(0) {
+    append(buf, count);
+  }
+
+  ChunkedData(ChunkedData &&other) noexcept
+    : length_(0) {
+    swap(other);
+  }
+
+  ChunkedData& operator=(ChunkedData &&other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  void swap(ChunkedData &other) noexcept {
+    chunks_.swap(other.chunks_);
+    starts_.swap(other.starts_);
+    std::swap(length_, other.length_);
+  }
+
+  size_t length() const { return length_; }
+
+  bool valid() const {
+    for (const SlabChunk &chunk : chunks_) if (chunk.data() == nullptr) return false;
+    return true;
+  }
+
+  void append(const char *buf, size_t count) {
+    if (!chunks_.empty()) {
+      size_t n = chunks_.back().append(buf, count);
+      buf += n;
+      count -= n;
+      length_ += n;
+    }
+    while (count > 0) {
+      starts_.push_back(length_);
+      chunks_.emplace_back(SlabPool::chunkSize(count));
+      if (chunks_.back().data() == nullptr) return;  // Out of memory, see valid().
+      size_t n = chunks_.back().append(buf, count);
+      buf += n;
+      count -= n;
+      length_ += n;
+    }
+  }
+
+  // Takes over the chunks of other, which is left empty.
+  void append(ChunkedData &&other) {
+    for (size_t i = 0; i < other.chunks_.size(); ++i) {
+      starts_.push_back(length_ + other.starts_[i]);
+      chunks_.push_back(std::move(other.chunks_[i]));
+    }
+    length_ += other.length_;
+    other.clear();
+  }
+
+  // Appends bytes [from, length()) of other.
+  void appendTail(const ChunkedData &other, size_t from) {
+    other.forEachSegment(from, other.length_ - from, [this](const char *buf, size_t n) {
+      append(buf, n);
+    });
+  }
+
+  // Overwrites bytes [pos, pos + count) with those of other starting at
+  // from. The range must lie within this chain.
+  void overwrite(size_t pos, const ChunkedData &other, size_t from, size_t count) {
+    other.forEachSegment(from, count, [this, &pos](const char *buf, size_t n) {
+      overwrite(pos, buf, n);
+      pos += n;
+    });
+  }
+
+  void overwrite(size_t pos, const char *buf, size_t count) {
+    size_t i = chunkAt(pos);
+    while (count > 0) {
+      size_t in_chunk = pos - starts_[i];
+      size_t n = std::min(count, chunks_[i].length() - in_chunk);
+      memcpy(chunks_[i].data() + in_chunk, buf, n);
+      buf += n;
+      pos += n;
+      count -= n;
+      ++i;
+    }
+  }
+
+  // Calls fn(buf, n) for the consecutive pieces of bytes [pos, pos + count).
+  template <typename Fn>
+  void forEachSegment(size_t pos, size_t count, Fn fn) const {
+    if (count == 0) return;
+    size_t i = chunkAt(pos);
+    while (count > 0) {
+      size_t in_chunk = pos - starts_[i];
+      size_t n = std::min(count, chunks_[i].length() - in_chunk);
+      fn(chunks_[i].data() + in_chunk, n);
+      pos += n;
+      count -= n;
+      ++i;
+    }
+  }
+
+  void clear() {
+    chunks_.clear();
+    starts_.clear();
+    length_ = 0;
+  }
+
+ private:
+  // The index of the chunk holding byte pos.
+  size_t chunkAt(size_t pos) const {
+    return std::upper_bound(starts_.begin(), starts_.end(), pos) - starts_.begin() - 1;
+  }
+
+  std::vector<SlabChunk> chunks_;
+  std::vector<size_t> starts_;  // Offset of every chunk's first byte.
+  size_t length_;
+};
+
+#endif  // _NFS_SERVER_SLAB_H_
@@ -0,0 +1,166 @@
+#ifndef _NFS_SERVER_STATS_H_
+#define _NFS_SERVER_STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "nfs_latency_histogram.h"
+
+// What the server keeps a histogram of. Procedures count the time to serve
+// a call, or a whole stream for the streaming ones; operations inside a
+// COMPOUND also count as their own procedure. Disk times are in ns too,
+// flush sizes in bytes.
+enum StatId {
+  kStatGetattr,
+  kStatSetattr,
+  kStatLookup,
+  kStatRead,
+  kStatReadStream,
+  kStatWrite,
+  kStatWriteStream,
+  kStatCommit,
+  kStatCreate,
+  kStatRemove,
+  kStatMkdir,
+  kStatRmdir,
+  kStatReaddir,
+  kStatReaddirplus,
+  kStatCompound,
+  kNumProcedureStats,
+  kStatDiskRead = kNumProcedureStats,
+  kStatDiskWrite,
+  kStatFsync,
+  kStatFlushBytes,  // Bytes of each file flushed from the write buffer.
+  kNumStats
+};
+
+static const char *kProcedureNames[kNumProcedureStats] = {
+  "GETATTR", "SETATTR", "LOOKUP", "READ", "READ_STREAM", "WRITE", "WRITE_STREAM", "COMMIT",
+  "CREATE", "REMOVE", "MKDIR", "RMDIR", "READDIR", "READDIRPLUS", "COMPOUND"
+};
+
+uint64_t statsClockNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Histograms kept per thread, so recording a value is a few uncontended
+// memory writes, and merged when read. Each thread only ever writes its own
+// counters; relaxed atomics let a reader sum them up meanwhile. A thread
+// that exits leaves its counters to the next thread that starts, so nothing
+// counted is lost and the number of blocks stays bounded by the number of
+// threads alive at once.
+class ServerStats {
+ public:
+  ServerStats()
+    : start_ns_(statsClockNs()) {
+    pthread_mutex_init(&threads_mutex, nullptr);
+  }
+
+  void record(StatId id, uint64_t value) {
+    ThreadStats *stats = local();
+    bump(&stats->buckets[id][histogramBucket(value)], 1);
+    bump(&stats->sums[id], value);
+  }
+
+  Histogram snapshot(StatId id) {
+    Histogram merged;
+    pthread_mutex_lock(&threads_mutex);
+    for (ThreadStats *stats : all_) {
+      for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+	uint64_t n = stats->buckets[id][i].load(std::memory_order_relaxed);
+	merged.buckets[i] += n;
+	merged.count += n;
+      }
+      merged.sum += stats->sums[id].load(std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&threads_mutex);
+    return merged;
+  }
+
+  uint64_t uptimeNs() const { return statsClockNs() - start_ns_; }
+
+ private:
+  struct ThreadStats {
+    ThreadStats() {
+      for (int id = 0; id < kNumStats; ++id) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) buckets[id][i].store(0, std::memory_order_relaxed);
+	sums[id].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    std::atomic<uint64_t> buckets[kNumStats][HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> sums[kNumStats];
+  };
+
+  // Lends a thread a block of counters for as long as it runs.
+  struct ThreadSlot {
+    explicit ThreadSlot(ServerStats *owner)
+      : owner(owner), stats(owner->acquire()) {
+    }
+
+    ~ThreadSlot() { owner->release(stats); }
+
+    ServerStats *owner;
+    ThreadStats *stats;
+  };
+
+  // Only the owning thread writes, so no read-modify-write is needed.
+  static void bump(std::atomic<uint64_t> *counter, uint64_t n) {
+    counter->store(counter->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  ThreadStats* local() {
+    static thread_local ThreadSlot slot(this);
+    return slot.stats;
+  }
+
+  ThreadStats* acquire() {
+    pthread_mutex_lock(&threads_mutex);
+    ThreadStats *stats;
+    if (!idle_.empty()) {
+      stats = idle_.back();
+      idle_.pop_back();
+    } else {
+      stats = new ThreadStats();
+      all_.push_back(stats);
+    }
+    pthread_mutex_unlock(&threads_mutex);
+    return stats;
+  }
+
+  void release(ThreadStats *stats) {
+    pthread_mutex_lock(&threads_mutex);
+    idle_.push_back(stats);
+    pthread_mutex_unlock(&threads_mutex);
+  }
+
+  uint64_t start_ns_;
+  std::vector<ThreadStats*> all_;   // Never freed: they hold counts of threads gone.
+  std::vector<ThreadStats*> idle_;  // Blocks of exited threads, for new ones.
+  pthread_mutex_t threads_mutex;    // Guards all_ and idle_.
+};
+
+static ServerStats serverStats;
+
+// Records the time from its construction to its destruction under id.
+class StatTimer {
+ public:
+  explicit StatTimer(StatId id)
+    : id_(id), start_ns_(statsClockNs()) {
+  }
+
+  ~StatTimer() { serverStats.record(id_, statsClockNs() - start_ns_); }
+
+ private:
+  StatTimer(const StatTimer&);
+  StatTimer& operator=(const StatTimer&);
+
+  StatId id_;
+  uint64_t start_ns_;
+};
+
+#endif  // _NFS_SERVER_STATS_H_
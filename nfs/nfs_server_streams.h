@@ -0,0 +1,228 @@
+#ifndef _NFS_SERVER_STREAMS_H_
+#define _NFS_SERVER_STREAMS_H_
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "nfs_server_utilities.h"
+#include "nfs_server_batch_optimizer.h"
+
+#define READ_STREAM_CHUNK_SIZE READ_MAX_COUNT  // Bytes carried by each streamed READres.
+#define READDIR_STREAM_ENTRIES 1024   // Default entries carried by each streamed READDIRres.
+
+using nfs::READargs;
+using nfs::READres;
+using nfs::READDIRargs;
+using nfs::READDIRres;
+using nfs::READDIRresok;
+using nfs::WRITEargs;
+using nfs::WRITEres;
+using nfs::WRITEresok;
+
+// Cursors produce the messages of a server-streaming RPC one at a time, so
+// the same code serves the sync API (looping over ServerWriter::Write) and
+// the async server (one outstanding write at a time). next() fills in the
+// next message and returns false once the stream is complete.
+
+// Streams the requested range of a file in READ_STREAM_CHUNK_SIZE pieces.
+// Only one chunk is buffered at a time, so memory per call stays bounded no
+// matter how large a range the client asks for.
+class ReadStreamCursor {
+ public:
+  ReadStreamCursor(const READargs &readArgs)
+    : fh_data_(readArgs.file().data()),
+      fd_(&fdCache, acquireFileDescriptor(readArgs.file().data())),
+      offset_(readArgs.offset()),
+      remaining_(readArgs.count()),
+      done_(false),
+      buf_(new char[READ_STREAM_CHUNK_SIZE]) {
+  }
+
+  bool next(READres *readRes) {
+    if (done_) return false;
+    if (fd_.get() == -1) {
+      readRes->mutable_resfail();
+      done_ = true;
+      return true;
+    }
+    if (remaining_ == 0) return false;
+
+    size_t chunk_size = std::min(remaining_, (size_t) READ_STREAM_CHUNK_SIZE);
+    ssize_t bytes_read = blockCache.read(fh_data_, fd_.get(), buf_.get(), chunk_size, offset_);
+    if (bytes_read == -1) {
+      readRes->mutable_resfail();
+      done_ = true;
+      return true;
+    }
+
+    bool eof = ((size_t) bytes_read < chunk_size);
+    readRes->mutable_resok()->set_data(buf_.get(), bytes_read);
+    readRes->mutable_resok()->set_count(bytes_read);
+    readRes->mutable_resok()->set_eof(eof);
+    offset_ += bytes_read;
+    remaining_ -= bytes_read;
+    done_ = eof;
+    // The last chunk carries the file's attributes as of the end of the read.
+    struct stat sb;
+    if ((done_ || remaining_ == 0) && fstat(fd_.get(), &sb) != -1) {
+      fillAttributes(sb, readRes->mutable_resok()->mutable_file_attributes());
+    }
+    return true;
+  }
+
+ private:
+  std::string fh_data_;
+  ScopedFileDescriptor fd_;
+  size_t offset_;
+  size_t remaining_;
+  bool done_;
+  std::unique_ptr<char[]> buf_;
+};
+
+// Streams the entries of a directory, but "." and "..", resuming after the
+// entry whose cookie the client passes back. An entry's cookie is where the
+// directory stream stood after reading it, as telldir() reports it, so a
+// listing broken off by a failed stream picks up on a new RPC where it left
+// off. With plus, every entry also carries its file handle and attributes,
+// and the handle is indexed so that the client's next RPC on it resolves
+// without a search.
+template <bool plus>
+class DirectoryCursor {
+ public:
+  DirectoryCursor(const READDIRargs &readDirArgs)
+    : dir_(nullptr),
+      per_message_(readDirArgs.count() > 0 ? readDirArgs.count() : READDIR_STREAM_ENTRIES),
+      done_(false) {
+    std::unique_ptr<const std::string> server_path(getServerPath(readDirArgs.dir()));
+    if (server_path == nullptr) return;
+    path_ = *server_path;
+    if (path_.empty() || path_.back() != '/') path_ += '/';
+    dir_ = opendir(path_.c_str());
+    if (dir_ != nullptr && readDirArgs.cookie() != 0) seekdir(dir_, readDirArgs.cookie());
+  }
+
+  ~DirectoryCursor() {
+    if (dir_ != nullptr) closedir(dir_);
+  }
+
+  bool next(READDIRres *readDirRes) {
+    if (done_) return false;
+    if (dir_ == nullptr) {
+      readDirRes->mutable_resfail();
+      done_ = true;
+      return true;
+    }
+
+    READDIRresok *resok = readDirRes->mutable_resok();
+    while ((size_t) resok->entries_size() < per_message_) {
+      errno = 0;
+      struct dirent *de = readdir(dir_);
+      if (de == nullptr) {
+	if (errno != 0) readDirRes->mutable_resfail();
+	else resok->set_eof(true);
+	done_ = true;
+	break;
+      }
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+      nfs::entry *entry = resok->add_entries();
+      entry->set_fileid(de->d_ino);
+      entry->set_name(de->d_name);
+      entry->set_cookie(telldir(dir_));
+      if (plus) addAttributes(de, entry);
+    }
+    return true;
+  }
+
+ private:
+  void addAttributes(const struct dirent *de, nfs::entry *entry) {
+    struct stat sb;
+    if (fstatat(dirfd(dir_), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) return;  // Gone meanwhile.
+    fillAttributes(sb, entry->mutable_name_attributes()->mutable_attributes());
+    entry->mutable_name_handle()->mutable_handle()->set_data(std::to_string(sb.st_ino));
+    handleIndex.insert(sb.st_ino, path_ + de->d_name);
+  }
+
+  std::string path_;  // With a trailing slash.
+  DIR *dir_;
+  size_t per_message_;
+  bool done_;
+};
+
+typedef DirectoryCursor<false> ReadDirCursor;
+typedef DirectoryCursor<true> ReadDirPlusCursor;
+
+// Sinks are the client-streaming counterpart of cursors: consume() is called
+// for every message the client sends and finish() fills in the single reply
+// once the client closes the stream.
+
+// Feeds the chunks of an NFSPROC_WRITE_STREAM into the unstable write buffer
+// and acknowledges them all at once with the server's verifier, after one
+// sync of the write-ahead log if it is enabled.
+class WriteStreamSink {
+ public:
+  WriteStreamSink()
+    : verf_(serverVerifier()), bytes_written_(0), last_lsn_(0), failed_(false) {
+  }
+
+  void consume(WRITEargs *writeArgs) {
+    if (failed_) return;  // Drain the rest of the stream.
+    if (!batchWriteOptimizer.admitUnstableWrite()) {
+      // The buffer is full, write this chunk through instead.
+      wcc_data wcc;
+      ssize_t bytes_written = writeStable(*writeArgs, true, &wcc);
+      if (bytes_written == -1) {
+	failed_ = true;
+      } else {
+	mergeWcc(wcc);
+	bytes_written_ += bytes_written;
+      }
+      return;
+    }
+    uint64_t lsn = 0;
+    wcc_data wcc;
+    if (bufferUnstableWrite(*writeArgs, &lsn, &wcc)) {
+      mergeWcc(wcc);
+      last_lsn_ = std::max(last_lsn_, lsn);
+      bytes_written_ += std::min((size_t) writeArgs->count(), writeArgs->data().size());
+    } else {
+      failed_ = true;
+    }
+  }
+
+  void finish(WRITEres *writeRes) {
+    if (failed_ || !syncUnstableWrites(last_lsn_)) {
+      writeRes->mutable_resfail();
+      return;
+    }
+    writeRes->mutable_resok()->set_count(bytes_written_);
+    writeRes->mutable_resok()->set_verf(verf_);
+    writeRes->mutable_resok()->set_committed(WRITEresok::UNSTABLE);
+    writeRes->mutable_resok()->mutable_file_wcc()->Swap(&wcc_);
+  }
+
+ private:
+  // Keeps the attributes from before the first chunk, and those after the
+  // latest one grown to the furthest any chunk reached.
+  void mergeWcc(const wcc_data &wcc) {
+    uint64_t size = wcc_.after().attributes().size();
+    if (!wcc_.has_before()) *wcc_.mutable_before() = wcc.before();
+    *wcc_.mutable_after() = wcc.after();
+    if (size > wcc_.after().attributes().size()) {
+      wcc_.mutable_after()->mutable_attributes()->set_size(size);
+    }
+  }
+
+  wcc_data wcc_;  // For the file the stream writes to.
+  std::string verf_;  // As of before the first chunk was buffered.
+  size_t bytes_written_;
+  uint64_t last_lsn_;
+  bool failed_;
+};
+
+#endif  // _NFS_SERVER_STREAMS_H_
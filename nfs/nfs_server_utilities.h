@@ -3,6 +3,7 @@
 
 #define SERVER_DATA_DIR "/tmp/nfs_server"
 #define LAG_TIME 5  // Time in seconds that server lags before replying.
+#define READ_MAX_COUNT 65536  // Most bytes one READ reply carries; streamed READs send this much per message.
 
 // #define DEBUG true
 
@@ -11,10 +12,35 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <stdio.h>
+#include <chrono>
+#include <pthread.h>
+
+#include "nfs_server_fd_cache.h"
+#include "nfs_server_handle_index.h"
 
 using nfs::nfs_fh;
+using nfs::fattr;
+using nfs::nfstime;
+using nfs::wcc_data;
 
 static const std::string SERVER_DATA_DIR_STR = std::string(SERVER_DATA_DIR);
+// Changes with every restart that may have lost acknowledged unstable
+// writes; see the write-ahead log.
+static std::string SERVER_VERF = std::to_string(std::chrono::system_clock::now().time_since_epoch() / std::chrono::milliseconds(1));
+static pthread_mutex_t server_verf_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards SERVER_VERF once serving.
+
+std::string serverVerifier() {
+  pthread_mutex_lock(&server_verf_mutex);
+  std::string verf = SERVER_VERF;
+  pthread_mutex_unlock(&server_verf_mutex);
+  return verf;
+}
+
+void setServerVerifier(const std::string &verf) {
+  pthread_mutex_lock(&server_verf_mutex);
+  SERVER_VERF = verf;
+  pthread_mutex_unlock(&server_verf_mutex);
+}
 
 const std::string* getPathName(std::string fh_data) {
   std::unique_ptr<std::string> server_path(new std::string(std::string(SERVER_DATA_DIR) + fh_data));
@@ -27,77 +53,98 @@ const std::string* getPathName(std::string fh_data) {
   return server_path.release();
 }
 
-const char* inode_path(std::string path, int level, long inode_no)
-{
+const std::string* getPathName(nfs_fh file_handle) {
+  return getPathName(file_handle.data());
+}
+
+
+static HandleIndex handleIndex;
+
+// Resolves a file handle to its path at the server. If sb is given, it is
+// set to the attributes of the file as of the lookup.
+const std::string* getServerPath(std::string fh_data, struct stat *sb = nullptr) {
+  long inode_no = atol(fh_data.c_str());
+  std::unique_ptr<std::string> server_path(new std::string());
   struct stat path_stat;
-  int res = lstat(path.c_str(), &path_stat);
-  if (res == -1) return nullptr;  // End-of-Recursion
-  
-  long curr_inode = (long) path_stat.st_ino;
-  if (curr_inode == inode_no) {
-      return path.c_str();  // Inode found, End-of-Recursion!
-  }
-  
-  if (S_ISREG(path_stat.st_mode)) {
-    // Regular File detected, End-of-Recursion 
-    return nullptr;
-  }
-  
-  DIR *dir;
-  dirent *entry;
-    
-  if (!(dir = opendir(path.c_str()))) return nullptr;
-
-  if (!(entry = readdir(dir))) return nullptr;
-
-  do {
-    const char *d_name = entry->d_name;
-    if (strcmp(d_name, ".") != 0 && strcmp(d_name, "..") != 0) {
-      std::string r_path = path + "/" + std::string(d_name);
-      const char* result = inode_path(r_path, level + 1, inode_no);
-      if (result != nullptr) {
-	closedir(dir);
-	return result;
-      }
+  if (sb == nullptr) sb = &path_stat;
+
+  if (handleIndex.lookup(inode_no, server_path.get())) {
+    // Guard against entries made stale by changes behind the server's back.
+    if (lstat(server_path->c_str(), sb) != -1 && (long) sb->st_ino == inode_no) {
+      return server_path.release();
     }
-  } while (entry = readdir(dir));
-  closedir(dir);
+    handleIndex.erase(inode_no);
+  }
+  // The index covers every file the server knows of, so a miss is a stale
+  // handle.
   return nullptr;
 }
 
-const std::string* getPathName(nfs_fh file_handle) {
-  return getPathName(file_handle.data());
+const std::string* getServerPath(nfs_fh file_handle, struct stat *sb = nullptr) {
+  return getServerPath(file_handle.data(), sb);
 }
 
+void fillTime(const struct timespec &ts, nfstime *time) {
+  time->set_seconds(ts.tv_sec);
+  time->set_nseconds(ts.tv_nsec);
+}
 
-const std::string* getServerPath(std::string fh_data) {
-  long inode_no = atol(fh_data.c_str());
-  const char *ret_path = inode_path(SERVER_DATA_DIR_STR, 0, inode_no);
-  if (ret_path == nullptr) {
-    std::unique_ptr<std::string> server_path(nullptr);
-    return server_path.release();
+// Populates fattr based on stat.
+void fillAttributes(const struct stat &sb, fattr *attributes) {
+  switch(sb.st_mode & S_IFMT) {
+  case S_IFDIR: attributes->set_type(fattr::NFSDIR); break;
+  case S_IFREG: attributes->set_type(fattr::NFSREG); break;
+  default: break;
   }
-  else {
-    std::unique_ptr<std::string> server_path(new std::string(ret_path));
-    return server_path.release();
+  attributes->set_size(sb.st_size);
+  attributes->set_used(sb.st_blocks * 512);
+  attributes->set_fsid(sb.st_dev);
+  attributes->set_fileid(sb.st_ino);
+  fillTime(sb.st_atim, attributes->mutable_atime());
+  fillTime(sb.st_mtim, attributes->mutable_mtime());
+  fillTime(sb.st_ctim, attributes->mutable_ctime());
+}
+
+// Populates wcc with the attributes of a file before and after a change;
+// either may be null if unknown. Clients compare the ones from before with
+// what they have cached to tell whether someone else changed the file.
+void fillWcc(const struct stat *before, const struct stat *after, wcc_data *wcc) {
+  if (before != nullptr) {
+    nfs::wcc_attr *attributes = wcc->mutable_before()->mutable_attributes();
+    attributes->set_size(before->st_size);
+    fillTime(before->st_mtim, attributes->mutable_mtime());
+    fillTime(before->st_ctim, attributes->mutable_ctime());
   }
+  if (after != nullptr) fillAttributes(*after, wcc->mutable_after()->mutable_attributes());
 }
 
-const std::string* getServerPath(nfs_fh file_handle) {
-  return getServerPath(file_handle.data());
+// Populates wcc with the attributes of the directory holding server_path,
+// after an entry was added to or removed from it.
+void fillParentWcc(const std::string &server_path, wcc_data *wcc) {
+  struct stat sb;
+  std::string parent = server_path.substr(0, server_path.find_last_of('/'));
+  if (lstat(parent.c_str(), &sb) != -1) fillWcc(nullptr, &sb, wcc);
 }
 
-int synchronous_write(const std::string *server_path, size_t offset, size_t count, const char *buf) {
-    int fd = open(server_path->c_str(), O_WRONLY);
-    if (fd == -1) {
-      return -1;
-    } else {
-      size_t bytes_written = pwrite(fd, buf, count, offset);
-      fsync(fd);
-      close(fd);
-      return bytes_written;
-    }
+static FileDescriptorCache fdCache;
+
+// Returns an open descriptor for the file handle, reusing a cached one when
+// possible. The caller must release it through fdCache.
+CachedFileDescriptor* acquireFileDescriptor(const std::string &fh_data) {
+  uint64_t generation;
+  CachedFileDescriptor *entry = fdCache.lookup(fh_data, &generation);
+  if (entry != nullptr) return entry;
+
+  std::unique_ptr<const std::string> server_path(getServerPath(fh_data));
+  if (server_path == nullptr) return nullptr;
+
+  int fd = open(server_path->c_str(), O_RDWR);
+  if (fd == -1) {
+    fd = open(server_path->c_str(), O_RDONLY);  // e.g. a directory.
+    if (fd == -1) return nullptr;
   }
+  return fdCache.insert(fh_data, fd, generation);
+}
 
 
 #endif  // _NFS_SERVER_UTILITIES_H_
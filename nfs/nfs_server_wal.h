@@ -0,0 +1,386 @@
+#ifndef _NFS_SERVER_WAL_H_
+#define _NFS_SERVER_WAL_H_
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "nfs_server_utilities.h"
+#include "nfs_server_group_commit.h"
+
+#define WAL_DIR "/tmp/nfs_server_wal"        // Outside the export on purpose.
+#define WAL_SEGMENT_SIZE (64 * 1024 * 1024)  // Segments rotate past this size.
+#define WAL_RECORD_MAGIC 0x4c41574e          // "NWAL"
+#define WAL_HEADER_SIZE 36
+
+struct WalChecksumTable {
+  WalChecksumTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      entries[i] = c;
+    }
+  }
+
+  uint32_t entries[256];
+};
+
+// CRC-32 (IEEE) of len bytes at data.
+uint32_t walChecksum(const char *data, size_t len) {
+  static const WalChecksumTable table;
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < len; ++i) {
+    crc = table.entries[(crc ^ (unsigned char) data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// One log record. A kWrite record carries an UNSTABLE write. A kRetire
+// record says that every write to fh with an LSN up to watermark no longer
+// needs replaying, because it has been synced to the file or the file was
+// removed.
+//
+// On disk: magic, crc, lsn, offset (the watermark of a kRetire record),
+// type, fh length and data length, followed by the fh and the data. The
+// crc covers everything after itself.
+struct WalRecord {
+  enum Type { kWrite = 1, kRetire = 2 };
+
+  uint64_t lsn;
+  uint64_t offset;
+  uint32_t type;
+  std::string fh_data;
+  std::string data;
+};
+
+// An open log segment. Closed when the log lets go of it and no sync still
+// uses it.
+struct WalSegment {
+  WalSegment(uint64_t first_lsn, const std::string &path, int fd)
+    : first_lsn(first_lsn), path(path), fd(fd), size(0) {
+  }
+
+  ~WalSegment() {
+    close(fd);
+  }
+
+  uint64_t first_lsn;
+  std::string path;
+  int fd;
+  size_t size;
+};
+
+// An append-only log of UNSTABLE writes, so that a restarted server still
+// has every write it acknowledged and can keep its verifier, sparing the
+// clients a full retransmission.
+//
+// Records are appended to the current segment and made durable with one
+// fdatasync shared by all concurrent writers (through the group committer).
+// A full segment is synced before the log moves to the next one, so a crash
+// can only tear the current segment; an earlier one only ends in a torn
+// record if an append failed and could not be cut off. Segments are deleted
+// once every write in them has been retired.
+class WriteAheadLog {
+ public:
+  WriteAheadLog()
+    : enabled_(false), next_lsn_(1) {
+    pthread_mutex_init(&wal_mutex, nullptr);
+  }
+
+  bool enabled() const { return enabled_; }
+
+  // Replays whatever a previous run left in dir into the export and clears
+  // the log. Returns true if the log was read to its end without damage, in
+  // which case every write the previous run acknowledged is on disk now.
+  bool replay(const std::string &dir) {
+    dir_ = dir;
+    std::vector<std::string> segments = listSegments();
+    if (segments.empty()) return true;
+
+    // First pass: find how far each file's writes have been retired.
+    std::unordered_map<std::string, uint64_t> retired;
+    bool clean = true;
+    for (size_t i = 0; i < segments.size(); ++i) {
+      std::vector<WalRecord> records;
+      bool complete = readSegment(segments[i], &records);
+      // Only the last segment can be torn by a crash. An earlier one was
+      // torn by a failed append (see append()) and counts as damage.
+      if (!complete && i + 1 < segments.size()) clean = false;
+      for (const WalRecord &record : records) {
+	next_lsn_ = std::max(next_lsn_, record.lsn + 1);
+	if (record.type == WalRecord::kRetire) {
+	  uint64_t &watermark = retired[record.fh_data];
+	  watermark = std::max(watermark, record.offset);
+	}
+      }
+    }
+
+    // Second pass: apply the writes nobody retired, in log order.
+    std::unordered_set<std::string> touched;
+    for (const std::string &segment : segments) {
+      std::vector<WalRecord> records;
+      readSegment(segment, &records);
+      for (const WalRecord &record : records) {
+	if (record.type != WalRecord::kWrite) continue;
+	auto it = retired.find(record.fh_data);
+	if (it != retired.end() && record.lsn <= it->second) continue;
+
+	ScopedFileDescriptor fd(&fdCache, acquireFileDescriptor(record.fh_data));
+	if (fd.get() == -1) continue;  // The file is gone, and its writes with it.
+	if (pwrite(fd.get(), record.data.data(), record.data.size(), record.offset) != (ssize_t) record.data.size()) {
+	  clean = false;
+	}
+	touched.insert(record.fh_data);
+      }
+    }
+    for (const std::string &fh_data : touched) {
+      ScopedFileDescriptor fd(&fdCache, acquireFileDescriptor(fh_data));
+      if (fd.get() == -1 || fdatasync(fd.get()) == -1) clean = false;
+    }
+
+    std::cout << "Replayed " << touched.size() << " files from " << segments.size()
+	      << " log segments" << (clean ? "" : " (damaged)") << std::endl;
+    for (const std::string &segment : segments) unlink(segment.c_str());
+    syncDirectory();
+    return clean;
+  }
+
+  // Starts logging into dir. replay() must have run on dir first.
+  bool open(const std::string &dir) {
+    dir_ = dir;
+    mkdir(dir_.c_str(), 0755);
+    pthread_mutex_lock(&wal_mutex);
+    bool opened = startSegment();
+    pthread_mutex_unlock(&wal_mutex);
+    enabled_ = opened;
+    return opened;
+  }
+
+  // Returns the verifier persisted in the log directory if reuse is set
+  // and there is one, otherwise persists fresh and returns it.
+  std::string loadVerifier(const std::string &fresh, bool reuse) {
+    std::string path = dir_ + "/verifier";
+    if (reuse) {
+      FILE *file = fopen(path.c_str(), "r");
+      if (file != nullptr) {
+	char buf[64];
+	size_t len = fread(buf, 1, sizeof(buf), file);
+	fclose(file);
+	if (len > 0) return std::string(buf, len);
+      }
+    }
+
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+      bool written = (write(fd, fresh.data(), fresh.size()) == (ssize_t) fresh.size() && fsync(fd) == 0);
+      close(fd);
+      if (written) rename(tmp_path.c_str(), path.c_str());
+      syncDirectory();
+    }
+    return fresh;
+  }
+
+  // Removes a persisted verifier, so that a later run cannot reuse it.
+  void forgetVerifier(const std::string &dir) {
+    unlink((dir + "/verifier").c_str());
+  }
+
+  // Appends a record and returns its LSN, or 0 if it could not be written.
+  // The record is not durable before sync() says so.
+  uint64_t append(WalRecord::Type type, const std::string &fh_data, uint64_t offset,
+		  const char *data, size_t count) {
+    std::string record(WAL_HEADER_SIZE, '\0');
+    record.append(fh_data);
+    record.append(data, count);
+
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = next_lsn_;
+    uint32_t magic = WAL_RECORD_MAGIC;
+    uint32_t type_field = type;
+    uint32_t fh_len = fh_data.size();
+    uint32_t data_len = count;
+    memcpy(&record[0], &magic, 4);
+    memcpy(&record[8], &lsn, 8);
+    memcpy(&record[16], &offset, 8);
+    memcpy(&record[24], &type_field, 4);
+    memcpy(&record[28], &fh_len, 4);
+    memcpy(&record[32], &data_len, 4);
+    uint32_t crc = walChecksum(record.data() + 8, record.size() - 8);
+    memcpy(&record[4], &crc, 4);
+
+    if (current_->size + record.size() > WAL_SEGMENT_SIZE && current_->size > 0) {
+      if (!rotate()) {
+	pthread_mutex_unlock(&wal_mutex);
+	return 0;
+      }
+    }
+    if (!writeFully(current_->fd, record.data(), record.size())) {
+      // Cut off whatever part made it, so the next record starts clean. If
+      // that fails too, the log moves on to a new segment and leaves the
+      // torn record behind. Replay then finds the log damaged, so the
+      // verifier is not reused and clients resend what they did not commit.
+      if (ftruncate(current_->fd, current_->size) == -1) rotate();
+      pthread_mutex_unlock(&wal_mutex);
+      return 0;
+    }
+    current_->size += record.size();
+    ++next_lsn_;
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+  }
+
+  // Returns once every record up to lsn is durable, false if syncing the
+  // log failed.
+  bool sync(uint64_t lsn) {
+    if (lsn == 0) return true;
+    pthread_mutex_lock(&wal_mutex);
+    std::shared_ptr<WalSegment> segment = current_;
+    pthread_mutex_unlock(&wal_mutex);
+    if (lsn < segment->first_lsn) return true;  // Synced when its segment closed.
+    return groupCommitter.sync(kWalGroupKey, segment->fd) == 0;
+  }
+
+  // The LSN the next record will get.
+  uint64_t nextLsn() {
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = next_lsn_;
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+  }
+
+  // Deletes the closed segments that only hold records below oldest_needed.
+  void reclaim(uint64_t oldest_needed) {
+    pthread_mutex_lock(&wal_mutex);
+    bool reclaimed = false;
+    while (segments_.size() > 1 && segments_[1]->first_lsn <= oldest_needed) {
+      unlink(segments_.front()->path.c_str());
+      segments_.pop_front();
+      reclaimed = true;
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    if (reclaimed) syncDirectory();
+  }
+
+ private:
+  // Opens a new segment starting at next_lsn_. Called with the mutex held.
+  bool startSegment() {
+    char name[64];
+    snprintf(name, sizeof(name), "/wal-%020llu.log", (unsigned long long) next_lsn_);
+    std::string path = dir_ + name;
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return false;
+    syncDirectory();
+    current_ = std::make_shared<WalSegment>(next_lsn_, path, fd);
+    segments_.push_back(current_);
+    return true;
+  }
+
+  // Closes the current segment, which makes everything in it durable, and
+  // moves on to a new one. Called with the mutex held.
+  bool rotate() {
+    return fdatasync(current_->fd) == 0 && startSegment();
+  }
+
+  // Segment paths in dir_, oldest first.
+  std::vector<std::string> listSegments() {
+    std::vector<std::string> segments;
+    DIR *dir = opendir(dir_.c_str());
+    if (dir == nullptr) return segments;
+    dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      if (strncmp(entry->d_name, "wal-", 4) == 0) segments.push_back(dir_ + "/" + entry->d_name);
+    }
+    closedir(dir);
+    std::sort(segments.begin(), segments.end());  // Zero padded LSNs sort in order.
+    return segments;
+  }
+
+  // Reads the intact records of a segment. Returns false if the segment
+  // ends in a torn or corrupt record.
+  bool readSegment(const std::string &path, std::vector<WalRecord> *records) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat sb;
+    std::string contents;
+    if (fstat(fd, &sb) == 0) {
+      contents.resize(sb.st_size);
+      ssize_t bytes_read = pread(fd, &contents[0], contents.size(), 0);
+      contents.resize(bytes_read > 0 ? bytes_read : 0);
+    }
+    close(fd);
+
+    size_t pos = 0;
+    while (pos + WAL_HEADER_SIZE <= contents.size()) {
+      const char *header = contents.data() + pos;
+      uint32_t magic, crc, type, fh_len, data_len;
+      WalRecord record;
+      memcpy(&magic, header, 4);
+      memcpy(&crc, header + 4, 4);
+      memcpy(&record.lsn, header + 8, 8);
+      memcpy(&record.offset, header + 16, 8);
+      memcpy(&type, header + 24, 4);
+      memcpy(&fh_len, header + 28, 4);
+      memcpy(&data_len, header + 32, 4);
+      size_t length = WAL_HEADER_SIZE + (size_t) fh_len + data_len;
+      if (magic != WAL_RECORD_MAGIC || pos + length > contents.size()) break;
+      if (walChecksum(header + 8, length - 8) != crc) break;
+
+      record.type = type;
+      record.fh_data.assign(header + WAL_HEADER_SIZE, fh_len);
+      record.data.assign(header + WAL_HEADER_SIZE + fh_len, data_len);
+      records->push_back(record);
+      pos += length;
+    }
+    return pos == contents.size();
+  }
+
+  static bool writeFully(int fd, const char *buf, size_t count) {
+    while (count > 0) {
+      ssize_t written = write(fd, buf, count);
+      if (written == -1) {
+	if (errno == EINTR) continue;
+	return false;
+      }
+      buf += written;
+      count -= written;
+    }
+    return true;
+  }
+
+  // Makes creations and deletions of segments durable.
+  void syncDirectory() {
+    int fd = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) return;
+    fsync(fd);
+    close(fd);
+  }
+
+  // Group committer key of the log; file handles are all digits.
+  const std::string kWalGroupKey = "wal";
+
+  bool enabled_;
+  std::string dir_;
+  uint64_t next_lsn_;
+  std::shared_ptr<WalSegment> current_;
+  std::deque<std::shared_ptr<WalSegment>> segments_;  // Oldest first.
+  pthread_mutex_t wal_mutex;
+};
+
+static WriteAheadLog writeAheadLog;
+
+#endif  // _NFS_SERVER_WAL_H_
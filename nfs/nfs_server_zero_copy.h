@@ -0,0 +1,245 @@
+#ifndef _NFS_SERVER_ZERO_COPY_H_
+#define _NFS_SERVER_ZERO_COPY_H_
+
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <grpc/slice.h>
+#include <grpc++/grpc++.h>
+
+#include "nfs_server_utilities.h"
+#include "nfs_server_io_engine.h"
+
+#define ZERO_COPY_READ_THRESHOLD 65536  // Smaller reads are copied, mmap costs more.
+
+using nfs::READargs;
+using nfs::READres;
+
+// Counts the mmap-backed READ replies still owned by gRPC, per file handle.
+// A mapping must not outlive the file's data: touching a page past a new,
+// shorter end of file raises SIGBUS. A read therefore calls begin() before
+// it looks at the file's size, and SETATTR truncates between
+// beginTruncate() and endTruncate(), which wait for the handle's mappings to
+// drain and hold new ones off meanwhile.
+class MappedReadTracker {
+ public:
+  MappedReadTracker() {
+    pthread_mutex_init(&mapped_reads_mutex, nullptr);
+    pthread_cond_init(&mapped_reads_cond, nullptr);
+  }
+
+  void begin(const std::string &fh_data) {
+    pthread_mutex_lock(&mapped_reads_mutex);
+    while (truncating.find(fh_data) != truncating.end()) {
+      pthread_cond_wait(&mapped_reads_cond, &mapped_reads_mutex);
+    }
+    ++mapped_reads[fh_data];
+    pthread_mutex_unlock(&mapped_reads_mutex);
+  }
+
+  void end(const std::string &fh_data) {
+    pthread_mutex_lock(&mapped_reads_mutex);
+    if (--mapped_reads[fh_data] == 0) {
+      mapped_reads.erase(fh_data);
+      pthread_cond_broadcast(&mapped_reads_cond);
+    }
+    pthread_mutex_unlock(&mapped_reads_mutex);
+  }
+
+  void beginTruncate(const std::string &fh_data) {
+    pthread_mutex_lock(&mapped_reads_mutex);
+    // One truncation at a time: the first holds new reads off, and the
+    // second must not clear that while the first is still truncating.
+    while (truncating.find(fh_data) != truncating.end()) {
+      pthread_cond_wait(&mapped_reads_cond, &mapped_reads_mutex);
+    }
+    truncating.insert(fh_data);
+    while (mapped_reads.find(fh_data) != mapped_reads.end()) {
+      pthread_cond_wait(&mapped_reads_cond, &mapped_reads_mutex);
+    }
+    pthread_mutex_unlock(&mapped_reads_mutex);
+  }
+
+  void endTruncate(const std::string &fh_data) {
+    pthread_mutex_lock(&mapped_reads_mutex);
+    truncating.erase(fh_data);
+    pthread_cond_broadcast(&mapped_reads_cond);
+    pthread_mutex_unlock(&mapped_reads_mutex);
+  }
+
+ private:
+  std::unordered_map<std::string, int> mapped_reads;
+  std::unordered_set<std::string> truncating;
+  pthread_mutex_t mapped_reads_mutex;  // Guards mapped_reads and truncating.
+  pthread_cond_t mapped_reads_cond;
+};
+
+static MappedReadTracker mappedReads;
+
+// A file region mapped for one READ reply, unmapped once gRPC has sent it.
+struct MappedRegion {
+  std::string fh_data;
+  void *addr;
+  size_t length;
+};
+
+void unmapRegion(void *user_data) {
+  MappedRegion *region = static_cast<MappedRegion*>(user_data);
+  munmap(region->addr, region->length);
+  mappedReads.end(region->fh_data);
+  delete region;
+}
+
+// Appends a protobuf varint to out.
+void appendVarint(uint64_t value, std::string *out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Serializes a successful READres around data without copying data: the
+// message is encoded as a header slice followed by the data slice, which
+// is exactly the wire format of a READres whose resok ends with its data
+// field.
+void serializeReadResok(const READres &readRes, grpc::Slice data, grpc::ByteBuffer *out) {
+  const int kResokField = 1;  // READres.resok
+  const int kDataField = 4;   // READresok.data
+  const int kLengthDelimited = 2;
+
+  std::string resok_head;
+  readRes.resok().SerializeToString(&resok_head);  // Everything but the data.
+  appendVarint((kDataField << 3) | kLengthDelimited, &resok_head);
+  appendVarint(data.size(), &resok_head);
+
+  std::string head;
+  appendVarint((kResokField << 3) | kLengthDelimited, &head);
+  appendVarint(resok_head.size() + data.size(), &head);
+  head += resok_head;
+
+  grpc::Slice slices[] = { grpc::Slice(head), data };
+  grpc::ByteBuffer buffer(slices, data.size() > 0 ? 2 : 1);
+  out->Swap(&buffer);
+}
+
+void serializeReadResfail(grpc::ByteBuffer *out) {
+  READres readRes;
+  readRes.mutable_resfail();
+  bool own_buffer;
+  grpc::SerializationTraits<READres>::Serialize(readRes, out, &own_buffer);
+}
+
+typedef std::function<void(grpc::ByteBuffer*)> ReadReplyCallback;
+
+// A READ whose data is being read into its reply slice.
+struct PendingRead {
+  PendingRead(const std::string &fh_data, ReadReplyCallback done)
+    : fd(&fdCache, acquireFileDescriptor(fh_data)), done(done) {
+  }
+
+  ScopedFileDescriptor fd;  // Held until the read completes.
+  grpc_slice slice;
+  size_t offset;
+  struct stat sb;  // Of the file as the read started.
+  ReadReplyCallback done;
+};
+
+void finishRead(PendingRead *read, ssize_t bytes_read) {
+  std::unique_ptr<PendingRead> owner(read);
+  grpc::ByteBuffer reply;
+  if (bytes_read < 0) {
+    grpc_slice_unref(read->slice);
+    serializeReadResfail(&reply);
+    read->done(&reply);
+    return;
+  }
+  size_t count = bytes_read;
+  grpc::Slice data(grpc_slice_sub(read->slice, 0, count), grpc::Slice::STEAL_REF);
+  grpc_slice_unref(read->slice);
+
+  READres readRes;
+  readRes.mutable_resok()->set_count(count);
+  readRes.mutable_resok()->set_eof(read->offset + count >= (size_t) read->sb.st_size);
+  fillAttributes(read->sb, readRes.mutable_resok()->mutable_file_attributes());
+  serializeReadResok(readRes, data, &reply);
+  read->done(&reply);
+}
+
+// Builds the serialized reply to readArgs and passes it to done. Large
+// reads hand the file's pages to gRPC through an mmap-backed slice, small
+// ones are read straight into a slice of their own, from the block cache if
+// it is enabled and through the I/O engine if not; either way the data is
+// never copied into a protobuf message. done may
+// run on the engine's completion thread, after this returns.
+void buildZeroCopyReadReply(const READargs &readArgs, ReadReplyCallback done) {
+  const std::string &fh_data = readArgs.file().data();
+  std::unique_ptr<PendingRead> read(new PendingRead(fh_data, done));
+  const ScopedFileDescriptor &fd = read->fd;
+  grpc::ByteBuffer reply;
+  // Reads that may be mapped keep truncation off from before the size is
+  // looked at until the mapping is gone.
+  bool may_map = (fd.get() != -1 && readArgs.count() >= ZERO_COPY_READ_THRESHOLD);
+  if (may_map) mappedReads.begin(fh_data);
+  struct stat sb;
+  if (fd.get() == -1 || fstat(fd.get(), &sb) == -1) {
+    if (may_map) mappedReads.end(fh_data);
+    serializeReadResfail(&reply);
+    done(&reply);
+    return;
+  }
+
+  size_t offset = readArgs.offset();
+  size_t file_size = sb.st_size;
+  size_t count = (offset >= file_size) ? 0 : std::min((size_t) readArgs.count(), file_size - offset);
+  count = std::min(count, (size_t) READ_MAX_COUNT);
+
+  grpc::Slice data;
+  bool mapped = false;
+  if (count >= ZERO_COPY_READ_THRESHOLD) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t map_offset = offset - offset % page_size;
+    size_t map_length = count + (offset - map_offset);
+    void *addr = mmap(nullptr, map_length, PROT_READ, MAP_SHARED, fd.get(), map_offset);
+    if (addr != MAP_FAILED) {
+      MappedRegion *region = new MappedRegion();
+      region->fh_data = fh_data;
+      region->addr = addr;
+      region->length = map_length;
+      mapped = true;
+      grpc_slice slice = grpc_slice_new_with_user_data(static_cast<char*>(addr) + (offset - map_offset),
+                                                       count, unmapRegion, region);
+      data = grpc::Slice(slice, grpc::Slice::STEAL_REF);
+    }
+  }
+  if (may_map && !mapped) mappedReads.end(fh_data);
+  if (data.size() == count) {
+    READres readRes;
+    readRes.mutable_resok()->set_count(count);
+    readRes.mutable_resok()->set_eof(offset + count >= file_size);
+    fillAttributes(sb, readRes.mutable_resok()->mutable_file_attributes());
+    serializeReadResok(readRes, data, &reply);
+    done(&reply);
+    return;
+  }
+
+  read->slice = grpc_slice_malloc(count);
+  read->offset = offset;
+  read->sb = sb;
+  PendingRead *pending = read.release();
+  if (blockCache.enabled()) {
+    char *buf = reinterpret_cast<char*>(GRPC_SLICE_START_PTR(pending->slice));
+    finishRead(pending, blockCache.read(fh_data, fd.get(), buf, count, offset));
+    return;
+  }
+  std::vector<IoOp> ops(1, readOp(fd.get(), reinterpret_cast<char*>(GRPC_SLICE_START_PTR(pending->slice)),
+				  count, offset, [pending](ssize_t res) { finishRead(pending, res); }));
+  ioEngine->submit(&ops);
+}
+
+#endif  // _NFS_SERVER_ZERO_COPY_H_
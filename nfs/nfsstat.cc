@@ -0,0 +1,140 @@
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <grpc++/grpc++.h>
+
+#include "nfs.grpc.pb.h"
+#include "nfs_latency_histogram.h"
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Status;
+using nfs::NFS;
+using nfs::STATSargs;
+using nfs::STATSres;
+
+// Prints the server's counters, like nfsstat(8): calls, rates and latency
+// percentiles per procedure, disk times, and the state of the write buffer
+// and the block cache. Given an interval, it keeps printing what happened
+// during each one; otherwise it prints the totals since the server started.
+
+Histogram toHistogram(const nfs::histogram &in) {
+  Histogram histogram;
+  for (int i = 0; i < in.buckets_size() && i < HISTOGRAM_BUCKETS; ++i) histogram.buckets[i] = in.buckets(i);
+  histogram.count = in.count();
+  histogram.sum = in.sum();
+  return histogram;
+}
+
+std::string formatNs(uint64_t ns) {
+  char buf[32];
+  if (ns < 1000) snprintf(buf, sizeof(buf), "%lluns", (unsigned long long) ns);
+  else if (ns < 1000000) snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+  else if (ns < 1000000000) snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+  else snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+  return buf;
+}
+
+std::string formatBytes(uint64_t bytes) {
+  char buf[32];
+  if (bytes < 1024) snprintf(buf, sizeof(buf), "%lluB", (unsigned long long) bytes);
+  else if (bytes < 1024 * 1024) snprintf(buf, sizeof(buf), "%.1fK", bytes / 1024.0);
+  else if (bytes < 1024L * 1024 * 1024) snprintf(buf, sizeof(buf), "%.1fM", bytes / (1024.0 * 1024));
+  else snprintf(buf, sizeof(buf), "%.1fG", bytes / (1024.0 * 1024 * 1024));
+  return buf;
+}
+
+// One row: how many, how often, and the distribution of the values.
+void printRow(const std::string &name, const Histogram &histogram, double seconds,
+	      std::string (*format)(uint64_t)) {
+  printf("%-14s %10llu %10.1f %9s %9s %9s %9s\n", name.c_str(), (unsigned long long) histogram.count,
+	 seconds > 0 ? histogram.count / seconds : 0.0, format(histogram.mean()).c_str(),
+	 format(histogram.percentile(0.5)).c_str(), format(histogram.percentile(0.99)).c_str(),
+	 format(histogram.percentile(0.999)).c_str());
+}
+
+void printHeader(const char *what) {
+  printf("%-14s %10s %10s %9s %9s %9s %9s\n", what, "count", "per sec", "mean", "p50", "p99", "p999");
+}
+
+// Prints what changed from earlier to now; earlier is empty for the totals.
+void print(const STATSres &now, const STATSres &earlier) {
+  double seconds = (now.uptime_ns() - earlier.uptime_ns()) / 1e9;
+  printf("\nServer up %.0fs, over the last %.1fs:\n", now.uptime_ns() / 1e9, seconds);
+
+  printHeader("Procedure");
+  for (int i = 0; i < now.procedures_size(); ++i) {
+    Histogram latency = toHistogram(now.procedures(i).latency_ns());
+    if (i < earlier.procedures_size()) latency = latency.since(toHistogram(earlier.procedures(i).latency_ns()));
+    if (latency.count > 0) printRow(now.procedures(i).name(), latency, seconds, formatNs);
+  }
+
+  printHeader("Disk");
+  printRow("read", toHistogram(now.disk_read_ns()).since(toHistogram(earlier.disk_read_ns())), seconds, formatNs);
+  printRow("write", toHistogram(now.disk_write_ns()).since(toHistogram(earlier.disk_write_ns())), seconds,
+	   formatNs);
+  printRow("fsync", toHistogram(now.fsync_ns()).since(toHistogram(earlier.fsync_ns())), seconds, formatNs);
+  printRow("flush size", toHistogram(now.flush_bytes()).since(toHistogram(earlier.flush_bytes())), seconds,
+	   formatBytes);
+
+  printf("Write buffer: %s in %llu files, oldest %llums, draining %s/s, %llu writes downgraded\n",
+	 formatBytes(now.queued_bytes()).c_str(), (unsigned long long) now.queued_files(),
+	 (unsigned long long) now.oldest_dirty_us() / 1000, formatBytes(now.drain_bytes_per_sec()).c_str(),
+	 (unsigned long long) (now.downgraded_writes() - earlier.downgraded_writes()));
+
+  uint64_t hits = now.cache_hits() - earlier.cache_hits();
+  uint64_t lookups = hits + now.cache_misses() - earlier.cache_misses();
+  uint64_t prefetched = now.prefetched_blocks() - earlier.prefetched_blocks();
+  printf("Block cache: %s cached, %.1f%% of %llu block reads hit, %llu blocks prefetched, %llu prefetched read\n",
+	 formatBytes(now.cached_bytes()).c_str(), lookups > 0 ? 100.0 * hits / lookups : 0.0,
+	 (unsigned long long) lookups, (unsigned long long) prefetched,
+	 (unsigned long long) (now.prefetch_hits() - earlier.prefetch_hits()));
+}
+
+void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [--server=HOST:PORT] [INTERVAL_SECONDS]\n", program);
+}
+
+int main(int argc, char** argv) {
+  std::string server = "localhost:50051";
+  static struct option long_options[] = {
+    {"server", required_argument, nullptr, 's'},
+    {nullptr, 0, nullptr, 0}
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 's': server = optarg; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  int interval = 0;
+  if (optind < argc) interval = atoi(argv[optind]);
+  if (optind + 1 < argc || interval < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::unique_ptr<NFS::Stub> stub(NFS::NewStub(grpc::CreateChannel(server, grpc::InsecureChannelCredentials())));
+  STATSres earlier;
+  while (1) {
+    ClientContext context;
+    STATSargs statsArgs;
+    STATSres statsRes;
+    Status status = stub->NFSPROC_STATS(&context, statsArgs, &statsRes);
+    if (!status.ok()) {
+      std::cerr << "STATS failed: " << status.error_message() << std::endl;
+      return 1;
+    }
+    print(statsRes, earlier);
+    fflush(stdout);
+    if (interval == 0) return 0;
+    earlier.Swap(&statsRes);
+    sleep(interval);
+  }
+}